@@ -0,0 +1,82 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+// Compares the bitmap and vector delimiter loops on RTF-like text: runs of plain text averaging a few hundred bytes between members of the RTF reader's reserved set. Each configuration is scanned with OFVectorDelimiterScanningEnabled off and then on.
+//
+// Build as a command line tool with the OmniBase and OmniFoundation sources from this tree, linking Foundation.
+//
+// Usage: DelimiterScanBenchmark [megabytes]
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniFoundation/OFByteSet.h>
+#import <OmniFoundation/OFCharacterSet.h>
+
+#include <mach/mach_time.h>
+
+RCS_ID("$Id$")
+
+static double _nanosecondsSince(uint64_t start)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+}
+
+int main(int argc, char *argv[])
+{
+    NSUInteger megabytes = 64;
+    if (argc > 1)
+        megabytes = strtoul(argv[1], NULL, 10);
+    NSUInteger length = megabytes * 1024 * 1024;
+
+    OMNI_POOL_START {
+        OFByte *bytes = malloc(length);
+        unichar *characters = malloc(length * sizeof(unichar));
+        srandom(1);
+        for (NSUInteger byteIndex = 0; byteIndex < length; byteIndex++) {
+            OFByte byte = (random() % 256 == 0) ? "\\{}\r\n"[random() % 5] : (OFByte)(' ' + random() % 90);
+            if (byte == '\\' && (random() % 8) != 0)
+                byte = 'x'; // Keep backslashes as rare as the rest of the reserved set
+            bytes[byteIndex] = byte;
+            characters[byteIndex] = byte;
+        }
+
+        OFByteSet *byteSet = [[OFByteSet alloc] init];
+        [byteSet addBytesFromString:@"\\{}\r\n" encoding:NSASCIIStringEncoding];
+        OFCharacterSet *characterSet = [[OFCharacterSet alloc] initWithString:@"\\{}\r\n"];
+
+        for (int vector = 0; vector <= 1; vector++) {
+            OFVectorDelimiterScanningEnabled = vector;
+
+            NSUInteger delimiters = 0;
+            uint64_t start = mach_absolute_time();
+            const OFByte *bytePtr = bytes, *byteEnd = bytes + length;
+            while ((bytePtr = OFByteSetFindMember(byteSet, bytePtr, byteEnd)) < byteEnd) {
+                delimiters++;
+                bytePtr++;
+            }
+            double byteNanoseconds = _nanosecondsSince(start);
+
+            start = mach_absolute_time();
+            const unichar *characterPtr = characters, *characterEnd = characters + length;
+            while ((characterPtr = OFCharacterSetFindMember(characterSet, characterPtr, characterEnd)) < characterEnd)
+                characterPtr++;
+            double characterNanoseconds = _nanosecondsSince(start);
+
+            printf("%s: delimiters=%lu bytes=%.3f ns/byte characters=%.3f ns/character\n", vector ? "vector" : "bitmap", (unsigned long)delimiters, byteNanoseconds / length, characterNanoseconds / length);
+        }
+
+        [byteSet release];
+        [characterSet release];
+        free(bytes);
+        free(characters);
+    } OMNI_POOL_END;
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+// Measures contention on OAFontDescriptor's unique table: N threads each create and release descriptors for a rotating set of families and sizes, the way concurrent RTF parses do on every style change. Fonts are never resolved, so the time is almost all uniquing. Reports total and per-descriptor time for 1 through N threads.
+//
+// Build as a command line tool with the OmniBase, OmniFoundation and OmniAppKit sources from this tree, linking Foundation and CoreText (and AppKit on the Mac).
+//
+// Usage: FontDescriptorContentionBenchmark [maximum threads] [descriptors per thread]
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniAppKit/OAFontDescriptor.h>
+
+#include <mach/mach_time.h>
+#include <pthread.h>
+
+RCS_ID("$Id$")
+
+static NSUInteger DescriptorsPerThread = 200000;
+static NSArray *FamilyNames = nil;
+
+static double _nanosecondsSince(uint64_t start)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+}
+
+static void *_createDescriptors(void *context)
+{
+    NSUInteger threadIndex = (NSUInteger)context;
+    NSUInteger familyCount = [FamilyNames count];
+
+    for (NSUInteger descriptorIndex = 0; descriptorIndex < DescriptorsPerThread; descriptorIndex += 1000) {
+        OMNI_POOL_START {
+            for (NSUInteger batchIndex = 0; batchIndex < 1000; batchIndex++) {
+                NSUInteger variant = threadIndex + descriptorIndex + batchIndex;
+                NSString *family = [FamilyNames objectAtIndex:variant % familyCount];
+                CGFloat size = 9 + (variant / familyCount) % 8;
+                OAFontDescriptor *descriptor = [[OAFontDescriptor alloc] initWithFamily:family size:size];
+                [descriptor release];
+            }
+        } OMNI_POOL_END;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    NSUInteger maximumThreads = 8;
+    if (argc > 1)
+        maximumThreads = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        DescriptorsPerThread = strtoul(argv[2], NULL, 10);
+
+    OMNI_POOL_START {
+        FamilyNames = [[NSArray alloc] initWithObjects:@"Helvetica", @"Times", @"Courier", @"Georgia", @"Verdana", @"Palatino", @"Gill Sans", @"Menlo", nil];
+
+        // Keep one of each descriptor alive, as a document would, so that the benchmark measures lookups rather than insertion and removal
+        NSMutableArray *liveDescriptors = [NSMutableArray array];
+        for (NSString *family in FamilyNames) {
+            for (CGFloat size = 9; size < 17; size++) {
+                OAFontDescriptor *descriptor = [[OAFontDescriptor alloc] initWithFamily:family size:size];
+                [liveDescriptors addObject:descriptor];
+                [descriptor release];
+            }
+        }
+
+        for (NSUInteger threadCount = 1; threadCount <= maximumThreads; threadCount *= 2) {
+            pthread_t *threads = malloc(sizeof(*threads) * threadCount);
+            uint64_t start = mach_absolute_time();
+            for (NSUInteger threadIndex = 0; threadIndex < threadCount; threadIndex++)
+                pthread_create(&threads[threadIndex], NULL, _createDescriptors, (void *)threadIndex);
+            for (NSUInteger threadIndex = 0; threadIndex < threadCount; threadIndex++)
+                pthread_join(threads[threadIndex], NULL);
+            double nanoseconds = _nanosecondsSince(start);
+            free(threads);
+
+            NSUInteger descriptorCount = threadCount * DescriptorsPerThread;
+            printf("threads=%lu descriptors=%lu total=%.1f ms %.1f ns/descriptor\n", (unsigned long)threadCount, (unsigned long)descriptorCount, nanoseconds / 1e6, nanoseconds / descriptorCount);
+        }
+
+        [FamilyNames release];
+    } OMNI_POOL_END;
+
+    return 0;
+}
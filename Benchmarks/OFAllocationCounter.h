@@ -0,0 +1,15 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSObject.h>
+
+// Counts calls into the default malloc zone (malloc, calloc, valloc, realloc and memalign), which is where both C and Objective-C allocations end up. Install once, before the work being measured; the count is process-wide, so keep other threads quiet while measuring.
+
+extern void OFAllocationCounterInstall(void);
+extern uint64_t OFAllocationCounterGetCount(void);
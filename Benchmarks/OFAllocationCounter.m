@@ -0,0 +1,85 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import "OFAllocationCounter.h"
+
+#import <malloc/malloc.h>
+#import <mach/mach.h>
+#import <libkern/OSAtomic.h>
+
+RCS_ID("$Id$")
+
+static volatile int64_t AllocationCount;
+
+static void *(*OriginalMalloc)(malloc_zone_t *zone, size_t size);
+static void *(*OriginalCalloc)(malloc_zone_t *zone, size_t count, size_t size);
+static void *(*OriginalValloc)(malloc_zone_t *zone, size_t size);
+static void *(*OriginalRealloc)(malloc_zone_t *zone, void *ptr, size_t size);
+static void *(*OriginalMemalign)(malloc_zone_t *zone, size_t alignment, size_t size);
+
+static void *_countingMalloc(malloc_zone_t *zone, size_t size)
+{
+    OSAtomicIncrement64(&AllocationCount);
+    return OriginalMalloc(zone, size);
+}
+
+static void *_countingCalloc(malloc_zone_t *zone, size_t count, size_t size)
+{
+    OSAtomicIncrement64(&AllocationCount);
+    return OriginalCalloc(zone, count, size);
+}
+
+static void *_countingValloc(malloc_zone_t *zone, size_t size)
+{
+    OSAtomicIncrement64(&AllocationCount);
+    return OriginalValloc(zone, size);
+}
+
+static void *_countingRealloc(malloc_zone_t *zone, void *ptr, size_t size)
+{
+    OSAtomicIncrement64(&AllocationCount);
+    return OriginalRealloc(zone, ptr, size);
+}
+
+static void *_countingMemalign(malloc_zone_t *zone, size_t alignment, size_t size)
+{
+    OSAtomicIncrement64(&AllocationCount);
+    return OriginalMemalign(zone, alignment, size);
+}
+
+void OFAllocationCounterInstall(void)
+{
+    static BOOL installed = NO;
+    if (installed)
+        return;
+    installed = YES;
+
+    malloc_zone_t *zone = malloc_default_zone();
+
+    // The zone structure is read-only on recent systems
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), FALSE, VM_PROT_READ | VM_PROT_WRITE);
+
+    OriginalMalloc = zone->malloc;
+    OriginalCalloc = zone->calloc;
+    OriginalValloc = zone->valloc;
+    OriginalRealloc = zone->realloc;
+    zone->malloc = _countingMalloc;
+    zone->calloc = _countingCalloc;
+    zone->valloc = _countingValloc;
+    zone->realloc = _countingRealloc;
+    if (zone->version >= 5) {
+        OriginalMemalign = zone->memalign;
+        zone->memalign = _countingMemalign;
+    }
+
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), FALSE, VM_PROT_READ);
+}
+
+uint64_t OFAllocationCounterGetCount(void)
+{
+    return (uint64_t)AllocationCount;
+}
@@ -0,0 +1,67 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+// Measures the cost of tokenizing and dispatching control words: a document that is nothing but control words (known and unknown, with and without parameters) is run through plain text extraction, and we report time and heap allocations per control word. The latter should be zero, give or take the occasional growth of the output buffer.
+//
+// Build as a command line tool with the OmniBase, OmniFoundation, OmniAppKit and OmniUI sources from this tree plus OFAllocationCounter.m, linking Foundation and CoreText.
+//
+// Usage: RTFControlWordBenchmark [repetitions]
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniUI/OUIRTFReader.h>
+
+#import "OFAllocationCounter.h"
+
+#include <mach/mach_time.h>
+
+RCS_ID("$Id$")
+
+// Sixteen control words per repetition
+static const char *ControlWordRun = "\\b\\i\\ul\\fs24\\cf0\\qc\\li720\\fi-360\\ri0\\plain\\b0\\i0\\ulnone\\nosupersub\\expndtw-2147483649\\par ";
+#define ControlWordsPerRun (16)
+
+int main(int argc, char *argv[])
+{
+    NSUInteger repetitions = 200000;
+    if (argc > 1)
+        repetitions = strtoul(argv[1], NULL, 10);
+
+    OMNI_POOL_START {
+        NSMutableData *rtfData = [NSMutableData data];
+        const char *header = "{\\rtf1\\ansi\\deff0 ";
+        [rtfData appendBytes:header length:strlen(header)];
+        size_t runLength = strlen(ControlWordRun);
+        for (NSUInteger repetition = 0; repetition < repetitions; repetition++)
+            [rtfData appendBytes:ControlWordRun length:runLength];
+        [rtfData appendBytes:"}" length:1];
+
+        // Warm up, so class initialization and the keyword table don't count
+        [OUIRTFReader plainTextFromRTFString:@"{\\rtf1 \\b warm\\par}"];
+
+        OFAllocationCounterInstall();
+
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+
+        uint64_t allocationsBefore = OFAllocationCounterGetCount();
+        uint64_t start = mach_absolute_time();
+        NSString *text = [OUIRTFReader plainTextFromRTFData:rtfData];
+        uint64_t elapsed = mach_absolute_time() - start;
+        uint64_t allocations = OFAllocationCounterGetCount() - allocationsBefore;
+
+        double nanoseconds = (double)elapsed * timebase.numer / timebase.denom;
+        double controlWords = (double)repetitions * ControlWordsPerRun;
+        printf("control words: %.0f\n", controlWords);
+        printf("output characters: %lu\n", (unsigned long)[text length]);
+        printf("ns/control word: %.2f\n", nanoseconds / controlWords);
+        printf("allocations: %llu\n", (unsigned long long)allocations);
+        printf("allocations/control word: %.6f\n", allocations / controlWords);
+    } OMNI_POOL_END;
+
+    return 0;
+}
@@ -0,0 +1,368 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+// The reader's benchmark suite. Each scenario generates a synthetic document that stresses one part of the reader (deep nesting, huge font and color tables, dense \u escapes, DBCS \'xx runs, \pict hex blobs, paragraph-heavy text) from a fixed seed, so every run and every build parses the same bytes. Each scenario is parsed both as plain text and as an attributed string, and reports the best ns/byte over several iterations, heap allocations per KB of input, and peak resident size.
+// Every scenario and mode runs in a fresh child process so that peak RSS is its own and not the high-water mark of everything before it. Results are printed one JSON object per line, for diffing between builds.
+//
+// Build as a command line tool with the OmniBase, OmniFoundation, OmniAppKit and OmniUI sources from this tree plus OFAllocationCounter.m, linking Foundation and CoreText.
+//
+// Usage: RTFReaderBenchmark [--size bytes] [--iterations count] [--scenario name --mode plain|attributed] [--generate directory]
+//   With no --scenario, runs every scenario in both modes. --generate writes the corpus as .rtf files (for rtf2txt, say) instead of measuring.
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniUI/OUIRTFReader.h>
+
+#import "OFAllocationCounter.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <mach/mach_time.h>
+#include <mach-o/dyld.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+RCS_ID("$Id$")
+
+extern char **environ;
+
+#pragma mark -
+#pragma mark Corpus generation
+
+// A tiny LCG, so the corpus doesn't depend on the platform's random()
+static uint32_t _nextRandom(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static void _append(NSMutableData *rtf, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void _append(NSMutableData *rtf, const char *format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    OBASSERT(length >= 0 && (size_t)length < sizeof(buffer));
+    [rtf appendBytes:buffer length:(NSUInteger)length];
+}
+
+static void _appendWords(NSMutableData *rtf, NSUInteger wordCount, uint32_t *seed)
+{
+    static const char *Words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"};
+    while (wordCount--)
+        _append(rtf, "%s ", Words[_nextRandom(seed) % (sizeof(Words) / sizeof(*Words))]);
+}
+
+static void _appendHeader(NSMutableData *rtf)
+{
+    _append(rtf, "{\\rtf1\\ansi\\ansicpg1252\\deff0{\\fonttbl{\\f0\\fswiss\\fcharset0 Helvetica;}}{\\colortbl;\\red0\\green0\\blue0;}\n");
+}
+
+static void _generateNesting(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    _appendHeader(rtf);
+    static const char *Toggles[] = {"\\b", "\\i", "\\ul", "\\fs28", "\\cf1", "\\super", "\\*\\unknowndest", "\\plain"};
+    while ([rtf length] < size) {
+        NSUInteger depth = 64 + _nextRandom(seed) % 192;
+        for (NSUInteger level = 0; level < depth; level++)
+            _append(rtf, "{%s ", Toggles[_nextRandom(seed) % (sizeof(Toggles) / sizeof(*Toggles))]);
+        _appendWords(rtf, 4, seed);
+        for (NSUInteger level = 0; level < depth; level++)
+            [rtf appendBytes:"}" length:1];
+        _append(rtf, "\\par\n");
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generateFontTable(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    static const char *Families[] = {"\\froman", "\\fswiss", "\\fmodern", "\\fnil"};
+    NSUInteger fontCount = MAX(16U, size / 64);
+    _append(rtf, "{\\rtf1\\ansi\\deff0{\\fonttbl");
+    for (NSUInteger fontIndex = 0; fontIndex < fontCount; fontIndex++)
+        _append(rtf, "{\\f%lu%s\\fcharset0 Synthetic Font %lu;}", (unsigned long)fontIndex, Families[_nextRandom(seed) % 4], (unsigned long)fontIndex);
+    _append(rtf, "}\n");
+    while ([rtf length] < size) {
+        _append(rtf, "\\f%lu ", (unsigned long)(_nextRandom(seed) % fontCount));
+        _appendWords(rtf, 6, seed);
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generateColorTable(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    NSUInteger colorCount = MAX(16U, size / 64);
+    _append(rtf, "{\\rtf1\\ansi\\deff0{\\fonttbl{\\f0 Helvetica;}}{\\colortbl;");
+    for (NSUInteger colorIndex = 1; colorIndex < colorCount; colorIndex++)
+        _append(rtf, "\\red%u\\green%u\\blue%u;", _nextRandom(seed) % 256, _nextRandom(seed) % 256, _nextRandom(seed) % 256);
+    _append(rtf, "}\n");
+    while ([rtf length] < size) {
+        _append(rtf, "\\cf%lu\\cb%lu ", (unsigned long)(_nextRandom(seed) % colorCount), (unsigned long)(_nextRandom(seed) % colorCount));
+        _appendWords(rtf, 6, seed);
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generateUnicode(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    _appendHeader(rtf);
+    while ([rtf length] < size) {
+        // Alternate skip counts, including negative parameters for characters above U+7FFF and surrogate pairs
+        unsigned skip = _nextRandom(seed) % 3;
+        _append(rtf, "{\\uc%u ", skip);
+        for (NSUInteger characterIndex = 0; characterIndex < 32; characterIndex++) {
+            // From U+0400 up, leaving out the surrogates so that every one is a real character
+            int character = (int)(0x400 + _nextRandom(seed) % (0x10000 - 0x400 - 0x800));
+            if (character >= 0xD800)
+                character += 0x800;
+            if (character > 0x7FFF)
+                character -= 0x10000;
+            _append(rtf, "\\u%d", character);
+            for (unsigned skipIndex = 0; skipIndex < skip; skipIndex++)
+                [rtf appendBytes:"?" length:1];
+        }
+        // U+1F60A as a surrogate pair; each half has its own fallback, as writers emit them
+        static const int SurrogatePair[] = {-10179, -8694};
+        for (unsigned halfIndex = 0; halfIndex < 2; halfIndex++) {
+            _append(rtf, "\\u%d", SurrogatePair[halfIndex]);
+            for (unsigned skipIndex = 0; skipIndex < skip; skipIndex++)
+                [rtf appendBytes:"?" length:1];
+        }
+        _append(rtf, "}\\par\n");
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generateDBCS(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    _append(rtf, "{\\rtf1\\ansi\\ansicpg932\\deff0{\\fonttbl{\\f0\\fswiss\\fcharset0 Helvetica;}{\\f1\\fnil\\fcharset128 MS-Gothic;}{\\f2\\fnil\\fcharset134 SimSun;}}\n");
+    while ([rtf length] < size) {
+        BOOL shiftJIS = (_nextRandom(seed) % 2) == 0;
+        _append(rtf, "{\\f%d ", shiftJIS ? 1 : 2);
+        for (NSUInteger characterIndex = 0; characterIndex < 64; characterIndex++) {
+            if (shiftJIS)
+                _append(rtf, "\\'82\\'%02x", 0x9F + _nextRandom(seed) % 0x52); // Hiragana
+            else
+                _append(rtf, "\\'%02x\\'%02x", 0xB0 + _nextRandom(seed) % 0x27, 0xA1 + _nextRandom(seed) % 0x5E);
+        }
+        _append(rtf, "}\\par\n");
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generatePict(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    static const char HexDigits[] = "0123456789abcdef";
+    _appendHeader(rtf);
+    while ([rtf length] < size) {
+        _appendWords(rtf, 20, seed);
+        _append(rtf, "{\\*\\shppict{\\pict\\pngblip\\picw640\\pich480\n");
+        NSUInteger blobLength = 16 * 1024 + _nextRandom(seed) % (112 * 1024);
+        for (NSUInteger byteIndex = 0; byteIndex < blobLength; byteIndex++) {
+            uint32_t random = _nextRandom(seed);
+            char hex[2] = {HexDigits[random & 0xF], HexDigits[(random >> 4) & 0xF]};
+            [rtf appendBytes:hex length:2];
+            if (byteIndex % 64 == 63)
+                [rtf appendBytes:"\n" length:1];
+        }
+        _append(rtf, "}}{\\nonshppict{\\pict\\wmetafile8 0100090000}}\\par\n");
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+static void _generateParagraphs(NSMutableData *rtf, NSUInteger size, uint32_t *seed)
+{
+    static const char *Alignments[] = {"\\ql", "\\qc", "\\qr", "\\qj"};
+    _appendHeader(rtf);
+    while ([rtf length] < size) {
+        _append(rtf, "\\pard%s\\li%u\\fi-%u\\ri%u ", Alignments[_nextRandom(seed) % 4], 360 * (_nextRandom(seed) % 4), 180 * (_nextRandom(seed) % 3), 120 * (_nextRandom(seed) % 2));
+        _appendWords(rtf, 3 + _nextRandom(seed) % 40, seed);
+        _append(rtf, "\\par\n");
+    }
+    [rtf appendBytes:"}" length:1];
+}
+
+typedef struct {
+    const char *name;
+    void (*generate)(NSMutableData *rtf, NSUInteger size, uint32_t *seed);
+} Scenario;
+
+static const Scenario Scenarios[] = {
+    {"nesting", _generateNesting},
+    {"fonttbl", _generateFontTable},
+    {"colortbl", _generateColorTable},
+    {"unicode", _generateUnicode},
+    {"dbcs", _generateDBCS},
+    {"pict", _generatePict},
+    {"paragraphs", _generateParagraphs},
+};
+#define ScenarioCount (sizeof(Scenarios) / sizeof(*Scenarios))
+
+static NSData *_newScenarioData(const Scenario *scenario, NSUInteger size)
+{
+    NSMutableData *rtf = [[NSMutableData alloc] initWithCapacity:size + 1024];
+    uint32_t seed = 20120101u; // Same for every scenario and every run
+    scenario->generate(rtf, size, &seed);
+    return rtf;
+}
+
+#pragma mark -
+#pragma mark Measurement
+
+static void _measureScenario(const Scenario *scenario, BOOL plainTextOnly, NSUInteger size, NSUInteger iterations)
+{
+    NSData *rtfData = _newScenarioData(scenario, size);
+    NSUInteger byteCount = [rtfData length];
+
+    // Warm up, so class initialization, the keyword table and the font cache don't count
+    OMNI_POOL_START {
+        if (plainTextOnly)
+            [OUIRTFReader plainTextFromRTFData:rtfData];
+        else
+            [OUIRTFReader parseRTFData:rtfData];
+    } OMNI_POOL_END;
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+
+    OFAllocationCounterInstall();
+    double bestNanoseconds = 0;
+    uint64_t allocations = 0;
+    for (NSUInteger iteration = 0; iteration < iterations; iteration++) {
+        uint64_t allocationsBefore = OFAllocationCounterGetCount();
+        uint64_t start = mach_absolute_time();
+        OMNI_POOL_START {
+            if (plainTextOnly)
+                [OUIRTFReader plainTextFromRTFData:rtfData];
+            else
+                [OUIRTFReader parseRTFData:rtfData];
+        } OMNI_POOL_END;
+        double nanoseconds = (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+        if (iteration == 0) {
+            allocations = OFAllocationCounterGetCount() - allocationsBefore;
+            bestNanoseconds = nanoseconds;
+        } else
+            bestNanoseconds = MIN(bestNanoseconds, nanoseconds);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"bytes\":%lu,\"iterations\":%lu,\"ns_per_byte\":%.3f,\"allocations_per_kb\":%.3f,\"peak_rss_bytes\":%ld}\n",
+        scenario->name, plainTextOnly ? "plain" : "attributed", (unsigned long)byteCount, (unsigned long)iterations,
+        bestNanoseconds / byteCount, allocations / (byteCount / 1024.0), (long)usage.ru_maxrss); // ru_maxrss is in bytes on Darwin; it includes the input itself
+    fflush(stdout);
+
+    [rtfData release];
+}
+
+static int _runScenarioInChildProcess(const char *scenarioName, const char *mode, NSUInteger size, NSUInteger iterations)
+{
+    char executablePath[PATH_MAX];
+    uint32_t pathSize = sizeof(executablePath);
+    if (_NSGetExecutablePath(executablePath, &pathSize) != 0)
+        return -1;
+
+    char sizeArgument[32], iterationsArgument[32];
+    snprintf(sizeArgument, sizeof(sizeArgument), "%lu", (unsigned long)size);
+    snprintf(iterationsArgument, sizeof(iterationsArgument), "%lu", (unsigned long)iterations);
+    char *childArguments[] = {executablePath, "--size", sizeArgument, "--iterations", iterationsArgument, "--scenario", (char *)scenarioName, "--mode", (char *)mode, NULL};
+
+    pid_t child;
+    if (posix_spawn(&child, executablePath, NULL, NULL, childArguments, environ) != 0)
+        return -1;
+    int status;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void _usage(const char *toolName)
+{
+    fprintf(stderr, "usage: %s [--size bytes] [--iterations count] [--scenario name --mode plain|attributed] [--generate directory]\n", toolName);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    NSUInteger size = 4 * 1024 * 1024;
+    NSUInteger iterations = 5;
+    const char *scenarioName = NULL;
+    const char *mode = NULL;
+    const char *generateDirectory = NULL;
+
+    for (int argumentIndex = 1; argumentIndex < argc; argumentIndex++) {
+        const char *argument = argv[argumentIndex];
+        if (argumentIndex + 1 >= argc)
+            _usage(argv[0]);
+        const char *value = argv[++argumentIndex];
+        if (strcmp(argument, "--size") == 0)
+            size = strtoul(value, NULL, 10);
+        else if (strcmp(argument, "--iterations") == 0)
+            iterations = MAX(1U, strtoul(value, NULL, 10));
+        else if (strcmp(argument, "--scenario") == 0)
+            scenarioName = value;
+        else if (strcmp(argument, "--mode") == 0)
+            mode = value;
+        else if (strcmp(argument, "--generate") == 0)
+            generateDirectory = value;
+        else
+            _usage(argv[0]);
+    }
+
+    int status = 0;
+    OMNI_POOL_START {
+        if (generateDirectory != NULL) {
+            NSString *directory = [NSString stringWithUTF8String:generateDirectory];
+            [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:NULL];
+            for (NSUInteger scenarioIndex = 0; scenarioIndex < ScenarioCount; scenarioIndex++) {
+                NSData *rtfData = _newScenarioData(&Scenarios[scenarioIndex], size);
+                NSString *path = [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%s.rtf", Scenarios[scenarioIndex].name]];
+                if (![rtfData writeToFile:path atomically:YES]) {
+                    fprintf(stderr, "Unable to write %s\n", [path fileSystemRepresentation]);
+                    status = 1;
+                }
+                [rtfData release];
+            }
+        } else if (scenarioName != NULL) {
+            BOOL plainTextOnly;
+            if (mode != NULL && strcmp(mode, "plain") == 0)
+                plainTextOnly = YES;
+            else if (mode != NULL && strcmp(mode, "attributed") == 0)
+                plainTextOnly = NO;
+            else
+                _usage(argv[0]);
+
+            const Scenario *scenario = NULL;
+            for (NSUInteger scenarioIndex = 0; scenarioIndex < ScenarioCount; scenarioIndex++) {
+                if (strcmp(Scenarios[scenarioIndex].name, scenarioName) == 0)
+                    scenario = &Scenarios[scenarioIndex];
+            }
+            if (scenario == NULL) {
+                fprintf(stderr, "Unknown scenario %s\n", scenarioName);
+                status = 1;
+            } else
+                _measureScenario(scenario, plainTextOnly, size, iterations);
+        } else {
+            for (NSUInteger scenarioIndex = 0; scenarioIndex < ScenarioCount; scenarioIndex++) {
+                if (_runScenarioInChildProcess(Scenarios[scenarioIndex].name, "plain", size, iterations) != 0 ||
+                    _runScenarioInChildProcess(Scenarios[scenarioIndex].name, "attributed", size, iterations) != 0) {
+                    fprintf(stderr, "Scenario %s failed\n", Scenarios[scenarioIndex].name);
+                    status = 1;
+                }
+            }
+        }
+    } OMNI_POOL_END;
+
+    return status;
+}
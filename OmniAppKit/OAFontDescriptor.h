@@ -35,6 +35,7 @@ extern OFExtent OAFontDescriptorValidFontWeightExtent(void);
     NSDictionary *_attributes;
     CTFontDescriptorRef _fontDescriptor;
     OAFontDescriptorPlatformFont _font;
+    NSUInteger _hash;
     BOOL _isUniquedInstance;
 }
 
@@ -17,9 +17,39 @@
 RCS_ID("$Id$");
 
 //#define FONT_DESC_STATS
-static NSMutableSet *_OAFontDescriptorUniqueTable = nil;
-static NSLock *_OAFontDescriptorUniqueTableLock = nil;
-static NSMutableArray *_OAFontDescriptorRecentInstances = nil;
+
+// The unique table is split into shards by hash, each with its own lock, so that threads creating descriptors for different fonts don't contend. A given set of attributes always hashes to the same shard, so uniquing works just as it would with one table.
+#define OAFontDescriptorUniqueTableShardCount (16) // Must be a power of two
+
+typedef struct {
+    NSLock *lock;
+    NSMutableSet *table;
+    NSMutableArray *recentInstances;
+} OAFontDescriptorUniqueTableShard;
+
+static OAFontDescriptorUniqueTableShard _OAFontDescriptorUniqueTableShards[OAFontDescriptorUniqueTableShardCount];
+
+static inline OAFontDescriptorUniqueTableShard *_OAFontDescriptorShardForHash(NSUInteger hash)
+{
+    // The low bits of our hash are the least mixed
+    uint32_t mixed = (uint32_t)(hash ^ (hash >> 16));
+    mixed *= 0x45d9f3bu;
+    mixed ^= mixed >> 16;
+    return &_OAFontDescriptorUniqueTableShards[mixed & (OAFontDescriptorUniqueTableShardCount - 1)];
+}
+
+// NSDictionary's -hash is just its count, which would put nearly every descriptor in the same shard (and the same bucket of its set), so we mix in the attributes that usually tell fonts apart.
+static NSUInteger _OAFontDescriptorAttributesHash(NSDictionary *attributes)
+{
+    NSUInteger hash = [attributes count];
+    hash = 31 * hash + [[attributes objectForKey:(id)kCTFontFamilyNameAttribute] hash];
+    hash = 31 * hash + [[attributes objectForKey:(id)kCTFontNameAttribute] hash];
+    hash = 31 * hash + [[attributes objectForKey:(id)kCTFontSizeAttribute] hash];
+    id traits = [attributes objectForKey:(id)kCTFontTraitsAttribute];
+    if ([traits isKindOfClass:[NSDictionary class]])
+        hash = 31 * hash + [[traits objectForKey:(id)kCTFontSymbolicTrait] hash];
+    return hash;
+}
 
 @interface OAFontDescriptor (/*Private*/)
 - (void)_invalidateCachedFont;
@@ -35,37 +65,47 @@ static NSMutableArray *_OAFontDescriptorRecentInstances = nil;
     CFSetCallBacks callbacks = OFNSObjectSetCallbacks;
     callbacks.retain  = NULL;
     callbacks.release = NULL;
-    _OAFontDescriptorUniqueTable = (NSMutableSet *)CFSetCreateMutable(kCFAllocatorDefault, 0, &callbacks);
-    _OAFontDescriptorUniqueTableLock = [[NSLock alloc] init];
-    
-    // Keep recently created/in-use instances alive until the next call to +forgetUnusedInstances. We could have a timer running to do this periodically, but we also want to do it in response to memory warnings in UIKit and we don't really want a timer waking up every N seconds when there is nothing to do. Hopefully we'll get a memory warning point to hook into on the Mac or we can add a timer there if we need it (or we could call it when a document is closed).
-    _OAFontDescriptorRecentInstances = [[NSMutableArray alloc] init];
+    for (NSUInteger shardIndex = 0; shardIndex < OAFontDescriptorUniqueTableShardCount; shardIndex++) {
+        OAFontDescriptorUniqueTableShard *shard = &_OAFontDescriptorUniqueTableShards[shardIndex];
+        shard->table = (NSMutableSet *)CFSetCreateMutable(kCFAllocatorDefault, 0, &callbacks);
+        shard->lock = [[NSLock alloc] init];
+
+        // Keep recently created/in-use instances alive until the next call to +forgetUnusedInstances. We could have a timer running to do this periodically, but we also want to do it in response to memory warnings in UIKit and we don't really want a timer waking up every N seconds when there is nothing to do. Hopefully we'll get a memory warning point to hook into on the Mac or we can add a timer there if we need it (or we could call it when a document is closed).
+        shard->recentInstances = [[NSMutableArray alloc] init];
+    }
 }
 
 + (void)forgetUnusedInstances;
 {
-    NSArray *oldInstances = nil;
-    
-    [_OAFontDescriptorUniqueTableLock lock];
-    oldInstances = _OAFontDescriptorRecentInstances;
-    _OAFontDescriptorRecentInstances = nil;
-    [_OAFontDescriptorUniqueTableLock unlock];
-    
-    [oldInstances release]; // -dealloc will clean out the otherwise unused instances
-    
-    [_OAFontDescriptorUniqueTableLock lock];
-    if (_OAFontDescriptorRecentInstances == nil) // another thread called this?
-        _OAFontDescriptorRecentInstances = [[NSMutableArray alloc] initWithArray:[_OAFontDescriptorUniqueTable allObjects]];
-    [_OAFontDescriptorUniqueTableLock unlock];
+    for (NSUInteger shardIndex = 0; shardIndex < OAFontDescriptorUniqueTableShardCount; shardIndex++) {
+        OAFontDescriptorUniqueTableShard *shard = &_OAFontDescriptorUniqueTableShards[shardIndex];
+        NSArray *oldInstances = nil;
+
+        [shard->lock lock];
+        oldInstances = shard->recentInstances;
+        shard->recentInstances = nil;
+        [shard->lock unlock];
+
+        [oldInstances release]; // -dealloc will clean out the otherwise unused instances (taking this shard's lock, so we mustn't hold it here)
+
+        [shard->lock lock];
+        if (shard->recentInstances == nil) // another thread called this?
+            shard->recentInstances = [[NSMutableArray alloc] initWithArray:[shard->table allObjects]];
+        [shard->lock unlock];
+    }
 }
 
 // This is currently called by the NSNotificationCenter hacks in OmniOutliner.  Horrifying; maybe those hacks should move here, but better yet would be if we didn't need them.
 + (void)fontSetWillChangeNotification:(NSNotification *)note;
 {
     // Invalidate the cached fonts in all our font descriptors.  The various live text storages are about to get a -fixFontAttributeInRange: due to this notification (this gets called specially first so that all the font descriptors are primed to recache the right fonts).
-    [_OAFontDescriptorUniqueTableLock lock];
-    NSArray *allFontDescriptors = [_OAFontDescriptorUniqueTable allObjects];
-    [_OAFontDescriptorUniqueTableLock unlock];
+    NSMutableArray *allFontDescriptors = [NSMutableArray array];
+    for (NSUInteger shardIndex = 0; shardIndex < OAFontDescriptorUniqueTableShardCount; shardIndex++) {
+        OAFontDescriptorUniqueTableShard *shard = &_OAFontDescriptorUniqueTableShards[shardIndex];
+        [shard->lock lock];
+        [allFontDescriptors addObjectsFromArray:[shard->table allObjects]];
+        [shard->lock unlock];
+    }
     [allFontDescriptors makeObjectsPerformSelector:@selector(_invalidateCachedFont)];
 }
 
@@ -106,17 +146,19 @@ static NSInteger _weightToFontManagerWeight(CGFloat weight)
         return nil;
     
     _attributes = [fontAttributes copy];
+    _hash = _OAFontDescriptorAttributesHash(_attributes);
     
-    [_OAFontDescriptorUniqueTableLock lock];
-    OAFontDescriptor *uniquedInstance = [[_OAFontDescriptorUniqueTable member:self] retain];
+    OAFontDescriptorUniqueTableShard *shard = _OAFontDescriptorShardForHash(_hash);
+    [shard->lock lock];
+    OAFontDescriptor *uniquedInstance = [[shard->table member:self] retain];
     if (uniquedInstance == nil) {
-        [_OAFontDescriptorUniqueTable addObject:self];
-        [_OAFontDescriptorRecentInstances addObject:self];
+        [shard->table addObject:self];
+        [shard->recentInstances addObject:self];
 #if defined(FONT_DESC_STATS)
-        NSLog(@"%lu font descriptors ++ added %@", [_OAFontDescriptorUniqueTable count], self);
+        NSLog(@"%lu font descriptors in shard %td ++ added %@", [shard->table count], shard - _OAFontDescriptorUniqueTableShards, self);
 #endif
     }
-    [_OAFontDescriptorUniqueTableLock unlock];
+    [shard->lock unlock];
 
     if (uniquedInstance) {
         [self release];
@@ -228,13 +270,14 @@ static NSInteger _weightToFontManagerWeight(CGFloat weight)
 - (void)dealloc;
 {
     if (_isUniquedInstance) {
-        [_OAFontDescriptorUniqueTableLock lock];
-        OBASSERT([_OAFontDescriptorUniqueTable member:self] == self);
-        [_OAFontDescriptorUniqueTable removeObject:self];
+        OAFontDescriptorUniqueTableShard *shard = _OAFontDescriptorShardForHash(_hash);
+        [shard->lock lock];
+        OBASSERT([shard->table member:self] == self);
+        [shard->table removeObject:self];
 #if defined(FONT_DESC_STATS)
-        NSLog(@"%lu font descriptors -- removed %p", [_OAFontDescriptorUniqueTable count], self);
+        NSLog(@"%lu font descriptors in shard %td -- removed %p", [shard->table count], shard - _OAFontDescriptorUniqueTableShards, self);
 #endif
-        [_OAFontDescriptorUniqueTableLock unlock];
+        [shard->lock unlock];
     }
 #if defined(TARGET_OS_IPHONE) && TARGET_OS_IPHONE
     if (_font)
@@ -641,7 +684,7 @@ static OAFontDescriptor *_newWithFontDescriptorHavingTrait(OAFontDescriptor *sel
 
 - (NSUInteger)hash;
 {
-    return [_attributes hash];
+    return _hash;
 }
 
 - (BOOL)isEqual:(id)otherObject;
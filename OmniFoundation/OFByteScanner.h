@@ -0,0 +1,284 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSObject.h>
+
+#import <CoreFoundation/CFString.h> // For CFStringEncoding
+#import <OmniBase/OBObject.h> // For -debugDictionary
+#import <OmniFoundation/OFByte.h>
+#import <OmniFoundation/OFByteSet.h>
+#import <OmniFoundation/OFCharacterScanner.h> // For OFMaximumRewindMarks
+
+@class NSString;
+
+/*
+ OFByteScanner is the byte-oriented twin of OFCharacterScanner. It is meant for formats that are defined in terms of 7-bit ASCII (RTF, for example), where widening every input byte to a unichar before looking at it would double the memory traffic of the scan. Bytes are only turned into strings when asked for, using whatever encoding the caller knows applies to them.
+ The buffer and refill contract match OFCharacterScanner's: subclasses implement -fetchMoreData in terms of -fetchMoreDataFromBytes:length:offset:freeWhenDone:, and may point inputBuffer at memory they don't own by passing freeWhenDone:NO.
+*/
+
+@interface OFByteScanner : NSObject
+{
+    NSUInteger rewindMarkOffsets[OFMaximumRewindMarks]; // rewindMarkOffsets[0] is always the earliest mark, by definition
+    unsigned short rewindMarkCount;
+
+@public
+    const OFByte *inputBuffer;	// A buffer of bytes, in which we are scanning
+    const OFByte *scanLocation;	// Pointer to next byte
+    const OFByte *scanEnd;	// Pointer to position after end of valid bytes
+    NSUInteger inputBufferPosition;	// This is the position (in the notional input stream) of the first byte in inputBuffer
+    BOOL freeInputBuffer;	// Whether we should deallocate inputBuffer when we're done with it
+}
+
+- init;
+    // Designated initializer
+
+/* Implemented by subclasses */
+- (BOOL)fetchMoreData;
+- (void)_rewindByteSource;
+
+/* As with OFCharacterScanner: -fetchMoreData should make scanLocation point to a valid byte without changing the value of (scanLocation - inputBuffer + inputBufferPosition), returning NO at EOF. -_rewindByteSource is called when the next -fetchMoreData must supply something other than the bytes immediately following the previous buffer; the default raises. */
+
+/* Used by subclasses to implement the above */
+- (BOOL)fetchMoreDataFromBytes:(const OFByte *)bytes length:(NSUInteger)length offset:(NSUInteger)offset freeWhenDone:(BOOL)doFreeWhenDone;
+- (NSUInteger)prepareWindow:(OFByte **)ioWindow capacity:(NSUInteger *)ioCapacity minimumFreeSpace:(NSUInteger)minimumFreeSpace keepPosition:(NSUInteger *)outKeepPosition;
+    // For subclasses that refill a window they own: moves whatever must survive the refill (everything from the earliest rewind mark, or else from the scan location) to the start of the window, growing it if that would leave less than minimumFreeSpace. Returns the number of bytes kept; new bytes go after them, and the whole window is then passed to -fetchMoreDataFromBytes:... with offset *outKeepPosition.
+
+- (OFByte)peekByte;
+- (void)skipPeekedByte;
+- (OFByte)readByte;
+
+- (void)setRewindMark;
+- (void)rewindToMark;
+- (void)discardRewindMark;
+
+- (NSUInteger)scanLocation;
+- (void)setScanLocation:(NSUInteger)aLocation;
+- (void)skipBytes:(NSUInteger)anOffset;
+
+- (BOOL)scanUpToByte:(OFByte)aByte;
+
+// As with OFCharacterScanner, these return nil for a zero-length token. The bytes are interpreted using the given encoding; if they aren't valid in it, the token is consumed and nil is returned.
+- (NSString *)readTokenFragmentWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+- (NSString *)readFullTokenWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+// Like -readTokenFragmentWithDelimiterOFByteSet:encoding:, but bytes that aren't valid in the encoding don't cost the whole token: each malformed UTF-8 sequence becomes U+FFFD, and a token that isn't valid in any other encoding is read as ISO Latin 1 instead.
+- (NSString *)readLossyTokenFragmentWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+
+- (NSUInteger)_finishTokenStartingAt:(const OFByte *)tokenStart delimiterOFByteSet:(OFByteSet *)delimiterOFByteSet spanBuffer:(OFByte *)spanBuffer spanBufferLength:(NSUInteger)spanBufferLength;
+    // The slow path of byteScannerReadTokenWithDelimiterOFByteSet(), for tokens that run off the end of the buffer
+
+- (unsigned int)scanHexadecimalNumberMaximumDigits:(unsigned int)maximumDigits;
+- (unsigned int)scanUnsignedIntegerMaximumDigits:(unsigned int)maximumDigits;
+- (BOOL)scanBytes:(const void *)bytes length:(NSUInteger)length peek:(BOOL)doPeek;
+
+@end
+
+#import <OmniBase/assertions.h> // For OBPRECONDITION
+
+// Here's a list of the inline functions:
+//
+//	BOOL byteScannerHasData(OFByteScanner *scanner);
+//	NSUInteger byteScannerScanLocation(OFByteScanner *scanner);
+//	OFByte byteScannerPeekByte(OFByteScanner *scanner);
+//	void byteScannerSkipPeekedByte(OFByteScanner *scanner);
+//	OFByte byteScannerReadByte(OFByteScanner *scanner);
+//	BOOL byteScannerScanUpToByte(OFByteScanner *scanner, OFByte scanByte);
+//	BOOL byteScannerScanUpToByteInOFByteSet(OFByteScanner *scanner, OFByteSet *delimiterBitmapRep);
+//	BOOL byteScannerScanUpToByteNotInOFByteSet(OFByteScanner *scanner, OFByteSet *memberBitmapRep);
+//	BOOL byteScannerPeekBytes(OFByteScanner *scanner, const char *bytes);
+//	BOOL byteScannerReadBytes(OFByteScanner *scanner, const char *bytes);
+//	NSUInteger byteScannerReadTokenWithDelimiterOFByteSet(OFByteScanner *scanner, OFByteSet *delimiterOFByteSet, const OFByte **outToken, OFByte *spanBuffer, NSUInteger spanBufferLength);
+//	unsigned int byteScannerScanHexadecimalNumber(OFByteScanner *scanner, unsigned int maximumDigits);
+//	int byteScannerScanClampedSignedInteger(OFByteScanner *scanner, int minimumValue, int maximumValue);
+//	NSUInteger byteScannerSkipBytes(OFByteScanner *scanner, NSUInteger length);
+//
+
+extern const OFByte OFByteScannerEndOfDataByte;
+    // This byte is returned when a scanner is asked for a byte past the end of its input. Like OFCharacterScannerEndOfDataCharacter, it is currently '\0'.
+
+static inline BOOL
+byteScannerHasData(OFByteScanner *scanner)
+{
+    return scanner->scanLocation < scanner->scanEnd || [scanner fetchMoreData];
+}
+
+static inline NSUInteger
+byteScannerScanLocation(OFByteScanner *scanner)
+{
+    if (!byteScannerHasData(scanner)) {
+        // Don't return an offset which is longer than our input.
+        scanner->scanLocation = scanner->scanEnd;
+    }
+    return scanner->inputBufferPosition + (scanner->scanLocation - scanner->inputBuffer);
+}
+
+static inline OFByte
+byteScannerPeekByte(OFByteScanner *scanner)
+{
+    if (!byteScannerHasData(scanner))
+        return OFByteScannerEndOfDataByte;
+    return *scanner->scanLocation;
+}
+
+static inline void
+byteScannerSkipPeekedByte(OFByteScanner *scanner)
+{
+    // NOTE: It's OK for scanLocation to go past scanEnd
+    scanner->scanLocation++;
+}
+
+static inline OFByte
+byteScannerReadByte(OFByteScanner *scanner)
+{
+    OFByte byte;
+
+    if (!byteScannerHasData(scanner))
+        return OFByteScannerEndOfDataByte;
+    byte = *scanner->scanLocation;
+    byteScannerSkipPeekedByte(scanner);
+    return byte;
+}
+
+static inline BOOL
+byteScannerScanUpToByte(OFByteScanner *scanner, OFByte scanByte)
+{
+    while (byteScannerHasData(scanner)) {
+        while (scanner->scanLocation < scanner->scanEnd) {
+            if (*scanner->scanLocation == scanByte)
+                return YES;
+            scanner->scanLocation++;
+        }
+    }
+    return NO;
+}
+
+static inline BOOL
+byteScannerScanUpToByteInOFByteSet(OFByteScanner *scanner, OFByteSet *delimiterBitmapRep)
+{
+    while (byteScannerHasData(scanner)) {
+        scanner->scanLocation = OFByteSetFindMember(delimiterBitmapRep, scanner->scanLocation, scanner->scanEnd);
+        if (scanner->scanLocation < scanner->scanEnd)
+            return YES;
+    }
+    return NO;
+}
+
+static inline BOOL
+byteScannerScanUpToByteNotInOFByteSet(OFByteScanner *scanner, OFByteSet *memberBitmapRep)
+{
+    while (byteScannerHasData(scanner)) {
+        while (scanner->scanLocation < scanner->scanEnd) {
+            if (!isByteInByteSet(*scanner->scanLocation, memberBitmapRep))
+                return YES;
+            scanner->scanLocation++;
+        }
+    }
+    return NO;
+}
+
+// Unlike -skipBytes:, this refills as it goes rather than seeking, so it works on any scanner. Returns the number of bytes skipped, which is less than the length asked for only at the end of the input.
+static inline NSUInteger
+byteScannerSkipBytes(OFByteScanner *scanner, NSUInteger length)
+{
+    NSUInteger remaining = length;
+    while (remaining > 0 && byteScannerHasData(scanner)) {
+        NSUInteger skipLength = MIN(remaining, (NSUInteger)(scanner->scanEnd - scanner->scanLocation));
+        scanner->scanLocation += skipLength;
+        remaining -= skipLength;
+    }
+    return length - remaining;
+}
+
+static inline BOOL byteScannerPeekBytes(OFByteScanner *scanner, const char *bytes)
+{
+    size_t length = strlen(bytes);
+    if ((size_t)(scanner->scanEnd - scanner->scanLocation) >= length)
+        return memcmp(scanner->scanLocation, bytes, length) == 0;
+    return [scanner scanBytes:bytes length:length peek:YES];
+}
+
+static inline BOOL byteScannerReadBytes(OFByteScanner *scanner, const char *bytes)
+{
+    size_t length = strlen(bytes);
+    if ((size_t)(scanner->scanEnd - scanner->scanLocation) >= length) {
+        if (memcmp(scanner->scanLocation, bytes, length) != 0)
+            return NO;
+        scanner->scanLocation += length;
+        return YES;
+    }
+    return [scanner scanBytes:bytes length:length peek:NO];
+}
+
+// Reads up to the next delimiter without allocating anything. Returns the full length of the token; *outToken points at its bytes, which stay valid until the next read from the scanner. Usually that's straight into the scanner's buffer, but a token that spans a buffer refill is copied into spanBuffer, in which case only the first spanBufferLength bytes are kept (though the whole token is consumed, and its full length returned).
+static inline NSUInteger
+byteScannerReadTokenWithDelimiterOFByteSet(OFByteScanner *scanner, OFByteSet *delimiterOFByteSet, const OFByte **outToken, OFByte *spanBuffer, NSUInteger spanBufferLength)
+{
+    if (!byteScannerHasData(scanner)) {
+        *outToken = spanBuffer;
+        return 0;
+    }
+
+    const OFByte *tokenStart = scanner->scanLocation;
+    scanner->scanLocation = OFByteSetFindMember(delimiterOFByteSet, scanner->scanLocation, scanner->scanEnd);
+    if (scanner->scanLocation < scanner->scanEnd) {
+        *outToken = tokenStart;
+        return scanner->scanLocation - tokenStart;
+    }
+
+    *outToken = spanBuffer;
+    return [scanner _finishTokenStartingAt:tokenStart delimiterOFByteSet:delimiterOFByteSet spanBuffer:spanBuffer spanBufferLength:spanBufferLength];
+}
+
+static inline unsigned int
+byteScannerScanHexadecimalNumber(OFByteScanner *scanner, unsigned int maximumDigits)
+{
+    unsigned int resultInt = 0;
+
+    while (maximumDigits-- > 0) {
+        OFByte nextByte = byteScannerPeekByte(scanner);
+        if (nextByte >= '0' && nextByte <= '9')
+            resultInt = resultInt * 16 + (nextByte - '0');
+        else if (nextByte >= 'a' && nextByte <= 'f')
+            resultInt = resultInt * 16 + (nextByte - 'a') + 10;
+        else if (nextByte >= 'A' && nextByte <= 'F')
+            resultInt = resultInt * 16 + (nextByte - 'A') + 10;
+        else
+            break;
+        byteScannerSkipPeekedByte(scanner);
+    }
+    return resultInt;
+}
+
+// Scans an optional '-' followed by decimal digits. All of the digits are consumed, but the value saturates at the given bounds rather than overflowing.
+static inline int
+byteScannerScanClampedSignedInteger(OFByteScanner *scanner, int minimumValue, int maximumValue)
+{
+    OBPRECONDITION(minimumValue <= 0 && maximumValue >= 0);
+
+    BOOL isNegative = NO;
+    if (byteScannerPeekByte(scanner) == '-') {
+        isNegative = YES;
+        byteScannerSkipPeekedByte(scanner);
+    }
+
+    // Accumulate the magnitude, stopping once it's past the bound on this side of zero
+    long long limit = isNegative ? -(long long)minimumValue : (long long)maximumValue;
+    long long magnitude = 0;
+    while (YES) {
+        OFByte nextByte = byteScannerPeekByte(scanner);
+        if (nextByte < '0' || nextByte > '9')
+            break;
+        byteScannerSkipPeekedByte(scanner);
+        if (magnitude <= limit)
+            magnitude = magnitude * 10 + (nextByte - '0');
+    }
+    if (magnitude > limit)
+        magnitude = limit;
+
+    return (int)(isNegative ? -magnitude : magnitude);
+}
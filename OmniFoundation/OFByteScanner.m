@@ -0,0 +1,391 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFByteScanner.h>
+
+#import <OmniFoundation/OFStringDecoder.h> // For OFCharacterConversionExceptionName
+
+RCS_ID("$Id$")
+
+@implementation OFByteScanner
+
+const OFByte OFByteScannerEndOfDataByte = '\0';
+
+- init;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    inputBuffer = NULL;
+    scanEnd = inputBuffer;
+    scanLocation = scanEnd;
+    inputBufferPosition = 0;
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    if (freeInputBuffer) {
+        OBASSERT(inputBuffer != NULL);
+        NSZoneFree(NULL, (void *)inputBuffer);
+    }
+    [super dealloc];
+}
+
+// Declared methods
+
+/* This is called by the scanner when it needs a new bufferful of data. Default implementation is to return NO, which indicates EOF. */
+- (BOOL)fetchMoreData;
+{
+    return NO;
+}
+
+- (void)_rewindByteSource;
+{
+    /* This should not happen if the caller is using -setRewindMark, etc. */
+    [NSException raise:OFCharacterConversionExceptionName format:@"Attempt to rewind a nonrewindable stream"];
+}
+
+- (BOOL)fetchMoreDataFromBytes:(const OFByte *)bytes length:(NSUInteger)length offset:(NSUInteger)offset freeWhenDone:(BOOL)doFreeWhenDone;
+{
+    NSUInteger oldScanPosition = inputBufferPosition + (scanLocation - inputBuffer);
+    OBASSERT(bytes != NULL || length == 0);
+    OBASSERT(offset <= oldScanPosition);
+    OBASSERT(offset + length >= oldScanPosition || length == 0);
+
+    if (freeInputBuffer && inputBuffer != bytes) {
+        OBASSERT(inputBuffer != NULL);
+        NSZoneFree(NULL, (void *)inputBuffer);
+    }
+    freeInputBuffer = doFreeWhenDone;
+
+    inputBufferPosition = offset;
+
+    if (bytes == NULL || length == 0) {
+        inputBuffer = NULL;
+        scanEnd = NULL;
+        scanLocation = NULL;
+        freeInputBuffer = NO;
+        return NO;
+    } else {
+        inputBuffer = bytes;
+        scanLocation = inputBuffer + (oldScanPosition - inputBufferPosition);
+        scanEnd = inputBuffer + length;
+        return YES;
+    }
+}
+
+- (NSUInteger)prepareWindow:(OFByte **)ioWindow capacity:(NSUInteger *)ioCapacity minimumFreeSpace:(NSUInteger)minimumFreeSpace keepPosition:(NSUInteger *)outKeepPosition;
+{
+    OBPRECONDITION(ioWindow != NULL && *ioWindow != NULL);
+    OBPRECONDITION(ioCapacity != NULL && *ioCapacity > minimumFreeSpace);
+    OBPRECONDITION(inputBuffer == NULL || inputBuffer == *ioWindow); // We can only carry bytes over from our own window
+
+    NSUInteger windowEndPosition = inputBufferPosition + (scanEnd - inputBuffer);
+    NSUInteger scanPosition = inputBufferPosition + (scanLocation - inputBuffer);
+
+    // The scan location may have been skipped past the end of the window, in which case there's nothing to keep for it.
+    NSUInteger keepPosition = MIN(scanPosition, windowEndPosition);
+    if (rewindMarkCount > 0)
+        keepPosition = MIN(keepPosition, rewindMarkOffsets[0]);
+    OBASSERT(keepPosition >= inputBufferPosition || inputBuffer == NULL);
+    NSUInteger keepLength = windowEndPosition - keepPosition;
+
+    if (*ioCapacity - keepLength < minimumFreeSpace) {
+        // Only happens when a rewind mark is held across an entire window
+        NSUInteger newCapacity = 2 * *ioCapacity;
+        OFByte *newWindow = NSZoneMalloc(NULL, newCapacity);
+        memcpy(newWindow, inputBuffer + (keepPosition - inputBufferPosition), keepLength);
+        NSZoneFree(NULL, *ioWindow);
+        *ioWindow = newWindow;
+        *ioCapacity = newCapacity;
+    } else if (keepLength > 0) {
+        memmove(*ioWindow, inputBuffer + (keepPosition - inputBufferPosition), keepLength);
+    }
+
+    *outKeepPosition = keepPosition;
+    return keepLength;
+}
+
+- (OFByte)peekByte;
+{
+    return byteScannerPeekByte(self);
+}
+
+- (void)skipPeekedByte;
+{
+    byteScannerSkipPeekedByte(self);
+}
+
+- (OFByte)readByte;
+{
+    return byteScannerReadByte(self);
+}
+
+- (void)setRewindMark;
+{
+    // We only have so much room for marks.  In particular, don't try to call this method recursively, it's just not designed for that.
+    OBPRECONDITION(rewindMarkCount < OFMaximumRewindMarks);
+    // We should never be setting a mark that is earlier in the file than the existing marks
+    OBPRECONDITION(rewindMarkCount == 0 || rewindMarkOffsets[rewindMarkCount-1] <= byteScannerScanLocation(self));
+
+    rewindMarkOffsets[rewindMarkCount++] = byteScannerScanLocation(self);
+}
+
+- (void)rewindToMark;
+{
+    OBPRECONDITION(rewindMarkCount > 0);
+    if (rewindMarkCount == 0)
+        [NSException raise:OFCharacterConversionExceptionName format:@"Attempt to use nonexistent rewind mark"];
+
+    [self setScanLocation:rewindMarkOffsets[rewindMarkCount-1]];
+    rewindMarkCount--;
+}
+
+- (void)discardRewindMark;
+{
+    OBPRECONDITION(rewindMarkCount > 0);
+    if (rewindMarkCount > 0)
+        rewindMarkCount--;
+}
+
+- (NSUInteger)scanLocation;
+{
+    return byteScannerScanLocation(self);
+}
+
+- (void)setScanLocation:(NSUInteger)aLocation;
+{
+    // You are only allowed to set the new scan location to be between the most recent rewind mark and EOF, or the current position and EOF if there are no rewind marks
+    OBPRECONDITION(aLocation >= byteScannerScanLocation(self) || (rewindMarkCount > 0 && aLocation >= rewindMarkOffsets[rewindMarkCount-1]));
+    if (aLocation < byteScannerScanLocation(self) && (rewindMarkCount == 0 || aLocation < rewindMarkOffsets[rewindMarkCount-1]))
+        [NSException raise:OFCharacterConversionExceptionName format:@"You are only allowed to set the new scan location to be between the most recent rewind mark and EOF, or the current position and EOF if there are no rewind marks."];
+
+    if (aLocation >= inputBufferPosition) {
+        NSUInteger inputLocation = aLocation - inputBufferPosition;
+        if (inputLocation <= (NSUInteger)(scanEnd - inputBuffer)) {
+            scanLocation = inputBuffer + inputLocation;
+            return;
+        }
+    }
+
+    scanEnd = inputBuffer;
+    scanLocation = scanEnd;
+    inputBufferPosition = aLocation;
+    [self _rewindByteSource];
+}
+
+- (void)skipBytes:(NSUInteger)anOffset;
+{
+    if (scanLocation + anOffset >= scanEnd)
+        [self setScanLocation:(scanLocation - inputBuffer) + anOffset + inputBufferPosition];
+    else
+        scanLocation += anOffset;
+}
+
+- (BOOL)scanUpToByte:(OFByte)aByte;
+{
+    return byteScannerScanUpToByte(self, aByte);
+}
+
+// Decodes UTF-8, replacing each malformed sequence (a stray continuation byte, a truncated sequence, an overlong or surrogate encoding) with U+FFFD
+static CFStringRef _createStringWithMalformedUTF8(const OFByte *bytes, NSUInteger length)
+{
+    unichar *characters = NSZoneMalloc(NULL, length * sizeof(*characters)); // Never more characters than bytes
+    NSUInteger characterCount = 0;
+    const OFByte *end = bytes + length;
+
+    while (bytes < end) {
+        OFByte leadByte = *bytes++;
+        if (leadByte < 0x80) {
+            characters[characterCount++] = leadByte;
+            continue;
+        }
+
+        unsigned int continuationCount;
+        uint32_t value, minimumValue;
+        if (leadByte >= 0xC2 && leadByte <= 0xDF) {
+            continuationCount = 1; value = leadByte & 0x1F; minimumValue = 0x80;
+        } else if (leadByte >= 0xE0 && leadByte <= 0xEF) {
+            continuationCount = 2; value = leadByte & 0x0F; minimumValue = 0x800;
+        } else if (leadByte >= 0xF0 && leadByte <= 0xF4) {
+            continuationCount = 3; value = leadByte & 0x07; minimumValue = 0x10000;
+        } else {
+            characters[characterCount++] = 0xFFFD;
+            continue;
+        }
+
+        unsigned int continuationIndex;
+        for (continuationIndex = 0; continuationIndex < continuationCount && bytes < end && (*bytes & 0xC0) == 0x80; continuationIndex++)
+            value = (value << 6) | (*bytes++ & 0x3F);
+
+        if (continuationIndex < continuationCount || value < minimumValue || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) {
+            characters[characterCount++] = 0xFFFD;
+        } else if (value > 0xFFFF) {
+            value -= 0x10000;
+            characters[characterCount++] = (unichar)(0xD800 + (value >> 10));
+            characters[characterCount++] = (unichar)(0xDC00 + (value & 0x3FF));
+        } else {
+            characters[characterCount++] = (unichar)value;
+        }
+    }
+
+    CFStringRef string = CFStringCreateWithCharacters(kCFAllocatorDefault, characters, characterCount);
+    NSZoneFree(NULL, characters);
+    return string;
+}
+
+static inline NSString *
+readRetainedTokenFragmentWithDelimiterOFByteSet(OFByteScanner *self, OFByteSet *delimiterOFByteSet, CFStringEncoding encoding, BOOL lossy)
+{
+    const OFByte *startLocation;
+
+    if (!byteScannerHasData(self))
+        return nil;
+    startLocation = self->scanLocation;
+    self->scanLocation = OFByteSetFindMember(delimiterOFByteSet, self->scanLocation, self->scanEnd);
+
+    NSUInteger length = self->scanLocation - startLocation;
+    if (length == 0)
+        return nil;
+
+    // NULL if the bytes aren't valid in the given encoding and we weren't asked to make do; they've still been consumed.
+    CFStringRef tokenFragment = CFStringCreateWithBytes(kCFAllocatorDefault, startLocation, length, encoding, false);
+    if (tokenFragment == NULL && lossy) {
+        if (encoding == kCFStringEncodingUTF8)
+            tokenFragment = _createStringWithMalformedUTF8(startLocation, length);
+        else
+            tokenFragment = CFStringCreateWithBytes(kCFAllocatorDefault, startLocation, length, kCFStringEncodingISOLatin1, false); // Every byte is valid here
+    }
+    return NSMakeCollectable(tokenFragment);
+}
+
+- (NSString *)readTokenFragmentWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+{
+    return [readRetainedTokenFragmentWithDelimiterOFByteSet(self, delimiterOFByteSet, encoding, NO) autorelease];
+}
+
+- (NSString *)readLossyTokenFragmentWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+{
+    return [readRetainedTokenFragmentWithDelimiterOFByteSet(self, delimiterOFByteSet, encoding, YES) autorelease];
+}
+
+- (NSString *)readFullTokenWithDelimiterOFByteSet:(OFByteSet *)delimiterOFByteSet encoding:(CFStringEncoding)encoding;
+{
+    NSString *resultString = nil, *fragment;
+
+    if (!byteScannerHasData(self))
+        return nil;
+
+    do {
+        fragment = readRetainedTokenFragmentWithDelimiterOFByteSet(self, delimiterOFByteSet, encoding, NO);
+        if (!fragment)
+            break;
+
+        if (resultString) {
+            // this case should be uncommon; it only happens when a token spans a buffer refill
+            NSString *old = resultString;
+            resultString = [[old stringByAppendingString:fragment] retain];
+            [old release];
+            [fragment release];
+        } else {
+            resultString = fragment;
+        }
+    } while (!isByteInByteSet(byteScannerPeekByte(self), delimiterOFByteSet));
+
+    return [resultString autorelease];
+}
+
+- (NSUInteger)_finishTokenStartingAt:(const OFByte *)tokenStart delimiterOFByteSet:(OFByteSet *)delimiterOFByteSet spanBuffer:(OFByte *)spanBuffer spanBufferLength:(NSUInteger)spanBufferLength;
+{
+    OBPRECONDITION(scanLocation == scanEnd);
+
+    // Save what we have before the refill moves it
+    NSUInteger tokenLength = scanEnd - tokenStart;
+    memcpy(spanBuffer, tokenStart, MIN(tokenLength, spanBufferLength));
+
+    while (byteScannerHasData(self)) {
+        while (scanLocation < scanEnd) {
+            OFByte byte = *scanLocation;
+            if (isByteInByteSet(byte, delimiterOFByteSet))
+                return tokenLength;
+            if (tokenLength < spanBufferLength)
+                spanBuffer[tokenLength] = byte;
+            tokenLength++;
+            scanLocation++;
+        }
+    }
+    return tokenLength;
+}
+
+- (unsigned int)scanHexadecimalNumberMaximumDigits:(unsigned int)maximumDigits;
+{
+    return byteScannerScanHexadecimalNumber(self, maximumDigits);
+}
+
+- (unsigned int)scanUnsignedIntegerMaximumDigits:(unsigned int)maximumDigits;
+{
+    unsigned int resultInt = 0;
+
+    while (maximumDigits-- > 0) {
+        OFByte nextByte = byteScannerPeekByte(self);
+        if (nextByte >= '0' && nextByte <= '9') {
+            byteScannerSkipPeekedByte(self);
+            resultInt = resultInt * 10 + (nextByte - '0');
+        } else
+            break;
+    }
+    return resultInt;
+}
+
+- (BOOL)scanBytes:(const void *)bytes length:(NSUInteger)length peek:(BOOL)doPeek;
+{
+    const OFByte *ptr = bytes;
+
+    // Fast path when everything we need is already in the buffer
+    if ((NSUInteger)(scanEnd - scanLocation) >= length) {
+        if (memcmp(scanLocation, ptr, length) != 0)
+            return NO;
+        if (!doPeek)
+            scanLocation += length;
+        return YES;
+    }
+
+    BOOL bytesFound = YES;
+    [self setRewindMark];
+    while (length--) {
+        if (byteScannerReadByte(self) != *ptr++) {
+            bytesFound = NO;
+            break;
+        }
+    }
+
+    if (!bytesFound || doPeek)
+        [self rewindToMark];
+    else
+        [self discardRewindMark];
+
+    return bytesFound;
+}
+
+// Debugging methods
+
+- (NSMutableDictionary *)debugDictionary;
+{
+    NSMutableDictionary *debugDictionary = [super debugDictionary];
+
+    if (inputBuffer) {
+        [debugDictionary setObject:[NSString stringWithFormat:@"%td", scanEnd - inputBuffer] forKey:@"inputBufferLength"];
+        [debugDictionary setObject:[NSString stringWithFormat:@"%td", scanLocation - inputBuffer] forKey:@"inputScanLocation"];
+    }
+    [debugDictionary setObject:[NSString stringWithFormat:@"%lu", inputBufferPosition] forKey:@"inputBufferPosition"];
+
+    return debugDictionary;
+}
+
+@end
@@ -13,6 +13,7 @@
 
 #import <Foundation/NSString.h> // For unichar and NSStringEncoding
 #import <OmniFoundation/OFByte.h>
+#import <OmniFoundation/OFVectorDelimiterScan.h>
 
 #define OFByteSetBitmapRepLength ((1 << 8) >> 3)
 
@@ -20,6 +21,11 @@
 {
 @public
     OFByte bitmapRep[OFByteSetBitmapRepLength];
+
+    // The members, listed for OFVectorScanBytesForMembers() if there are few enough of them (otherwise vectorMemberCount is zero). Rebuilt lazily by OFByteSetFindMember() after any change to the set.
+    OFByte vectorMembers[OFVectorDelimiterScanMaximumMembers];
+    unsigned int vectorMemberCount;
+    volatile BOOL vectorMembersValid;
 }
 
 - (BOOL)byteIsMember:(OFByte)aByte;
@@ -58,11 +64,30 @@ static inline BOOL isCharacterInByteSet(unichar ch, OFByteSet *byteSet)
 static inline void addByteToByteSet(OFByte aByte, OFByteSet *byteSet)
 {
     byteSet->bitmapRep[aByte >> 3] |= (((unsigned)1) << (aByte & 7));
+    byteSet->vectorMembersValid = NO;
 }
 
 static inline void
 removeByteFromByteSet(OFByte aByte, OFByteSet *byteSet)
 {
     byteSet->bitmapRep[aByte >> 3] &= ~(((unsigned)1) << (aByte & 7));
+    byteSet->vectorMembersValid = NO;
+}
+
+extern void OFByteSetUpdateVectorMembers(OFByteSet *byteSet);
+
+// Returns a pointer to the first byte in [bytes, end) which is a member of the set, or end if there isn't one.
+static inline const OFByte *OFByteSetFindMember(OFByteSet *byteSet, const OFByte *bytes, const OFByte *end)
+{
+    if (OFVectorDelimiterScanningEnabled && (NSUInteger)(end - bytes) >= OFVectorDelimiterScanMinimumBytes) {
+        if (!byteSet->vectorMembersValid)
+            OFByteSetUpdateVectorMembers(byteSet);
+        if (byteSet->vectorMemberCount != 0)
+            bytes = OFVectorScanBytesForMembers(bytes, end, byteSet->vectorMembers, byteSet->vectorMemberCount);
+    }
+
+    while (bytes < end && !isByteInByteSet(*bytes, byteSet))
+        bytes++;
+    return bytes;
 }
 
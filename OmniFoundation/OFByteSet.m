@@ -9,6 +9,8 @@
 
 #import <OmniFoundation/NSString-OFExtensions.h>
 
+#import <libkern/OSAtomic.h>
+
 RCS_ID("$Id$")
 
 @implementation OFByteSet
@@ -45,6 +47,7 @@ RCS_ID("$Id$")
 
     for (byteIndex = 0; byteIndex < OFByteSetBitmapRepLength; byteIndex++)
 	bitmapRep[byteIndex] = 0xff;
+    vectorMembersValid = NO;
 }
 
 - (void)removeAllBytes;
@@ -53,6 +56,7 @@ RCS_ID("$Id$")
 
     for (byteIndex = 0; byteIndex < OFByteSetBitmapRepLength; byteIndex++)
 	bitmapRep[byteIndex] = 0x00;
+    vectorMembersValid = NO;
 }
 
 - (void)addBytesFromData:(NSData *)data;
@@ -126,6 +130,27 @@ RCS_ID("$Id$")
 
 @end
 
+void OFByteSetUpdateVectorMembers(OFByteSet *byteSet)
+{
+    unsigned int memberCount = 0;
+    unsigned int byteValue;
+
+    for (byteValue = 0; byteValue < 256; byteValue++) {
+        if (!isByteInByteSet(byteValue, byteSet))
+            continue;
+        if (memberCount == OFVectorDelimiterScanMaximumMembers) {
+            memberCount = 0; // Too many to be worth it
+            break;
+        }
+        byteSet->vectorMembers[memberCount++] = byteValue;
+    }
+    byteSet->vectorMemberCount = memberCount;
+
+    // Sets are often shared between threads once built; make sure the list is complete before anyone sees it marked valid. (Racing updaters compute the same list.)
+    OSMemoryBarrier();
+    byteSet->vectorMembersValid = YES;
+}
+
 @implementation OFByteSet (PredefinedSets)
 
 static OFByteSet *whitespaceByteSet = nil;
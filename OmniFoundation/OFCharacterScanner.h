@@ -188,11 +188,9 @@ static inline BOOL
 scannerScanUpToCharacterInOFCharacterSet(OFCharacterScanner *scanner, OFCharacterSet *delimiterBitmapRep)
 {
     while (scannerHasData(scanner)) {
-        while (scanner->scanLocation < scanner->scanEnd) {
-            if (OFCharacterSetHasMember(delimiterBitmapRep, *scanner->scanLocation))
-                return YES;
-            scanner->scanLocation++;
-        }
+        scanner->scanLocation = (unichar *)OFCharacterSetFindMember(delimiterBitmapRep, scanner->scanLocation, scanner->scanEnd);
+        if (scanner->scanLocation < scanner->scanEnd)
+            return YES;
     } 
     return NO;
 }
@@ -385,11 +385,7 @@ readRetainedTokenFragmentWithDelimiterOFCharacterSet(OFCharacterScanner *self, O
     if (!scannerHasData(self))
 	return nil;
     startLocation = self->scanLocation;
-    while (self->scanLocation < self->scanEnd) {
-	if (OFCharacterSetHasMember(delimiterOFCharacterSet, *self->scanLocation))
-	    break;
-	self->scanLocation++;
-    }
+    self->scanLocation = (unichar *)OFCharacterSetFindMember(delimiterOFCharacterSet, self->scanLocation, self->scanEnd);
 
     NSUInteger length = self->scanLocation - startLocation;
     if (length == 0)
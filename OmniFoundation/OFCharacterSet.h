@@ -14,6 +14,7 @@
 #import <Foundation/NSString.h> // For unichar
 
 #import <OmniFoundation/OFByte.h>
+#import <OmniFoundation/OFVectorDelimiterScan.h>
 
 #define OFCharacterSetBitmapRepLength ((1 << 16) >> 3)
 
@@ -21,6 +22,11 @@
 {
 @public
     OFByte bitmapRep[OFCharacterSetBitmapRepLength];
+
+    // The members, listed for OFVectorScanCharactersForMembers() if there are few enough of them (otherwise vectorMemberCount is zero). Rebuilt lazily by OFCharacterSetFindMember() after any change to the set.
+    unichar vectorMembers[OFVectorDelimiterScanMaximumMembers];
+    unsigned int vectorMemberCount;
+    volatile BOOL vectorMembersValid;
 }
 
 + (OFCharacterSet *)characterSetWithString:(NSString *)string;
@@ -63,9 +69,28 @@ static inline BOOL OFCharacterSetHasMember(OFCharacterSet *unicharSet, unichar c
 static inline void OFCharacterSetAddCharacter(OFCharacterSet *unicharSet, unichar character)
 {
     unicharSet->bitmapRep[character >> 3] |= (((unsigned)1) << (character & 7));
+    unicharSet->vectorMembersValid = NO;
 }
 
 static inline void OFCharacterSetRemoveCharacter(OFCharacterSet *unicharSet, unichar character)
 {
     unicharSet->bitmapRep[character >> 3] &= ~(((unsigned)1) << (character & 7));
+    unicharSet->vectorMembersValid = NO;
+}
+
+extern void OFCharacterSetUpdateVectorMembers(OFCharacterSet *unicharSet);
+
+// Returns a pointer to the first character in [characters, end) which is a member of the set, or end if there isn't one.
+static inline const unichar *OFCharacterSetFindMember(OFCharacterSet *unicharSet, const unichar *characters, const unichar *end)
+{
+    if (OFVectorDelimiterScanningEnabled && (NSUInteger)(end - characters) >= OFVectorDelimiterScanMinimumCharacters) {
+        if (!unicharSet->vectorMembersValid)
+            OFCharacterSetUpdateVectorMembers(unicharSet);
+        if (unicharSet->vectorMemberCount != 0)
+            characters = OFVectorScanCharactersForMembers(characters, end, unicharSet->vectorMembers, unicharSet->vectorMemberCount);
+    }
+
+    while (characters < end && !OFCharacterSetHasMember(unicharSet, *characters))
+        characters++;
+    return characters;
 }
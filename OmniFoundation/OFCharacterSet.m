@@ -10,6 +10,8 @@
 #import <OmniFoundation/NSString-OFUnicodeCharacters.h>
 #import <OmniBase/OBObject.h>
 
+#import <libkern/OSAtomic.h>
+
 RCS_ID("$Id$");
 
 @implementation OFCharacterSet
@@ -117,6 +119,7 @@ RCS_ID("$Id$");
     while (maskIndex--) {
         bitmapRep[maskIndex] |= ofCharacterSet->bitmapRep[maskIndex];
     }
+    vectorMembersValid = NO;
 }
 
 - (void)removeCharactersFromOFCharacterSet:(OFCharacterSet *)ofCharacterSet;
@@ -127,6 +130,7 @@ RCS_ID("$Id$");
     while (maskIndex--) {
         bitmapRep[maskIndex] &= (~ofCharacterSet->bitmapRep[maskIndex]);
     }
+    vectorMembersValid = NO;
 }
 
 - (void)addCharactersFromCharacterSet:(NSCharacterSet *)characterSet;
@@ -139,6 +143,7 @@ RCS_ID("$Id$");
     while (maskIndex--) {
         bitmapRep[maskIndex] |= otherBitmap[maskIndex];
     }
+    vectorMembersValid = NO;
 }
 
 - (void)removeCharactersFromCharacterSet:(NSCharacterSet *)characterSet;
@@ -151,6 +156,7 @@ RCS_ID("$Id$");
     while (maskIndex--) {
         bitmapRep[maskIndex] &= (~otherBitmap[maskIndex]);
     }
+    vectorMembersValid = NO;
 }
 
 - (void)addCharactersInString:(NSString *)string;
@@ -176,11 +182,13 @@ RCS_ID("$Id$");
 - (void)addAllCharacters;
 {
     memset(bitmapRep, 0xff, OFCharacterSetBitmapRepLength);
+    vectorMembersValid = NO;
 }
 
 - (void)removeAllCharacters;
 {
     bzero(bitmapRep, OFCharacterSetBitmapRepLength);
+    vectorMembersValid = NO;
 }
 
 - (void)invert;
@@ -190,6 +198,7 @@ RCS_ID("$Id$");
     maskIndex = OFCharacterSetBitmapRepLength;
     while (maskIndex--)
         bitmapRep[maskIndex] = ~bitmapRep[maskIndex];
+    vectorMembersValid = NO;
 }
 
 // NSCopying protocol
@@ -245,3 +254,33 @@ RCS_ID("$Id$");
 }
 
 @end
+
+void OFCharacterSetUpdateVectorMembers(OFCharacterSet *unicharSet)
+{
+    unsigned int memberCount = 0;
+    unsigned int maskIndex;
+
+    // Most of the bitmap is usually empty, so skip it a byte at a time
+    for (maskIndex = 0; maskIndex < OFCharacterSetBitmapRepLength; maskIndex++) {
+        OFByte mask = unicharSet->bitmapRep[maskIndex];
+        if (mask == 0)
+            continue;
+
+        unsigned int bitIndex;
+        for (bitIndex = 0; bitIndex < 8; bitIndex++) {
+            if (!(mask & (1 << bitIndex)))
+                continue;
+            if (memberCount == OFVectorDelimiterScanMaximumMembers) {
+                memberCount = 0; // Too many to be worth it
+                goto done;
+            }
+            unicharSet->vectorMembers[memberCount++] = (unichar)(maskIndex * 8 + bitIndex);
+        }
+    }
+done:
+    unicharSet->vectorMemberCount = memberCount;
+
+    // Sets are often shared between threads once built; make sure the list is complete before anyone sees it marked valid. (Racing updaters compute the same list.)
+    OSMemoryBarrier();
+    unicharSet->vectorMembersValid = YES;
+}
@@ -0,0 +1,46 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFByteScanner.h>
+
+@class NSData, NSError;
+
+#define OFDataByteScannerReadLength (64 * 1024)
+
+/*
+ Scans the raw bytes of an NSData or a file descriptor. An NSData is scanned in place, with no copy at all. So is a regular file: it's mapped into memory, and the scanner points straight at the mapping. Anything else (a pipe, a socket, or a file that can't be mapped) is read into a fixed-size window, so memory use doesn't grow with the size of the input. Bytes back to the earliest rewind mark are carried over when the window is refilled.
+*/
+
+@interface OFDataByteScanner : OFByteScanner
+{
+@private
+    NSData *sourceData;
+    void *mapping;
+    size_t mappingLength;
+    const OFByte *sourceBytes; // The whole input, from the data or the mapping
+    NSUInteger sourceLength;
+    BOOL hasWholeInput;
+
+    int fileDescriptor;
+    BOOL closeFileDescriptor;
+    OFByte *window;
+    NSUInteger windowCapacity;
+    BOOL reachedEndOfInput;
+    NSError *readError;
+}
+
+- initWithData:(NSData *)data;
+    // Retains the data, so don't change it.
+- initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc;
+    // Scans from the current offset of the descriptor to the end of the input; pipes and sockets are fine. A regular file is mapped rather than read, which leaves the descriptor's offset where it was; it must not be truncated while the scanner is using it.
+
+- (NSError *)readError;
+    // Non-nil if reading from the file descriptor failed. The scanner treats a read error as the end of its input.
+
+@end
@@ -0,0 +1,166 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFDataByteScanner.h>
+
+#import <Foundation/NSData.h>
+#import <Foundation/NSError.h>
+#import <OmniBase/NSError-OBUtilities.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+RCS_ID("$Id$")
+
+#define OFDataByteScannerMinimumFreeBytes (4 * 1024)
+
+@implementation OFDataByteScanner
+
+- initWithData:(NSData *)data;
+{
+    OBPRECONDITION(data != nil);
+
+    if (!(self = [super init]))
+        return nil;
+
+    fileDescriptor = -1;
+    sourceData = [data retain];
+    sourceBytes = [data bytes];
+    sourceLength = [data length];
+    hasWholeInput = YES;
+
+    return self;
+}
+
+- initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc;
+{
+    OBPRECONDITION(fd >= 0);
+
+    if (!(self = [super init]))
+        return nil;
+
+    fileDescriptor = fd;
+    closeFileDescriptor = closeOnDealloc;
+    if (![self _mapFileDescriptor]) {
+        windowCapacity = OFDataByteScannerReadLength;
+        window = NSZoneMalloc(NULL, windowCapacity);
+    }
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [sourceData release];
+    if (mapping != NULL)
+        munmap(mapping, mappingLength);
+    if (closeFileDescriptor && fileDescriptor >= 0)
+        close(fileDescriptor);
+    // Our superclass only frees inputBuffer when it was handed ownership; we always pass freeWhenDone:NO.
+    if (window != NULL)
+        NSZoneFree(NULL, window);
+    [readError release];
+    [super dealloc];
+}
+
+- (NSError *)readError;
+{
+    return readError;
+}
+
+// Maps the rest of the file if it's a regular file, so it can be scanned in place with no read() or copy at all. Returns NO if it isn't, or if the mapping fails, in which case we read through the window as we would from a pipe. Files that claim to be empty are read, too, since some (in /proc, say) have contents anyway.
+- (BOOL)_mapFileDescriptor;
+{
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode))
+        return NO;
+
+    off_t offset = lseek(fileDescriptor, 0, SEEK_CUR);
+    if (offset < 0 || offset >= fileInfo.st_size)
+        return NO;
+    if ((unsigned long long)(fileInfo.st_size - offset) > SIZE_MAX - (size_t)getpagesize())
+        return NO; // Too big for our address space; reading still works
+
+    // The mapping has to start on a page boundary
+    off_t pageOffset = offset % getpagesize();
+    size_t length = (size_t)(fileInfo.st_size - offset + pageOffset);
+    void *bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileDescriptor, offset - pageOffset);
+    if (bytes == MAP_FAILED)
+        return NO;
+    madvise(bytes, length, MADV_SEQUENTIAL); // Only a hint, so we don't care if it fails
+
+    mapping = bytes;
+    mappingLength = length;
+    sourceBytes = (const OFByte *)bytes + pageOffset;
+    sourceLength = (NSUInteger)(fileInfo.st_size - offset);
+    hasWholeInput = YES;
+    return YES;
+}
+
+// Reads at most maximumLength bytes into the given buffer. Returns zero at end of file or on error.
+- (NSUInteger)_readBytesIntoBuffer:(OFByte *)bytes maximumLength:(NSUInteger)maximumLength;
+{
+    while (YES) {
+        ssize_t bytesRead = read(fileDescriptor, bytes, maximumLength);
+        if (bytesRead >= 0)
+            return bytesRead;
+        if (OMNI_ERRNO() == EINTR)
+            continue;
+
+        NSError *error = nil;
+        OBErrorWithErrno(&error, OMNI_ERRNO(), "read", nil, NSLocalizedStringFromTableInBundle(@"Unable to read input.", @"OmniFoundation", OMNI_BUNDLE, @"error description"));
+        [readError release];
+        readError = [error retain];
+        return 0;
+    }
+}
+
+#pragma mark -
+#pragma mark OFByteScanner subclass
+
+- (BOOL)fetchMoreData;
+{
+    if (hasWholeInput) {
+        // The whole input is the buffer, so the only time we get here is at the end of it (or before the first call).
+        if (inputBuffer != NULL)
+            return NO;
+        return [self fetchMoreDataFromBytes:sourceBytes length:sourceLength offset:0 freeWhenDone:NO];
+    }
+
+    if (reachedEndOfInput)
+        return NO;
+
+    NSUInteger keepPosition;
+    NSUInteger keepLength = [self prepareWindow:&window capacity:&windowCapacity minimumFreeSpace:OFDataByteScannerMinimumFreeBytes keepPosition:&keepPosition];
+    NSUInteger bytesRead = [self _readBytesIntoBuffer:window + keepLength maximumLength:windowCapacity - keepLength];
+    if (bytesRead == 0)
+        reachedEndOfInput = YES;
+
+    // Even at the end of the input we need to repoint our buffer at the (possibly moved) window.
+    [self fetchMoreDataFromBytes:window length:keepLength + bytesRead offset:keepPosition freeWhenDone:NO];
+    return bytesRead > 0;
+}
+
+- (void)_rewindByteSource;
+{
+    if (!hasWholeInput) {
+        [super _rewindByteSource];
+        return;
+    }
+
+    // Every position in the input is reachable by pointing back into it; past the end there's nothing to fetch.
+    if (inputBufferPosition < sourceLength) {
+        inputBuffer = NULL;
+        scanEnd = NULL;
+        scanLocation = NULL;
+    }
+}
+
+@end
@@ -0,0 +1,34 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFByteScanner.h>
+
+@class NSString;
+
+#define OFStringByteScannerWindowLength (16 * 1024)
+
+/*
+ Scans the UTF-8 bytes of an NSString. If the string can hand out a pointer to its UTF-8 (or ASCII) contents, that is scanned in place; otherwise the string is converted a window at a time, never splitting a surrogate pair across windows, so a multibyte sequence is never split either.
+*/
+
+@interface OFStringByteScanner : OFByteScanner
+{
+@private
+    NSString *sourceString;
+    NSUInteger sourceLength;
+    NSUInteger sourceCharacterOffset;
+    BOOL scanningInPlace;
+
+    OFByte *window;
+    NSUInteger windowCapacity;
+}
+
+- initWithString:(NSString *)aString;
+
+@end
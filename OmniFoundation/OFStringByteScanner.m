@@ -0,0 +1,89 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFStringByteScanner.h>
+
+#import <Foundation/NSString.h>
+
+RCS_ID("$Id$")
+
+// A UTF-16 code unit never needs more than three bytes of UTF-8 (a surrogate pair takes four bytes for two units).
+#define OFStringByteScannerMaximumBytesPerCharacter (3)
+#define OFStringByteScannerMinimumFreeBytes (OFStringByteScannerWindowLength / 2)
+
+@implementation OFStringByteScanner
+
+- initWithString:(NSString *)aString;
+{
+    OBPRECONDITION(aString != nil);
+
+    if (!(self = [super init]))
+        return nil;
+
+    sourceString = [aString copy];
+    sourceLength = [sourceString length];
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [sourceString release];
+    // Our superclass only frees inputBuffer when it was handed ownership; we always pass freeWhenDone:NO.
+    if (window != NULL)
+        NSZoneFree(NULL, window);
+    [super dealloc];
+}
+
+#pragma mark -
+#pragma mark OFByteScanner subclass
+
+- (BOOL)fetchMoreData;
+{
+    if (scanningInPlace)
+        return NO;
+
+    if (inputBuffer == NULL && sourceCharacterOffset == 0) {
+        // For ASCII, the byte count is the character count.
+        const char *bytes = CFStringGetCStringPtr((CFStringRef)sourceString, kCFStringEncodingASCII);
+        if (bytes == NULL)
+            bytes = CFStringGetCStringPtr((CFStringRef)sourceString, kCFStringEncodingUTF8);
+        if (bytes != NULL && strlen(bytes) == sourceLength) {
+            scanningInPlace = YES;
+            return [self fetchMoreDataFromBytes:(const OFByte *)bytes length:sourceLength offset:0 freeWhenDone:NO];
+        }
+
+        windowCapacity = OFStringByteScannerWindowLength;
+        window = NSZoneMalloc(NULL, windowCapacity);
+    }
+
+    if (sourceCharacterOffset >= sourceLength)
+        return NO;
+
+    NSUInteger keepPosition;
+    NSUInteger keepLength = [self prepareWindow:&window capacity:&windowCapacity minimumFreeSpace:OFStringByteScannerMinimumFreeBytes keepPosition:&keepPosition];
+
+    NSUInteger freeSpace = windowCapacity - keepLength;
+    CFRange range;
+    range.location = sourceCharacterOffset;
+    range.length = MIN(sourceLength - sourceCharacterOffset, freeSpace / OFStringByteScannerMaximumBytesPerCharacter);
+    if (range.location + range.length < sourceLength && range.length > 1) {
+        // Leave a trailing high surrogate for the next window so the pair is converted as a unit.
+        unichar lastCharacter = [sourceString characterAtIndex:range.location + range.length - 1];
+        if (lastCharacter >= 0xD800 && lastCharacter <= 0xDBFF)
+            range.length--;
+    }
+
+    CFIndex bytesProduced = 0;
+    CFIndex charactersConverted = CFStringGetBytes((CFStringRef)sourceString, range, kCFStringEncodingUTF8, '?', false, window + keepLength, freeSpace, &bytesProduced);
+    OBASSERT(charactersConverted == range.length);
+    sourceCharacterOffset += charactersConverted;
+
+    return [self fetchMoreDataFromBytes:window length:keepLength + bytesProduced offset:keepPosition freeWhenDone:NO];
+}
+
+@end
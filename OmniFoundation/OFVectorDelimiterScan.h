@@ -0,0 +1,40 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSString.h> // For unichar
+#import <OmniFoundation/OFByte.h>
+
+/*
+ Vector kernels for finding the first delimiter in a run of bytes or characters, for delimiter sets with only a handful of members (the RTF reader's reserved sets have five or six). Each iteration compares 16 bytes (or 8 characters) against every member at once, using SSE2 on Intel and NEON on 64-bit ARM.
+ OFByteSet and OFCharacterSet keep a list of their members for this when they are small enough, and the scanner loops that take those sets use it when OFVectorDelimiterScanningEnabled is set. Clearing it forces the plain bitmap loops, so the two can be benchmarked against each other.
+*/
+
+#define OFVectorDelimiterScanMaximumMembers (8)
+
+#if defined(__SSE2__) || defined(__aarch64__)
+#define OF_VECTOR_DELIMITER_SCAN_AVAILABLE 1
+#else
+#define OF_VECTOR_DELIMITER_SCAN_AVAILABLE 0
+#endif
+
+#if OF_VECTOR_DELIMITER_SCAN_AVAILABLE
+#define OFVectorDelimiterScanMinimumBytes (16)
+#define OFVectorDelimiterScanMinimumCharacters (8)
+#else
+// Never worth calling the kernels, which just return their start pointer
+#define OFVectorDelimiterScanMinimumBytes (NSUIntegerMax)
+#define OFVectorDelimiterScanMinimumCharacters (NSUIntegerMax)
+#endif
+
+extern BOOL OFVectorDelimiterScanningEnabled;
+    // Defaults to YES where the kernels are available. Set the OFDisableVectorDelimiterScanning environment variable to start with it off.
+
+// These return a pointer to the first member found, or else to the point where fewer than a full vector's worth of input remains; the caller finishes from there with its scalar loop.
+extern const OFByte *OFVectorScanBytesForMembers(const OFByte *bytes, const OFByte *end, const OFByte *members, unsigned int memberCount);
+extern const unichar *OFVectorScanCharactersForMembers(const unichar *characters, const unichar *end, const unichar *members, unsigned int memberCount);
@@ -0,0 +1,138 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniFoundation/OFVectorDelimiterScan.h>
+
+#import <OmniBase/assertions.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <stdlib.h>
+
+RCS_ID("$Id$")
+
+BOOL OFVectorDelimiterScanningEnabled = OF_VECTOR_DELIMITER_SCAN_AVAILABLE;
+
+static void _OFVectorDelimiterScanInitialize(void) __attribute__((constructor));
+static void _OFVectorDelimiterScanInitialize(void)
+{
+    if (getenv("OFDisableVectorDelimiterScanning") != NULL)
+        OFVectorDelimiterScanningEnabled = NO;
+}
+
+#if defined(__SSE2__)
+
+const OFByte *OFVectorScanBytesForMembers(const OFByte *bytes, const OFByte *end, const OFByte *members, unsigned int memberCount)
+{
+    OBPRECONDITION(memberCount > 0 && memberCount <= OFVectorDelimiterScanMaximumMembers);
+
+    __m128i memberVectors[OFVectorDelimiterScanMaximumMembers];
+    for (unsigned int memberIndex = 0; memberIndex < memberCount; memberIndex++)
+        memberVectors[memberIndex] = _mm_set1_epi8((char)members[memberIndex]);
+
+    while (end - bytes >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)bytes);
+        __m128i matches = _mm_cmpeq_epi8(chunk, memberVectors[0]);
+        for (unsigned int memberIndex = 1; memberIndex < memberCount; memberIndex++)
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, memberVectors[memberIndex]));
+
+        int mask = _mm_movemask_epi8(matches);
+        if (mask != 0)
+            return bytes + __builtin_ctz(mask);
+        bytes += 16;
+    }
+    return bytes;
+}
+
+const unichar *OFVectorScanCharactersForMembers(const unichar *characters, const unichar *end, const unichar *members, unsigned int memberCount)
+{
+    OBPRECONDITION(memberCount > 0 && memberCount <= OFVectorDelimiterScanMaximumMembers);
+
+    __m128i memberVectors[OFVectorDelimiterScanMaximumMembers];
+    for (unsigned int memberIndex = 0; memberIndex < memberCount; memberIndex++)
+        memberVectors[memberIndex] = _mm_set1_epi16((short)members[memberIndex]);
+
+    while (end - characters >= 8) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)characters);
+        __m128i matches = _mm_cmpeq_epi16(chunk, memberVectors[0]);
+        for (unsigned int memberIndex = 1; memberIndex < memberCount; memberIndex++)
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi16(chunk, memberVectors[memberIndex]));
+
+        // Two mask bits per character
+        int mask = _mm_movemask_epi8(matches);
+        if (mask != 0)
+            return characters + (__builtin_ctz(mask) >> 1);
+        characters += 8;
+    }
+    return characters;
+}
+
+#elif defined(__aarch64__)
+
+const OFByte *OFVectorScanBytesForMembers(const OFByte *bytes, const OFByte *end, const OFByte *members, unsigned int memberCount)
+{
+    OBPRECONDITION(memberCount > 0 && memberCount <= OFVectorDelimiterScanMaximumMembers);
+
+    uint8x16_t memberVectors[OFVectorDelimiterScanMaximumMembers];
+    for (unsigned int memberIndex = 0; memberIndex < memberCount; memberIndex++)
+        memberVectors[memberIndex] = vdupq_n_u8(members[memberIndex]);
+
+    while (end - bytes >= 16) {
+        uint8x16_t chunk = vld1q_u8(bytes);
+        uint8x16_t matches = vceqq_u8(chunk, memberVectors[0]);
+        for (unsigned int memberIndex = 1; memberIndex < memberCount; memberIndex++)
+            matches = vorrq_u8(matches, vceqq_u8(chunk, memberVectors[memberIndex]));
+
+        // Narrow to four mask bits per byte, since NEON has no movemask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+        if (mask != 0)
+            return bytes + (__builtin_ctzll(mask) >> 2);
+        bytes += 16;
+    }
+    return bytes;
+}
+
+const unichar *OFVectorScanCharactersForMembers(const unichar *characters, const unichar *end, const unichar *members, unsigned int memberCount)
+{
+    OBPRECONDITION(memberCount > 0 && memberCount <= OFVectorDelimiterScanMaximumMembers);
+
+    uint16x8_t memberVectors[OFVectorDelimiterScanMaximumMembers];
+    for (unsigned int memberIndex = 0; memberIndex < memberCount; memberIndex++)
+        memberVectors[memberIndex] = vdupq_n_u16(members[memberIndex]);
+
+    while (end - characters >= 8) {
+        uint16x8_t chunk = vld1q_u16(characters);
+        uint16x8_t matches = vceqq_u16(chunk, memberVectors[0]);
+        for (unsigned int memberIndex = 1; memberIndex < memberCount; memberIndex++)
+            matches = vorrq_u16(matches, vceqq_u16(chunk, memberVectors[memberIndex]));
+
+        // Eight mask bits per character
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(matches)), 0);
+        if (mask != 0)
+            return characters + (__builtin_ctzll(mask) >> 3);
+        characters += 8;
+    }
+    return characters;
+}
+
+#else
+
+const OFByte *OFVectorScanBytesForMembers(const OFByte *bytes, const OFByte *end, const OFByte *members, unsigned int memberCount)
+{
+    return bytes;
+}
+
+const unichar *OFVectorScanCharactersForMembers(const unichar *characters, const unichar *end, const unichar *members, unsigned int memberCount)
+{
+    return characters;
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+#import <OmniFoundation/OFDataBuffer.h>
+
+@class NSData, NSError;
+
+/*
+ Where a parse of an RTF document may start other than at its beginning. There's an entry for each top-level group in the document (at its '{') and for each paragraph of body text (just past the \par that ends the one before it). Each entry carries a compact snapshot of the reader's group state stack there, and how much of the font and color tables had been read by then, so +[OUIRTFReader parseRange:ofRTFData:index:] can pick up at any entry without reading what comes before it.
+ Build one with +[OUIRTFReader indexRTFData:]. An index is only good for the exact bytes it was built from; -serializedData and -initWithSerializedData:error: let it be cached alongside them.
+*/
+
+typedef enum {
+    OUIRTFDocumentIndexEntryGroupStart,
+    OUIRTFDocumentIndexEntryParagraphStart,
+} OUIRTFDocumentIndexEntryKind;
+
+struct _OUIRTFDocumentIndexEntry;
+
+@interface OUIRTFDocumentIndex : OFObject
+{
+@private
+    NSUInteger _documentLength;
+    NSUInteger _characterCount;
+    struct _OUIRTFDocumentIndexEntry *_entries; // In document order
+    NSUInteger _entryCount, _entryCapacity;
+    OFDataBuffer _snapshots; // Every entry's state snapshot, one after another; their format is up to the reader
+    OFDataBuffer _fontDefinitions; // Font table entries in the order they were read
+    OFDataBuffer _colorDefinitions; // Likewise for color table entries
+}
+
+- (id)initWithSerializedData:(NSData *)data error:(NSError **)outError;
+- (NSData *)serializedData;
+
+@property (readonly) NSUInteger documentLength; // In bytes
+@property (readonly) NSUInteger characterCount; // Of the text a full parse produces
+
+@property (readonly) NSUInteger entryCount;
+- (OUIRTFDocumentIndexEntryKind)kindOfEntryAtIndex:(NSUInteger)entryIndex;
+- (NSUInteger)byteOffsetOfEntryAtIndex:(NSUInteger)entryIndex;
+- (NSUInteger)characterOffsetOfEntryAtIndex:(NSUInteger)entryIndex; // Where the entry's text starts in the output of a full parse
+
+// The last entry at or before the given offset, or NSNotFound if there are none
+- (NSUInteger)indexOfEntryForByteOffset:(NSUInteger)byteOffset;
+- (NSUInteger)indexOfEntryForCharacterOffset:(NSUInteger)characterOffset;
+
+// For OUIRTFReader, which writes and reads the snapshots and table definitions
+- (id)_initWithDocumentLength:(NSUInteger)documentLength;
+- (OFDataBuffer *)_snapshots;
+- (OFDataBuffer *)_fontDefinitions;
+- (OFDataBuffer *)_colorDefinitions;
+- (void)_addEntryOfKind:(OUIRTFDocumentIndexEntryKind)kind byteOffset:(NSUInteger)byteOffset characterOffset:(NSUInteger)characterOffset; // Whatever has been appended to -_snapshots since the last entry is this one's snapshot
+- (void)_setCharacterCount:(NSUInteger)characterCount;
+- (void)_getSnapshot:(const OFByte **)outSnapshot length:(NSUInteger *)outSnapshotLength fontDefinitions:(const OFByte **)outFontDefinitions length:(NSUInteger *)outFontDefinitionsLength colorDefinitions:(const OFByte **)outColorDefinitions length:(NSUInteger *)outColorDefinitionsLength forEntryAtIndex:(NSUInteger)entryIndex;
+- (void)_appendDefinitionsOfEntryAtIndex:(NSUInteger)entryIndex ofIndex:(OUIRTFDocumentIndex *)index; // The tables as they stood at that entry, for a reparse starting there
+- (void)_replaceEntriesInRange:(NSRange)entryRange withEntriesOfIndex:(OUIRTFDocumentIndex *)replacement characterOffset:(NSUInteger)replacementCharacterOffset byteDelta:(NSInteger)byteDelta characterDelta:(NSInteger)characterDelta keepDefinitions:(BOOL)keepDefinitions;
+
+@end
+
+// Reads back a value written by OFDataBufferAppendCompressedLongLongInt(), advancing the cursor. Returns NO if the bytes run out (or the value runs past 64 bits) first.
+static inline BOOL
+OUIRTFDocumentIndexReadCompressedInt(const OFByte **cursor, const OFByte *end, unsigned long long *outValue)
+{
+    unsigned long long value = 0;
+    unsigned int shift = 0;
+    const OFByte *position = *cursor;
+
+    while (position < end && shift < 64) {
+        OFByte byte = *position++;
+        value |= (unsigned long long)(byte & OF_COMPRESSED_INT_DATA_MASK) << shift;
+        if ((byte & OF_COMPRESSED_INT_CONTINUE_MASK) == 0) {
+            *cursor = position;
+            *outValue = value;
+            return YES;
+        }
+        shift += OF_COMPRESSED_INT_BITS_OF_DATA;
+    }
+    return NO;
+}
@@ -0,0 +1,370 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFDocumentIndex.h>
+
+#import <Foundation/NSData.h>
+#import <Foundation/NSError.h>
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+typedef struct _OUIRTFDocumentIndexEntry {
+    NSUInteger byteOffset;
+    NSUInteger characterOffset;
+    NSUInteger snapshotEnd; // The snapshot starts where the previous entry's ends
+    NSUInteger fontDefinitionsLength; // How many bytes of the font and color definitions had been written at this entry
+    NSUInteger colorDefinitionsLength;
+    OUIRTFDocumentIndexEntryKind kind;
+} OUIRTFDocumentIndexEntry;
+
+/*
+ Serialized form: the magic bytes, then compressed integers: the format version, the document length, the character count and the entry count; for each entry its kind, then the growth from the previous entry of its byte offset, character offset and font and color definition lengths, then its snapshot length; and finally the snapshots, font definitions and color definitions, each as a length followed by that many bytes.
+ The offsets only ever grow, so the deltas are almost all a byte or two.
+*/
+static const OFByte SerializedIndexMagic[4] = {'R', 'T', 'F', 'X'};
+#define OUIRTFDocumentIndexSerializedVersion (1)
+
+#define OUIRTFDocumentIndexInitialEntryCapacity (64)
+
+@implementation OUIRTFDocumentIndex
+
+- (id)_initWithDocumentLength:(NSUInteger)documentLength;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    _documentLength = documentLength;
+    OFDataBufferInit(&_snapshots);
+    OFDataBufferInit(&_fontDefinitions);
+    OFDataBufferInit(&_colorDefinitions);
+
+    return self;
+}
+
+static BOOL _readInteger(const OFByte **cursor, const OFByte *end, NSUInteger *outValue)
+{
+    unsigned long long value;
+    if (!OUIRTFDocumentIndexReadCompressedInt(cursor, end, &value) || value > NSUIntegerMax)
+        return NO;
+    *outValue = (NSUInteger)value;
+    return YES;
+}
+
+static BOOL _readBlob(const OFByte **cursor, const OFByte *end, OFDataBuffer *dataBuffer)
+{
+    NSUInteger length;
+    if (!_readInteger(cursor, end, &length) || length > (NSUInteger)(end - *cursor))
+        return NO;
+    OFDataBufferAppendBytes(dataBuffer, *cursor, length);
+    *cursor += length;
+    return YES;
+}
+
+- (id)initWithSerializedData:(NSData *)data error:(NSError **)outError;
+{
+    OBPRECONDITION(data != nil);
+
+    if (!(self = [self _initWithDocumentLength:0]))
+        return nil;
+
+    const OFByte *cursor = [data bytes];
+    const OFByte *end = cursor + [data length];
+    NSUInteger version, entryCount;
+
+    if ((NSUInteger)(end - cursor) < sizeof(SerializedIndexMagic) || memcmp(cursor, SerializedIndexMagic, sizeof(SerializedIndexMagic)) != 0)
+        goto corrupt;
+    cursor += sizeof(SerializedIndexMagic);
+
+    if (!_readInteger(&cursor, end, &version) || version != OUIRTFDocumentIndexSerializedVersion)
+        goto corrupt;
+    if (!_readInteger(&cursor, end, &_documentLength) || !_readInteger(&cursor, end, &_characterCount) || !_readInteger(&cursor, end, &entryCount))
+        goto corrupt;
+    if (entryCount > (NSUInteger)(end - cursor)) // Every entry takes some bytes; this keeps a bad count from asking for a huge allocation
+        goto corrupt;
+
+    _entryCapacity = MAX(entryCount, 1U);
+    _entries = malloc(sizeof(*_entries) * _entryCapacity);
+
+    OUIRTFDocumentIndexEntry previous = {0, 0, 0, 0, 0, 0};
+    for (NSUInteger entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        NSUInteger kind, byteDelta, characterDelta, fontDelta, colorDelta, snapshotLength;
+        if (!_readInteger(&cursor, end, &kind) || !_readInteger(&cursor, end, &byteDelta) || !_readInteger(&cursor, end, &characterDelta) ||
+            !_readInteger(&cursor, end, &fontDelta) || !_readInteger(&cursor, end, &colorDelta) || !_readInteger(&cursor, end, &snapshotLength))
+            goto corrupt;
+        if (kind > OUIRTFDocumentIndexEntryParagraphStart)
+            goto corrupt;
+
+        OUIRTFDocumentIndexEntry *entry = &_entries[_entryCount++];
+        entry->kind = (OUIRTFDocumentIndexEntryKind)kind;
+        entry->byteOffset = previous.byteOffset + byteDelta;
+        entry->characterOffset = previous.characterOffset + characterDelta;
+        entry->fontDefinitionsLength = previous.fontDefinitionsLength + fontDelta;
+        entry->colorDefinitionsLength = previous.colorDefinitionsLength + colorDelta;
+        entry->snapshotEnd = previous.snapshotEnd + snapshotLength;
+        if (entry->byteOffset < previous.byteOffset || entry->byteOffset > _documentLength ||
+            entry->characterOffset < previous.characterOffset || entry->characterOffset > _characterCount ||
+            entry->snapshotEnd < previous.snapshotEnd)
+            goto corrupt; // Out of range, or the sums wrapped around
+        previous = *entry;
+    }
+
+    if (!_readBlob(&cursor, end, &_snapshots) || !_readBlob(&cursor, end, &_fontDefinitions) || !_readBlob(&cursor, end, &_colorDefinitions) || cursor != end)
+        goto corrupt;
+    if (previous.snapshotEnd != OFDataBufferSpaceOccupied(&_snapshots) ||
+        previous.fontDefinitionsLength > OFDataBufferSpaceOccupied(&_fontDefinitions) ||
+        previous.colorDefinitionsLength > OFDataBufferSpaceOccupied(&_colorDefinitions))
+        goto corrupt;
+
+    return self;
+
+corrupt:
+    _OBError(outError, NSCocoaErrorDomain, NSFileReadCorruptFileError, __FILE__, __LINE__, NSLocalizedDescriptionKey, NSLocalizedStringFromTableInBundle(@"Unable to read RTF document index.", @"OmniUI", OMNI_BUNDLE, @"error description"), nil);
+    [self release];
+    return nil;
+}
+
+- (void)dealloc;
+{
+    free(_entries);
+    OFDataBufferRelease(&_snapshots, NULL, NULL);
+    OFDataBufferRelease(&_fontDefinitions, NULL, NULL);
+    OFDataBufferRelease(&_colorDefinitions, NULL, NULL);
+    [super dealloc];
+}
+
+static void _appendBlob(OFDataBuffer *dataBuffer, OFDataBuffer *blob)
+{
+    NSUInteger length = OFDataBufferSpaceOccupied(blob);
+    OFDataBufferAppendCompressedLongLongInt(dataBuffer, length);
+    if (length > 0)
+        OFDataBufferAppendBytes(dataBuffer, blob->buffer, length);
+}
+
+- (NSData *)serializedData;
+{
+    OFDataBuffer dataBuffer;
+    OFDataBufferInit(&dataBuffer);
+
+    OFDataBufferAppendBytes(&dataBuffer, SerializedIndexMagic, sizeof(SerializedIndexMagic));
+    OFDataBufferAppendCompressedLongLongInt(&dataBuffer, OUIRTFDocumentIndexSerializedVersion);
+    OFDataBufferAppendCompressedLongLongInt(&dataBuffer, _documentLength);
+    OFDataBufferAppendCompressedLongLongInt(&dataBuffer, _characterCount);
+    OFDataBufferAppendCompressedLongLongInt(&dataBuffer, _entryCount);
+
+    OUIRTFDocumentIndexEntry previous = {0, 0, 0, 0, 0, 0};
+    for (NSUInteger entryIndex = 0; entryIndex < _entryCount; entryIndex++) {
+        const OUIRTFDocumentIndexEntry *entry = &_entries[entryIndex];
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->kind);
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->byteOffset - previous.byteOffset);
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->characterOffset - previous.characterOffset);
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->fontDefinitionsLength - previous.fontDefinitionsLength);
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->colorDefinitionsLength - previous.colorDefinitionsLength);
+        OFDataBufferAppendCompressedLongLongInt(&dataBuffer, entry->snapshotEnd - previous.snapshotEnd);
+        previous = *entry;
+    }
+
+    _appendBlob(&dataBuffer, &_snapshots);
+    _appendBlob(&dataBuffer, &_fontDefinitions);
+    _appendBlob(&dataBuffer, &_colorDefinitions);
+
+    CFDataRef data = NULL;
+    OFDataBufferRelease(&dataBuffer, kCFAllocatorDefault, &data);
+    return [NSMakeCollectable(data) autorelease];
+}
+
+@synthesize documentLength = _documentLength;
+@synthesize characterCount = _characterCount;
+@synthesize entryCount = _entryCount;
+
+- (OUIRTFDocumentIndexEntryKind)kindOfEntryAtIndex:(NSUInteger)entryIndex;
+{
+    OBPRECONDITION(entryIndex < _entryCount);
+    return _entries[entryIndex].kind;
+}
+
+- (NSUInteger)byteOffsetOfEntryAtIndex:(NSUInteger)entryIndex;
+{
+    OBPRECONDITION(entryIndex < _entryCount);
+    return _entries[entryIndex].byteOffset;
+}
+
+- (NSUInteger)characterOffsetOfEntryAtIndex:(NSUInteger)entryIndex;
+{
+    OBPRECONDITION(entryIndex < _entryCount);
+    return _entries[entryIndex].characterOffset;
+}
+
+// Both offsets are nondecreasing through the entries, so one binary search serves for either
+#define FIND_LAST_ENTRY_AT_OR_BEFORE(field, offset) do { \
+    NSUInteger low = 0, high = _entryCount; \
+    while (low < high) { \
+        NSUInteger middle = low + (high - low) / 2; \
+        if (_entries[middle].field <= (offset)) \
+            low = middle + 1; \
+        else \
+            high = middle; \
+    } \
+    return low == 0 ? NSNotFound : low - 1; \
+} while (0)
+
+- (NSUInteger)indexOfEntryForByteOffset:(NSUInteger)byteOffset;
+{
+    FIND_LAST_ENTRY_AT_OR_BEFORE(byteOffset, byteOffset);
+}
+
+- (NSUInteger)indexOfEntryForCharacterOffset:(NSUInteger)characterOffset;
+{
+    FIND_LAST_ENTRY_AT_OR_BEFORE(characterOffset, characterOffset);
+}
+
+#pragma mark -
+#pragma mark For OUIRTFReader
+
+- (OFDataBuffer *)_snapshots;
+{
+    return &_snapshots;
+}
+
+- (OFDataBuffer *)_fontDefinitions;
+{
+    return &_fontDefinitions;
+}
+
+- (OFDataBuffer *)_colorDefinitions;
+{
+    return &_colorDefinitions;
+}
+
+- (void)_addEntryOfKind:(OUIRTFDocumentIndexEntryKind)kind byteOffset:(NSUInteger)byteOffset characterOffset:(NSUInteger)characterOffset;
+{
+    OBPRECONDITION(_entryCount == 0 || _entries[_entryCount - 1].byteOffset <= byteOffset);
+    OBPRECONDITION(_entryCount == 0 || _entries[_entryCount - 1].characterOffset <= characterOffset);
+
+    if (_entryCount == _entryCapacity) {
+        _entryCapacity = _entryCapacity == 0 ? OUIRTFDocumentIndexInitialEntryCapacity : 2 * _entryCapacity;
+        _entries = realloc(_entries, sizeof(*_entries) * _entryCapacity);
+    }
+
+    OUIRTFDocumentIndexEntry *entry = &_entries[_entryCount++];
+    entry->kind = kind;
+    entry->byteOffset = byteOffset;
+    entry->characterOffset = characterOffset;
+    entry->snapshotEnd = OFDataBufferSpaceOccupied(&_snapshots);
+    entry->fontDefinitionsLength = OFDataBufferSpaceOccupied(&_fontDefinitions);
+    entry->colorDefinitionsLength = OFDataBufferSpaceOccupied(&_colorDefinitions);
+}
+
+- (void)_setCharacterCount:(NSUInteger)characterCount;
+{
+    _characterCount = characterCount;
+}
+
+- (void)_getSnapshot:(const OFByte **)outSnapshot length:(NSUInteger *)outSnapshotLength fontDefinitions:(const OFByte **)outFontDefinitions length:(NSUInteger *)outFontDefinitionsLength colorDefinitions:(const OFByte **)outColorDefinitions length:(NSUInteger *)outColorDefinitionsLength forEntryAtIndex:(NSUInteger)entryIndex;
+{
+    OBPRECONDITION(entryIndex < _entryCount);
+
+    const OUIRTFDocumentIndexEntry *entry = &_entries[entryIndex];
+    NSUInteger snapshotStart = entryIndex == 0 ? 0 : _entries[entryIndex - 1].snapshotEnd;
+    *outSnapshot = _snapshots.buffer + snapshotStart;
+    *outSnapshotLength = entry->snapshotEnd - snapshotStart;
+    *outFontDefinitions = _fontDefinitions.buffer;
+    *outFontDefinitionsLength = entry->fontDefinitionsLength;
+    *outColorDefinitions = _colorDefinitions.buffer;
+    *outColorDefinitionsLength = entry->colorDefinitionsLength;
+}
+
+- (void)_appendDefinitionsOfEntryAtIndex:(NSUInteger)entryIndex ofIndex:(OUIRTFDocumentIndex *)index;
+{
+    OBPRECONDITION(entryIndex < index->_entryCount);
+    OBPRECONDITION(_entryCount == 0);
+
+    const OUIRTFDocumentIndexEntry *entry = &index->_entries[entryIndex];
+    OFDataBufferAppendBytes(&_fontDefinitions, index->_fontDefinitions.buffer, entry->fontDefinitionsLength);
+    OFDataBufferAppendBytes(&_colorDefinitions, index->_colorDefinitions.buffer, entry->colorDefinitionsLength);
+}
+
+static inline NSUInteger _snapshotStartOfEntry(OUIRTFDocumentIndex *self, NSUInteger entryIndex)
+{
+    return entryIndex == 0 ? 0 : self->_entries[entryIndex - 1].snapshotEnd;
+}
+
+/*
+ Splices in the entries from a reparse after an edit. The replacement's byte offsets are already in terms of the edited document; its character offsets are relative to replacementCharacterOffset. Entries after the range are shifted by the deltas and keep their snapshots.
+ The replacement index's definitions start with ours as they stood before the range (see -_appendDefinitionsOfEntryAtIndex:ofIndex:). If the reparse caught up with us, they match ours up to the end of the range too and we keep our own; otherwise the reparse ran to the end of the document and we take all of its definitions.
+*/
+- (void)_replaceEntriesInRange:(NSRange)entryRange withEntriesOfIndex:(OUIRTFDocumentIndex *)replacement characterOffset:(NSUInteger)replacementCharacterOffset byteDelta:(NSInteger)byteDelta characterDelta:(NSInteger)characterDelta keepDefinitions:(BOOL)keepDefinitions;
+{
+    OBPRECONDITION(NSMaxRange(entryRange) <= _entryCount);
+    OBPRECONDITION(keepDefinitions || NSMaxRange(entryRange) == _entryCount);
+
+    NSUInteger oldSnapshotStart = _snapshotStartOfEntry(self, entryRange.location);
+    NSUInteger oldSnapshotEnd = _snapshotStartOfEntry(self, NSMaxRange(entryRange));
+    NSUInteger replacementSnapshotLength = OFDataBufferSpaceOccupied(&replacement->_snapshots);
+    NSInteger snapshotDelta = (NSInteger)replacementSnapshotLength - (NSInteger)(oldSnapshotEnd - oldSnapshotStart);
+
+    // Snapshots: ours before the range, the replacement's, then ours after the range
+    if (snapshotDelta != 0 || replacementSnapshotLength != 0) {
+        NSUInteger tailLength = OFDataBufferSpaceOccupied(&_snapshots) - oldSnapshotEnd;
+        if (snapshotDelta > 0)
+            OFDataBufferGetPointer(&_snapshots, snapshotDelta);
+        memmove(_snapshots.buffer + oldSnapshotEnd + snapshotDelta, _snapshots.buffer + oldSnapshotEnd, tailLength);
+        memcpy(_snapshots.buffer + oldSnapshotStart, replacement->_snapshots.buffer, replacementSnapshotLength);
+        _snapshots.writeStart += snapshotDelta;
+    }
+
+    // Entries likewise
+    NSUInteger tailIndex = NSMaxRange(entryRange);
+    NSUInteger tailCount = _entryCount - tailIndex;
+    NSUInteger newEntryCount = _entryCount - entryRange.length + replacement->_entryCount;
+    if (newEntryCount > _entryCapacity) {
+        _entryCapacity = MAX(newEntryCount, 2 * _entryCapacity);
+        _entries = realloc(_entries, sizeof(*_entries) * _entryCapacity);
+    }
+    OUIRTFDocumentIndexEntry *newTail = _entries + entryRange.location + replacement->_entryCount;
+    memmove(newTail, _entries + tailIndex, sizeof(*_entries) * tailCount);
+    for (NSUInteger entryIndex = 0; entryIndex < replacement->_entryCount; entryIndex++) {
+        OUIRTFDocumentIndexEntry *entry = &_entries[entryRange.location + entryIndex];
+        *entry = replacement->_entries[entryIndex];
+        entry->characterOffset += replacementCharacterOffset;
+        entry->snapshotEnd += oldSnapshotStart;
+    }
+    for (NSUInteger entryIndex = 0; entryIndex < tailCount; entryIndex++) {
+        OUIRTFDocumentIndexEntry *entry = &newTail[entryIndex];
+        entry->byteOffset += byteDelta;
+        entry->characterOffset += characterDelta;
+        entry->snapshotEnd += snapshotDelta;
+    }
+    _entryCount = newEntryCount;
+
+    if (!keepDefinitions) {
+        OFDataBuffer swap = _fontDefinitions;
+        _fontDefinitions = replacement->_fontDefinitions;
+        replacement->_fontDefinitions = swap;
+        swap = _colorDefinitions;
+        _colorDefinitions = replacement->_colorDefinitions;
+        replacement->_colorDefinitions = swap;
+    }
+
+    _documentLength += byteDelta;
+    _characterCount += characterDelta;
+}
+
+#pragma mark -
+#pragma mark Debugging
+
+- (NSMutableDictionary *)debugDictionary;
+{
+    NSMutableDictionary *debugDictionary = [super debugDictionary];
+    [debugDictionary setObject:[NSString stringWithFormat:@"%lu", _documentLength] forKey:@"documentLength"];
+    [debugDictionary setObject:[NSString stringWithFormat:@"%lu", _characterCount] forKey:@"characterCount"];
+    [debugDictionary setObject:[NSString stringWithFormat:@"%lu", _entryCount] forKey:@"entryCount"];
+    [debugDictionary setObject:[NSString stringWithFormat:@"%lu", OFDataBufferSpaceOccupied(&_snapshots)] forKey:@"snapshotBytes"];
+    return debugDictionary;
+}
+
+@end
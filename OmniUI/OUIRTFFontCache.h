@@ -0,0 +1,48 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+#import <OmniAppKit/OAFontDescriptor.h> // OAFontDescriptorPlatformFont
+
+@class NSLock, NSString;
+
+/*
+ Remembers the platform fonts the RTF reader has resolved, keyed by family name, size and bold/italic traits. Building an OAFontDescriptor, deriving its bold and italic variants and resolving the font is the most expensive thing the reader does per style, and a process parsing many documents tends to see the same handful of fonts over and over.
+ The cache is bounded; once it's full, the least recently used font is dropped. All methods may be called from any thread.
+*/
+
+typedef struct _OUIRTFFontCacheEntry OUIRTFFontCacheEntry;
+
+@interface OUIRTFFontCache : OFObject
+{
+@private
+    NSLock *_lock;
+    CFMutableDictionaryRef _entriesByKey;
+    OUIRTFFontCacheEntry *_mostRecentlyUsed; // Head of a doubly linked list in use order
+    OUIRTFFontCacheEntry *_leastRecentlyUsed;
+    NSUInteger _capacity;
+    NSUInteger _hitCount;
+    NSUInteger _missCount;
+}
+
++ (OUIRTFFontCache *)sharedCache;
+
+- initWithCapacity:(NSUInteger)capacity;
+
+- (OAFontDescriptorPlatformFont)fontWithFamilyName:(NSString *)familyName size:(CGFloat)size bold:(BOOL)bold italic:(BOOL)italic;
+    // A size of zero or less leaves the size up to the font descriptor. The font is autoreleased, so it stays valid even if another thread evicts it.
+
+- (void)removeAllFonts;
+    // Call this when the set of installed fonts changes.
+
+@property (readonly) NSUInteger count;
+@property (readonly) NSUInteger hitCount;
+@property (readonly) NSUInteger missCount;
+
+@end
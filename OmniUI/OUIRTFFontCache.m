@@ -0,0 +1,252 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFFontCache.h>
+
+#import <Foundation/NSLock.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniFoundation/OFCFCallbacks.h>
+#import <OmniFoundation/NSNumber-OFExtensions-CGTypes.h>
+
+#if defined(TARGET_OS_IPHONE) && TARGET_OS_IPHONE
+#import <CoreText/CTFontDescriptor.h>
+#endif
+
+RCS_ID("$Id$");
+
+#define OUIRTFFontCacheDefaultCapacity (64)
+
+struct _OUIRTFFontCacheEntry {
+    // Key
+    NSString *familyName;
+    CGFloat size;
+    BOOL bold;
+    BOOL italic;
+
+    id font;
+    OUIRTFFontCacheEntry *previous; // More recently used
+    OUIRTFFontCacheEntry *next; // Less recently used
+};
+
+static Boolean _entryKeyEqual(const void *value1, const void *value2)
+{
+    const OUIRTFFontCacheEntry *a = value1, *b = value2;
+    return a->size == b->size && a->bold == b->bold && a->italic == b->italic && [a->familyName isEqualToString:b->familyName];
+}
+
+static CFHashCode _entryKeyHash(const void *value)
+{
+    const OUIRTFFontCacheEntry *entry = value;
+    return [entry->familyName hash] ^ ((CFHashCode)(entry->size * 2.0f) << 2) ^ (entry->bold << 1) ^ entry->italic;
+}
+
+// The entries are owned by the list, not the dictionary
+static const CFDictionaryKeyCallBacks EntryKeyCallbacks = {
+    0, // version
+    NULL, // retain
+    NULL, // release
+    NULL, // copyDescription
+    _entryKeyEqual,
+    _entryKeyHash,
+};
+
+static OAFontDescriptorPlatformFont _newResolvedFont(NSString *familyName, CGFloat size, BOOL bold, BOOL italic)
+{
+    NSMutableDictionary *fontAttributes = [[NSMutableDictionary alloc] init];
+    [fontAttributes setObject:familyName forKey:(id)kCTFontNameAttribute];
+    if (size > 0.0)
+        [fontAttributes setObject:[NSNumber numberWithCGFloat:size] forKey:(id)kCTFontSizeAttribute];
+    OAFontDescriptor *fontDescriptor = [[OAFontDescriptor alloc] initWithFontAttributes:fontAttributes];
+    [fontAttributes release];
+    if (bold) {
+        OAFontDescriptor *boldDescriptor = [fontDescriptor newFontDescriptorWithBold:YES];
+        [fontDescriptor release];
+        fontDescriptor = boldDescriptor;
+    }
+    if (italic) {
+        OAFontDescriptor *italicDescriptor = [fontDescriptor newFontDescriptorWithItalic:YES];
+        [fontDescriptor release];
+        fontDescriptor = italicDescriptor;
+    }
+    OAFontDescriptorPlatformFont font = (OAFontDescriptorPlatformFont)[(id)[fontDescriptor font] retain];
+
+#ifdef OMNI_ASSERTIONS_ON
+    // Only checked on a miss, so a font that survives this is never checked again
+    OBASSERT([fontDescriptor bold] == bold);
+    OBASSERT([fontDescriptor italic] == italic);
+    OAFontDescriptor *resolvedFontDescriptor = [[OAFontDescriptor alloc] initWithFont:font];
+    OBASSERT([resolvedFontDescriptor bold] == bold);
+    OBASSERT([resolvedFontDescriptor italic] == italic);
+    [resolvedFontDescriptor release];
+#endif
+
+    [fontDescriptor release];
+    return font;
+}
+
+@implementation OUIRTFFontCache
+
+static OUIRTFFontCache *SharedCache = nil;
+
++ (void)initialize;
+{
+    OBINITIALIZE;
+
+    SharedCache = [[self alloc] initWithCapacity:OUIRTFFontCacheDefaultCapacity];
+}
+
++ (OUIRTFFontCache *)sharedCache;
+{
+    return SharedCache;
+}
+
+- init;
+{
+    return [self initWithCapacity:OUIRTFFontCacheDefaultCapacity];
+}
+
+- initWithCapacity:(NSUInteger)capacity;
+{
+    OBPRECONDITION(capacity > 0);
+
+    if (!(self = [super init]))
+        return nil;
+
+    _lock = [[NSLock alloc] init];
+    _entriesByKey = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &EntryKeyCallbacks, &OFNonOwnedPointerDictionaryValueCallbacks);
+    _capacity = MAX(capacity, 1U);
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [self removeAllFonts];
+    CFRelease(_entriesByKey);
+    [_lock release];
+    [super dealloc];
+}
+
+static void _unlinkEntry(OUIRTFFontCache *self, OUIRTFFontCacheEntry *entry)
+{
+    if (entry->previous != NULL)
+        entry->previous->next = entry->next;
+    else
+        self->_mostRecentlyUsed = entry->next;
+    if (entry->next != NULL)
+        entry->next->previous = entry->previous;
+    else
+        self->_leastRecentlyUsed = entry->previous;
+    entry->previous = NULL;
+    entry->next = NULL;
+}
+
+static void _linkEntryAsMostRecent(OUIRTFFontCache *self, OUIRTFFontCacheEntry *entry)
+{
+    entry->previous = NULL;
+    entry->next = self->_mostRecentlyUsed;
+    if (self->_mostRecentlyUsed != NULL)
+        self->_mostRecentlyUsed->previous = entry;
+    self->_mostRecentlyUsed = entry;
+    if (self->_leastRecentlyUsed == NULL)
+        self->_leastRecentlyUsed = entry;
+}
+
+static void _freeEntry(OUIRTFFontCacheEntry *entry)
+{
+    [entry->familyName release];
+    [entry->font release];
+    free(entry);
+}
+
+- (OAFontDescriptorPlatformFont)fontWithFamilyName:(NSString *)familyName size:(CGFloat)size bold:(BOOL)bold italic:(BOOL)italic;
+{
+    OBPRECONDITION(familyName != nil);
+
+    if (size < 0.0)
+        size = 0.0; // All "unspecified"
+    OUIRTFFontCacheEntry key = {familyName, size, bold != NO, italic != NO, nil, NULL, NULL};
+    id font;
+
+    [_lock lock];
+    OUIRTFFontCacheEntry *entry = (OUIRTFFontCacheEntry *)CFDictionaryGetValue(_entriesByKey, &key);
+    if (entry != NULL) {
+        _hitCount++;
+        if (entry != _mostRecentlyUsed) {
+            _unlinkEntry(self, entry);
+            _linkEntryAsMostRecent(self, entry);
+        }
+        font = [[entry->font retain] autorelease];
+        [_lock unlock];
+        return (OAFontDescriptorPlatformFont)font;
+    }
+    _missCount++;
+    [_lock unlock];
+
+    // Resolve without the lock so that other threads' hits don't wait on us
+    font = (id)_newResolvedFont(familyName, size, key.bold, key.italic);
+
+    [_lock lock];
+    if (CFDictionaryGetValue(_entriesByKey, &key) == NULL) { // Another thread may have resolved the same font in the meantime; theirs is just as good
+        entry = calloc(1, sizeof(*entry));
+        entry->familyName = [familyName copy];
+        entry->size = key.size;
+        entry->bold = key.bold;
+        entry->italic = key.italic;
+        entry->font = [font retain];
+        CFDictionarySetValue(_entriesByKey, entry, entry);
+        _linkEntryAsMostRecent(self, entry);
+
+        if ((NSUInteger)CFDictionaryGetCount(_entriesByKey) > _capacity) {
+            OUIRTFFontCacheEntry *evicted = _leastRecentlyUsed;
+            OBASSERT(evicted != entry);
+            _unlinkEntry(self, evicted);
+            CFDictionaryRemoveValue(_entriesByKey, evicted);
+            _freeEntry(evicted);
+        }
+    }
+    [_lock unlock];
+
+    return (OAFontDescriptorPlatformFont)[font autorelease];
+}
+
+- (void)removeAllFonts;
+{
+    [_lock lock];
+    CFDictionaryRemoveAllValues(_entriesByKey);
+    OUIRTFFontCacheEntry *entry = _mostRecentlyUsed;
+    _mostRecentlyUsed = NULL;
+    _leastRecentlyUsed = NULL;
+    [_lock unlock];
+
+    // Release the fonts outside the lock
+    while (entry != NULL) {
+        OUIRTFFontCacheEntry *next = entry->next;
+        _freeEntry(entry);
+        entry = next;
+    }
+}
+
+- (NSUInteger)count;
+{
+    [_lock lock];
+    NSUInteger count = CFDictionaryGetCount(_entriesByKey);
+    [_lock unlock];
+    return count;
+}
+
+- (NSUInteger)hitCount;
+{
+    return _hitCount;
+}
+
+- (NSUInteger)missCount;
+{
+    return _missCount;
+}
+
+@end
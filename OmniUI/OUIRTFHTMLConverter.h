@@ -0,0 +1,44 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+#import <OmniFoundation/OFDataBuffer.h>
+#import <OmniUI/OUIRTFReaderDelegate.h>
+
+@class NSData, NSError, NSMutableDictionary;
+@class OUIRTFReaderOptions;
+
+/*
+ Converts RTF to a UTF-8 HTML document as it's read, from the reader's events rather than by way of an attributed string. Each paragraph becomes a <p>, styled with its alignment and indents, and each run of text with character formatting becomes a <span> styled with its font, size, weight, slant, underline, colors and baseline. Text is escaped as it's copied into the output buffer, and the buffer is written to the file descriptor whenever it fills a chunk, so memory use doesn't grow with the document.
+ If one of the options' limits stops the parse, the document is closed off where it stopped and the error says which limit it was. If a write fails, nothing more is written and the error is the write's.
+*/
+
+@interface OUIRTFHTMLConverter : OFObject <OUIRTFReaderDelegate>
+{
+@private
+    int _fd;
+    OFDataBuffer _buffer;
+    int _writeErrno; // From the first write that failed, or zero
+    NSMutableDictionary *_fontFamilies; // Font number -> name, with anything that would need quoting in CSS left out
+    int *_colors; // 0xRRGGBB, or -1 for the default color
+    NSUInteger _colorCount, _colorCapacity;
+    OUIRTFReaderFormatting _formatting; // As last reported
+    unichar _pendingHighSurrogate; // A pair can be split between two runs of text
+    struct {
+        unsigned int hasFormatting:1; // The reader doesn't report formatting for plain text
+        unsigned int inParagraph:1;
+        unsigned int inSpan:1;
+        unsigned int spanIsCurrent:1; // We've opened a span for the current formatting, or found it didn't need one
+    } _flags;
+}
+
++ (BOOL)convertRTFData:(NSData *)rtfData toFileDescriptor:(int)outputFD options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
++ (BOOL)convertRTFFromFileDescriptor:(int)inputFD toFileDescriptor:(int)outputFD options:(OUIRTFReaderOptions *)options error:(NSError **)outError; // Reads to end of file; closes neither descriptor
+
+@end
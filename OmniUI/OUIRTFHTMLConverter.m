@@ -0,0 +1,467 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFHTMLConverter.h>
+
+#import <Foundation/NSDictionary.h>
+#import <Foundation/NSValue.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniUI/OUIRTFReader.h>
+
+#if defined(TARGET_OS_IPHONE) && TARGET_OS_IPHONE
+#import <CoreText/CTStringAttributes.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+RCS_ID("$Id$");
+
+#define OUIRTFHTMLConverterChunkLength (64 * 1024) // Bytes of HTML we hold before writing them out
+#define OUIRTFHTMLConverterSliceLength (1024) // Characters escaped at a time, so that a long run can't take the buffer far past a chunk
+#define OUIRTFHTMLConverterMaximumBytesPerCharacter (6) // "&quot;"; nothing else we write for one UTF-16 character is longer
+
+@interface OUIRTFHTMLConverter ()
+- (id)_initWithFileDescriptor:(int)fd;
+- (void)_writeChunkIfNeeded;
+- (void)_writeBuffer;
+- (void)_openParagraph;
+- (void)_closeParagraph;
+- (void)_appendColorAtIndex:(int)colorIndex forProperty:(const char *)property hasProperty:(BOOL *)hasProperty;
+- (void)_openSpanIfNeeded;
+- (void)_endRun;
+- (BOOL)_finishDocumentWithParseError:(NSError *)parseError error:(NSError **)outError;
+@end
+
+// Only what goes into a span's style; the paragraph fields go on the <p>
+static BOOL _characterFormattingEqual(const OUIRTFReaderFormatting *a, const OUIRTFReaderFormatting *b)
+{
+    return a->fontSize == b->fontSize &&
+        a->fontNumber == b->fontNumber &&
+        a->foregroundColorIndex == b->foregroundColorIndex &&
+        a->backgroundColorIndex == b->backgroundColorIndex &&
+        a->underline == b->underline &&
+        a->superscriptCount == b->superscriptCount &&
+        a->bold == b->bold &&
+        a->italic == b->italic;
+}
+
+static inline OFByte *_appendUTF8(OFByte *ptr, UnicodeScalarValue c)
+{
+    if (c < 0x80) {
+        *ptr++ = (OFByte)c;
+    } else if (c < 0x800) {
+        *ptr++ = (OFByte)(0xC0 | (c >> 6));
+        *ptr++ = (OFByte)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        *ptr++ = (OFByte)(0xE0 | (c >> 12));
+        *ptr++ = (OFByte)(0x80 | ((c >> 6) & 0x3F));
+        *ptr++ = (OFByte)(0x80 | (c & 0x3F));
+    } else {
+        *ptr++ = (OFByte)(0xF0 | (c >> 18));
+        *ptr++ = (OFByte)(0x80 | ((c >> 12) & 0x3F));
+        *ptr++ = (OFByte)(0x80 | ((c >> 6) & 0x3F));
+        *ptr++ = (OFByte)(0x80 | (c & 0x3F));
+    }
+    return ptr;
+}
+
+static inline OFByte *_appendBytes(OFByte *ptr, const char *bytes, size_t length)
+{
+    memcpy(ptr, bytes, length);
+    return ptr + length;
+}
+
+// Like OFDataBufferAppendXMLQuotedString(), but for characters as the reader hands them over, and writing UTF-8 rather than a numeric reference for everything outside ASCII. Line separators become <br>, and other control characters besides tab are dropped. A high surrogate at the end is held in *pendingHighSurrogate for the next call; one that isn't followed by a low surrogate, or a low surrogate on its own, becomes U+FFFD.
+static void _appendEscapedCharacters(OFDataBuffer *buffer, const unichar *characters, NSUInteger length, unichar *pendingHighSurrogate)
+{
+    OFByte *start = OFDataBufferGetPointer(buffer, (length + 1) * OUIRTFHTMLConverterMaximumBytesPerCharacter);
+    OFByte *ptr = start;
+
+    for (NSUInteger characterIndex = 0; characterIndex < length; characterIndex++) {
+        unichar c = characters[characterIndex];
+
+        if (*pendingHighSurrogate != 0) {
+            unichar highSurrogate = *pendingHighSurrogate;
+            *pendingHighSurrogate = 0;
+            if (CFStringIsSurrogateLowCharacter(c)) {
+                ptr = _appendUTF8(ptr, CFStringGetLongCharacterForSurrogatePair(highSurrogate, c));
+                continue;
+            }
+            ptr = _appendUTF8(ptr, 0xFFFD);
+        }
+
+        switch (c) {
+            case '&':
+                ptr = _appendBytes(ptr, "&amp;", 5);
+                break;
+            case '<':
+                ptr = _appendBytes(ptr, "&lt;", 4);
+                break;
+            case '>':
+                ptr = _appendBytes(ptr, "&gt;", 4);
+                break;
+            case '"':
+                ptr = _appendBytes(ptr, "&quot;", 6);
+                break;
+            case '\t':
+                *ptr++ = '\t';
+                break;
+            case '\n':
+            case 0x2028: // LINE SEPARATOR
+            case 0x2029: // PARAGRAPH SEPARATOR, which the reader only gives us inside a paragraph
+                ptr = _appendBytes(ptr, "<br>", 4);
+                break;
+            default:
+                if (c < 0x20 || c == 0x7F)
+                    break;
+                if (CFStringIsSurrogateHighCharacter(c))
+                    *pendingHighSurrogate = c;
+                else if (CFStringIsSurrogateLowCharacter(c))
+                    ptr = _appendUTF8(ptr, 0xFFFD);
+                else
+                    ptr = _appendUTF8(ptr, c);
+                break;
+        }
+    }
+
+    OFDataBufferDidAppend(buffer, ptr - start);
+}
+
+static void _appendPoints(OFDataBuffer *buffer, double points)
+{
+    char string[32];
+    snprintf(string, sizeof(string), "%gpt", points);
+    OFDataBufferAppendCString(buffer, string);
+}
+
+static void _appendTwipsAsPoints(OFDataBuffer *buffer, int twips)
+{
+    _appendPoints(buffer, twips / 20.0);
+}
+
+// Starts a property in a style attribute, separating it from the one before if there was one
+static void _appendStyleProperty(OFDataBuffer *buffer, BOOL *hasProperty, const char *property)
+{
+    if (*hasProperty)
+        OFDataBufferAppendByte(buffer, ';');
+    *hasProperty = YES;
+    OFDataBufferAppendCString(buffer, property);
+    OFDataBufferAppendByte(buffer, ':');
+}
+
+@implementation OUIRTFHTMLConverter
+
++ (BOOL)convertRTFData:(NSData *)rtfData toFileDescriptor:(int)outputFD options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
+{
+    OBPRECONDITION(rtfData != nil);
+
+    OUIRTFHTMLConverter *converter = [[self alloc] _initWithFileDescriptor:outputFD];
+    NSError *parseError = nil;
+    BOOL parsed = [OUIRTFReader parseRTFData:rtfData delegate:converter options:options error:&parseError];
+    BOOL success = [converter _finishDocumentWithParseError:(parsed ? nil : parseError) error:outError];
+    [converter release];
+    return success;
+}
+
++ (BOOL)convertRTFFromFileDescriptor:(int)inputFD toFileDescriptor:(int)outputFD options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
+{
+    OUIRTFHTMLConverter *converter = [[self alloc] _initWithFileDescriptor:outputFD];
+    NSError *parseError = nil;
+    BOOL parsed = [OUIRTFReader parseRTFFromFileDescriptor:inputFD delegate:converter options:options error:&parseError];
+    BOOL success = [converter _finishDocumentWithParseError:(parsed ? nil : parseError) error:outError];
+    [converter release];
+    return success;
+}
+
+- (void)dealloc;
+{
+    OFDataBufferRelease(&_buffer, kCFAllocatorDefault, NULL);
+    [_fontFamilies release];
+    free(_colors);
+    [super dealloc];
+}
+
+#pragma mark -
+#pragma mark OUIRTFReaderDelegate
+
+- (void)rtfReader:(OUIRTFReader *)reader foundCharacters:(const unichar *)characters length:(NSUInteger)length;
+{
+    if (_writeErrno != 0)
+        return;
+
+    if (!_flags.inParagraph)
+        [self _openParagraph];
+    [self _openSpanIfNeeded];
+
+    NSUInteger offset = 0;
+    while (offset < length) {
+        NSUInteger sliceLength = MIN(length - offset, (NSUInteger)OUIRTFHTMLConverterSliceLength);
+        _appendEscapedCharacters(&_buffer, characters + offset, sliceLength, &_pendingHighSurrogate);
+        offset += sliceLength;
+        [self _writeChunkIfNeeded];
+    }
+}
+
+- (void)rtfReader:(OUIRTFReader *)reader didChangeFormatting:(const OUIRTFReaderFormatting *)formatting;
+{
+    if (_writeErrno == 0 && (!_flags.hasFormatting || !_characterFormattingEqual(&_formatting, formatting)))
+        [self _endRun];
+    _formatting = *formatting;
+    _flags.hasFormatting = 1;
+}
+
+- (void)rtfReaderFoundParagraphBreak:(OUIRTFReader *)reader;
+{
+    if (_writeErrno != 0)
+        return;
+
+    if (!_flags.inParagraph) {
+        [self _openParagraph];
+        OFDataBufferAppendCString(&_buffer, "<br>"); // Otherwise an empty paragraph takes no space
+    }
+    [self _closeParagraph];
+    [self _writeChunkIfNeeded];
+}
+
+- (void)rtfReaderFoundPageBreak:(OUIRTFReader *)reader;
+{
+    if (_writeErrno != 0)
+        return;
+
+    if (_flags.inParagraph)
+        [self _closeParagraph];
+    OFDataBufferAppendCString(&_buffer, "<div style=\"page-break-after:always\"></div>\n");
+    [self _writeChunkIfNeeded];
+}
+
+- (void)rtfReader:(OUIRTFReader *)reader foundFontTableEntry:(int)fontNumber name:(NSString *)fontName encoding:(CFStringEncoding)encoding;
+{
+    // The family goes in single quotes inside a double-quoted attribute, and the browser undoes entities before CSS sees them, so we drop what would end either rather than escaping it
+    NSMutableString *family = [NSMutableString string];
+    NSUInteger characterCount = [fontName length];
+    for (NSUInteger characterIndex = 0; characterIndex < characterCount; characterIndex++) {
+        unichar c = [fontName characterAtIndex:characterIndex];
+        if (c < 0x20 || c == '\'' || c == '"' || c == '\\' || c == ';' || c == '<' || c == '>' || c == '&' || c == '{' || c == '}')
+            continue;
+        [family appendFormat:@"%C", c];
+    }
+    if ([family length] == 0)
+        return;
+
+    if (_fontFamilies == nil)
+        _fontFamilies = [[NSMutableDictionary alloc] init];
+    [_fontFamilies setObject:[family dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES] forKey:[NSNumber numberWithInt:fontNumber]];
+}
+
+- (void)rtfReader:(OUIRTFReader *)reader foundColorTableEntry:(NSUInteger)colorIndex red:(int)red green:(int)green blue:(int)blue;
+{
+    OBPRECONDITION(colorIndex == _colorCount); // The reader numbers them as it reads them
+
+    if (_colorCount == _colorCapacity) {
+        _colorCapacity = MAX(16U, 2 * _colorCapacity);
+        _colors = (int *)realloc(_colors, _colorCapacity * sizeof(*_colors));
+    }
+    if (red < 0 || green < 0 || blue < 0)
+        _colors[_colorCount++] = -1;
+    else
+        _colors[_colorCount++] = (MIN(red, 255) << 16) | (MIN(green, 255) << 8) | MIN(blue, 255);
+}
+
+#pragma mark -
+#pragma mark Private
+
+- (id)_initWithFileDescriptor:(int)fd;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    _fd = fd;
+    OFDataBufferInit(&_buffer);
+    OFDataBufferSetCapacity(&_buffer, OUIRTFHTMLConverterChunkLength + OUIRTFHTMLConverterSliceLength * OUIRTFHTMLConverterMaximumBytesPerCharacter);
+    OFDataBufferAppendCString(&_buffer, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n</head>\n<body>\n");
+
+    return self;
+}
+
+- (void)_writeChunkIfNeeded;
+{
+    if (OFDataBufferSpaceOccupied(&_buffer) >= OUIRTFHTMLConverterChunkLength)
+        [self _writeBuffer];
+}
+
+// Once a write has failed we throw away whatever else we're given; the reader has no way to be told to stop
+- (void)_writeBuffer;
+{
+    const OFByte *bytes = _buffer.buffer;
+    size_t remaining = OFDataBufferSpaceOccupied(&_buffer);
+    while (remaining > 0 && _writeErrno == 0) {
+        ssize_t written = write(_fd, bytes, remaining);
+        if (written < 0) {
+            if (OMNI_ERRNO() != EINTR)
+                _writeErrno = OMNI_ERRNO();
+            continue;
+        }
+        bytes += written;
+        remaining -= written;
+    }
+    _buffer.writeStart = _buffer.buffer;
+}
+
+- (void)_openParagraph;
+{
+    OBPRECONDITION(!_flags.inParagraph);
+
+    OFDataBufferAppendCString(&_buffer, "<p");
+    if (_flags.hasFormatting) {
+        size_t mark = OFDataBufferSpaceOccupied(&_buffer);
+        BOOL hasProperty = NO;
+        OFDataBufferAppendCString(&_buffer, " style=\"");
+        switch (_formatting.paragraph.alignment) {
+            case kCTRightTextAlignment:
+                _appendStyleProperty(&_buffer, &hasProperty, "text-align");
+                OFDataBufferAppendCString(&_buffer, "right");
+                break;
+            case kCTCenterTextAlignment:
+                _appendStyleProperty(&_buffer, &hasProperty, "text-align");
+                OFDataBufferAppendCString(&_buffer, "center");
+                break;
+            case kCTJustifiedTextAlignment:
+                _appendStyleProperty(&_buffer, &hasProperty, "text-align");
+                OFDataBufferAppendCString(&_buffer, "justify");
+                break;
+            default:
+                break;
+        }
+        if (_formatting.paragraph.leftIndent != 0) {
+            _appendStyleProperty(&_buffer, &hasProperty, "margin-left");
+            _appendTwipsAsPoints(&_buffer, _formatting.paragraph.leftIndent);
+        }
+        if (_formatting.paragraph.rightIndent != OUIRTFReaderNoRightIndent && _formatting.paragraph.rightIndent != 0) {
+            _appendStyleProperty(&_buffer, &hasProperty, "margin-right");
+            _appendTwipsAsPoints(&_buffer, _formatting.paragraph.rightIndent);
+        }
+        if (_formatting.paragraph.firstLineIndent != 0) {
+            _appendStyleProperty(&_buffer, &hasProperty, "text-indent");
+            _appendTwipsAsPoints(&_buffer, _formatting.paragraph.firstLineIndent);
+        }
+        if (hasProperty)
+            OFDataBufferAppendByte(&_buffer, '"');
+        else
+            _buffer.writeStart = _buffer.buffer + mark; // Nothing to say after all
+    }
+    OFDataBufferAppendByte(&_buffer, '>');
+    _flags.inParagraph = 1;
+}
+
+- (void)_closeParagraph;
+{
+    OBPRECONDITION(_flags.inParagraph);
+
+    [self _endRun];
+    OFDataBufferAppendCString(&_buffer, "</p>\n");
+    _flags.inParagraph = 0;
+}
+
+- (void)_appendColorAtIndex:(int)colorIndex forProperty:(const char *)property hasProperty:(BOOL *)hasProperty;
+{
+    if (colorIndex < 0 || (NSUInteger)colorIndex >= _colorCount || _colors[colorIndex] < 0)
+        return; // OUIRTFReaderNoColorIndex, the default color, or bad RTF
+
+    int color = _colors[colorIndex];
+    _appendStyleProperty(&_buffer, hasProperty, property);
+    OFDataBufferAppendByte(&_buffer, '#');
+    OFDataBufferAppendHexForByte(&_buffer, (OFByte)(color >> 16));
+    OFDataBufferAppendHexForByte(&_buffer, (OFByte)(color >> 8));
+    OFDataBufferAppendHexForByte(&_buffer, (OFByte)color);
+}
+
+// Text that has only the default formatting (or that the reader gave no formatting for, as with plainTextOnly) goes straight into the paragraph
+- (void)_openSpanIfNeeded;
+{
+    if (_flags.spanIsCurrent || !_flags.hasFormatting)
+        return;
+    _flags.spanIsCurrent = 1;
+
+    size_t mark = OFDataBufferSpaceOccupied(&_buffer);
+    BOOL hasProperty = NO;
+    OFDataBufferAppendCString(&_buffer, "<span style=\"");
+
+    NSData *family = [_fontFamilies objectForKey:[NSNumber numberWithInt:_formatting.fontNumber]];
+    if (family != nil) {
+        _appendStyleProperty(&_buffer, &hasProperty, "font-family");
+        OFDataBufferAppendByte(&_buffer, '\'');
+        OFDataBufferAppendData(&_buffer, family);
+        OFDataBufferAppendByte(&_buffer, '\'');
+    }
+    if (_formatting.fontSize > 0) {
+        _appendStyleProperty(&_buffer, &hasProperty, "font-size");
+        _appendPoints(&_buffer, _formatting.fontSize);
+    }
+    if (_formatting.bold) {
+        _appendStyleProperty(&_buffer, &hasProperty, "font-weight");
+        OFDataBufferAppendCString(&_buffer, "bold");
+    }
+    if (_formatting.italic) {
+        _appendStyleProperty(&_buffer, &hasProperty, "font-style");
+        OFDataBufferAppendCString(&_buffer, "italic");
+    }
+    if ((_formatting.underline & 0xFF) != kCTUnderlineStyleNone) {
+        _appendStyleProperty(&_buffer, &hasProperty, "text-decoration");
+        OFDataBufferAppendCString(&_buffer, "underline");
+    }
+    [self _appendColorAtIndex:_formatting.foregroundColorIndex forProperty:"color" hasProperty:&hasProperty];
+    [self _appendColorAtIndex:_formatting.backgroundColorIndex forProperty:"background-color" hasProperty:&hasProperty];
+    if (_formatting.superscriptCount != 0) {
+        _appendStyleProperty(&_buffer, &hasProperty, "vertical-align");
+        OFDataBufferAppendCString(&_buffer, _formatting.superscriptCount > 0 ? "super" : "sub");
+    }
+
+    if (hasProperty) {
+        OFDataBufferAppendCString(&_buffer, "\">");
+        _flags.inSpan = 1;
+    } else
+        _buffer.writeStart = _buffer.buffer + mark; // Nothing to say after all
+}
+
+// Closes off the text written with the current character formatting
+- (void)_endRun;
+{
+    if (_pendingHighSurrogate != 0) {
+        _pendingHighSurrogate = 0;
+        OFDataBufferAppendCString(&_buffer, "\xEF\xBF\xBD"); // U+FFFD in UTF-8
+    }
+    if (_flags.inSpan) {
+        OFDataBufferAppendCString(&_buffer, "</span>");
+        _flags.inSpan = 0;
+    }
+    _flags.spanIsCurrent = 0;
+}
+
+- (BOOL)_finishDocumentWithParseError:(NSError *)parseError error:(NSError **)outError;
+{
+    if (_writeErrno == 0) {
+        if (_flags.inParagraph)
+            [self _closeParagraph];
+        OFDataBufferAppendCString(&_buffer, "</body>\n</html>\n");
+        [self _writeBuffer];
+    }
+
+    if (_writeErrno != 0) {
+        OBErrorWithErrno(outError, _writeErrno, "write", nil, NSLocalizedStringFromTableInBundle(@"Unable to write HTML.", @"OmniUI", OMNI_BUNDLE, @"error description"));
+        return NO;
+    }
+    if (parseError != nil) {
+        if (outError)
+            *outError = parseError;
+        return NO;
+    }
+    return YES;
+}
+
+@end
@@ -8,23 +8,102 @@
 // $Id$
 
 #import <OmniFoundation/OFObject.h>
+#import <OmniUI/OUIRTFStringBuilder.h>
+#import <OmniUI/OUIRTFReaderDelegate.h>
+#import <OmniUI/OUIRTFReaderTask.h> // OUIRTFReaderProgressHandler
 
-@class NSMutableArray, NSMutableAttributedString;
-@class OFStringScanner;
-@class OUIRTFReaderState;
+@class NSArray, NSData, NSError, NSMutableArray, NSMutableAttributedString, NSString;
+@class OFByteScanner;
+@class OUIRTFReaderOptions, OUIRTFReaderStatistics, OUIRTFDocumentIndex;
+struct _OUIRTFReaderState;
+struct _OUIRTFReaderScratch;
+struct _OUIRTFReaderReindexing;
+struct _OUIRTFReaderCodePage;
+struct _OUIRTFReaderLimits;
+struct _OUIRTFReaderEvents;
+struct _OUIRTFReaderCounters;
+
+extern NSString * const OUIRTFReaderErrorDomain;
+
+enum {
+    // Zero means no error. Each of these says which of the limits in OUIRTFReaderOptions cut a parse short.
+    OUIRTFReaderGroupsNestedTooDeeplyError = 1,
+    OUIRTFReaderTableIndexTooLargeError,
+    OUIRTFReaderOutputTooLongError,
+    OUIRTFReaderTooManyTokensError,
+    OUIRTFReaderTimeLimitExceededError,
+};
 
 @interface OUIRTFReader : OFObject
 {
 @private
-    NSMutableAttributedString *_attributedString;
-    OFStringScanner *_scanner;
-    OUIRTFReaderState *_currentState;
-    NSMutableArray *_pushedStates;
+    OFByteScanner *_scanner;
+    CFStringEncoding _textEncoding; // How to interpret bytes of text outside of escapes
+    struct _OUIRTFReaderState *_stateStack; // One per open group, outermost first; grows geometrically and is reused as groups close
+    struct _OUIRTFReaderState *_currentState; // Top of _stateStack
+    NSUInteger _stateStackDepth, _stateStackCapacity;
+    struct _OUIRTFReaderScratch *_scratch; // Where our state stack was borrowed from, if anywhere
+    CFMutableDictionaryRef _attributesByFormatting; // Attribute dictionaries we've built, keyed by the formatting they were built from
     NSMutableArray *_colorTable;
     NSMutableArray *_fontTable;
     short int _colorTableRedComponent, _colorTableGreenComponent, _colorTableBlueComponent;
+    OUIRTFStringBuilder _stringBuilder; // Our output; no attribute runs are recorded when we're extracting plain text
+    unichar _pendingHighSurrogate; // From a \u, waiting for the low surrogate that should come next; zero if none
+    const struct _OUIRTFReaderCodePage *_codePage; // How to decode \'xx in the current state's string encoding; looked up again when that changes
+    const struct _OUIRTFReaderCodePage *_pendingLeadCodePage; // Non-NULL while the lead byte of a double-byte character waits for its trail byte
+    OFByte _pendingLeadByte;
+    OUIRTFDocumentIndex *_index; // Non-nil while we're building one
+    NSUInteger _stopLocation; // Byte offset at which a range parse ends
+    struct _OUIRTFReaderReindexing *_reindexing; // Non-NULL while reparsing after an edit
+    struct _OUIRTFReaderLimits *_limits; // NULL if nothing limits the parse
+    struct _OUIRTFReaderEvents *_events; // Non-NULL if we're sending events to a delegate rather than building a string
+    struct _OUIRTFReaderCounters *_counters; // Non-NULL if we're collecting statistics, which we only ever do if built with OUI_COLLECT_RTF_READER_STATS
+    struct {
+        unsigned int plainTextOnly:1;
+        unsigned int tracksBoundaries:1; // Indexing or parsing a range
+        unsigned int indexOnly:1; // Building an index and nothing else, so there's no need for attributes
+        unsigned int reachedStopLocation:1;
+        unsigned int exceededLimit:1;
+    } _flags;
 }
 
 + (NSAttributedString *)parseRTFString:(NSString *)rtfString;
 
+// These scan the raw bytes of their input (in place for NSData and for regular files, which are mapped into memory; through a fixed-size window for pipes) rather than building an NSString of the whole document first. Bytes outside of escapes are taken to be Windows Latin 1, the RTF default (\ansi).
++ (NSAttributedString *)parseRTFData:(NSData *)rtfData;
++ (NSAttributedString *)parseRTFFileAtPath:(NSString *)path error:(NSError **)outError;
++ (NSAttributedString *)parseRTFFromFileDescriptor:(int)fd error:(NSError **)outError; // Reads to end of file; doesn't close the descriptor
+
+// Plain text extraction. Destinations, \uc/\u and \'xx are handled as above, but no fonts, colors or paragraph styles are ever built; the text goes straight into a UTF-16 buffer.
++ (NSString *)plainTextFromRTFString:(NSString *)rtfString;
++ (NSString *)plainTextFromRTFData:(NSData *)rtfData;
++ (NSString *)plainTextFromRTFFileAtPath:(NSString *)path error:(NSError **)outError;
++ (NSString *)plainTextFromRTFFileDescriptor:(int)fd error:(NSError **)outError;
+
+// Batch parsing. The documents are parsed concurrently, with results in input order. All of the class methods here are safe to call from any thread.
++ (NSArray *)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options; // Returns when every document is done
++ (NSArray *)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options errors:(NSArray **)outErrors; // An NSError or NSNull per result
++ (void)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options completion:(void (^)(NSArray *results, NSArray *errors))completion; // Returns immediately; the completion block is called on a global queue
+
+// Parsing untrusted input. A parse that reaches one of the options' limits returns what it read so far (an NSString for plainTextOnly) and an error in OUIRTFReaderErrorDomain, so check both. Statistics are only collected when built with OUI_COLLECT_RTF_READER_STATS; pass NULL to skip them.
++ (id)parseRTFData:(NSData *)rtfData options:(OUIRTFReaderOptions *)options statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
++ (id)parseRTFFromFileDescriptor:(int)fd options:(OUIRTFReaderOptions *)options statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
+
+// Background parsing on a global queue. The progress handler (which may be NULL) and the completion handler are called there; a cancelled parse completes with what it had read and an NSUserCancelledError.
++ (OUIRTFReaderTask *)parseRTFData:(NSData *)rtfData options:(OUIRTFReaderOptions *)options progress:(OUIRTFReaderProgressHandler)progress completion:(void (^)(id result, NSError *error))completion;
++ (OUIRTFReaderTask *)parseRTFFileAtPath:(NSString *)path options:(OUIRTFReaderOptions *)options progress:(OUIRTFReaderProgressHandler)progress completion:(void (^)(id result, NSError *error))completion;
+
+// Streaming. The document goes to the delegate as events (see OUIRTFReaderDelegate) and no string is built. Returns NO if a limit stops the parse or the file can't be read.
++ (BOOL)parseRTFData:(NSData *)rtfData delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
++ (BOOL)parseRTFFromFileDescriptor:(int)fd delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError; // Reads to end of file; doesn't close the descriptor
+
+// Random access. The index records where each top-level group and paragraph starts (see OUIRTFDocumentIndex), so a range of its entries can be parsed on its own. The data must be the very bytes the index was built from.
++ (OUIRTFDocumentIndex *)indexRTFData:(NSData *)rtfData;
++ (NSAttributedString *)parseRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index;
++ (NSString *)plainTextFromRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index;
+
+// Incremental reparsing. +parseRTFData:index: builds the index during a full parse. After each edit, pass the edited range and change in length (in bytes), and the attributed string and index are brought up to date by reparsing only the paragraphs around the edit. Returns the range of characters replaced.
++ (NSAttributedString *)parseRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex **)outIndex;
++ (NSRange)reparseEditedRTFData:(NSData *)rtfData editedRange:(NSRange)editedRange changeInLength:(NSInteger)delta attributedString:(NSMutableAttributedString *)attributedString index:(OUIRTFDocumentIndex *)index;
+
 @end
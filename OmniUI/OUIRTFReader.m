@@ -10,48 +10,96 @@
 #import <Foundation/NSAttributedString.h>
 #import <OmniBase/assertions.h>
 #import <OmniFoundation/NSString-OFUnicodeCharacters.h>
-#import <OmniFoundation/NSMutableAttributedString-OFExtensions.h>
 #import <OmniFoundation/NSMutableDictionary-OFExtensions.h>
-#import <OmniFoundation/NSNumber-OFExtensions-CGTypes.h>
-#import <OmniFoundation/OFStringScanner.h>
+#import <OmniFoundation/OFCFCallbacks.h>
+#import <OmniFoundation/OFDataByteScanner.h>
+#import <OmniFoundation/OFStringByteScanner.h>
 #import <OmniAppKit/OAFontDescriptor.h>
 #import <OmniAppKit/OATextAttributes.h>
+#import <OmniUI/OUIRTFDocumentIndex.h>
+#import <OmniUI/OUIRTFFontCache.h>
+#import <OmniUI/OUIRTFReaderOptions.h>
+#import <OmniUI/OUIRTFReaderStatistics.h>
 
 #if defined(TARGET_OS_IPHONE) && TARGET_OS_IPHONE
 #import <CoreText/CTParagraphStyle.h>
 #import <CoreText/CTStringAttributes.h>
 #endif
 
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <libkern/OSAtomic.h>
+#include <unistd.h>
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+#include <mach/mach_time.h>
+#endif
+
 RCS_ID("$Id$");
 
 #ifdef DEBUG_kc0
 #define DEBUG_RTF_READER
 #endif
 
-@class OUIRTFReaderAction;
+NSString * const OUIRTFReaderErrorDomain = @"com.omnigroup.framework.OmniUI.RTFReader.ErrorDomain";
 
 @interface OUIRTFReader ()
 
-@property (nonatomic, retain) NSAttributedString *attributedString;
-
-+ (void)_registerKeyword:(NSString *)keyword action:(OUIRTFReaderAction *)action;
-
-- (id)_initWithRTFString:(NSString *)rtfString;
-- (void)_parseRTFGroupWithSemicolonAction:(OUIRTFReaderAction *)semicolonAction;
++ (void)_registerKeyword:(const char *)keyword selector:(SEL)selector defaultValue:(int)defaultValue forceValue:(BOOL)forceValue attributeOnly:(BOOL)attributeOnly;
++ (void)_registerKeyword:(const char *)keyword selector:(SEL)selector;
++ (void)_registerAttributeKeyword:(const char *)keyword selector:(SEL)selector;
++ (void)_registerAttributeKeyword:(const char *)keyword selector:(SEL)selector value:(int)value;
++ (void)_buildKeywordHash;
+
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly;
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly scratch:(struct _OUIRTFReaderScratch *)scratch;
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly options:(OUIRTFReaderOptions *)options task:(OUIRTFReaderTask *)task scratch:(struct _OUIRTFReaderScratch *)scratch statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
++ (id)_parseRTFFileAtPath:(NSString *)path plainTextOnly:(BOOL)plainTextOnly error:(NSError **)outError;
++ (id)_parseRTFFromFileDescriptor:(int)fd plainTextOnly:(BOOL)plainTextOnly options:(OUIRTFReaderOptions *)options task:(OUIRTFReaderTask *)task statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
++ (BOOL)_parseRTFWithScanner:(OFByteScanner *)scanner delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
++ (id)_parseRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index plainTextOnly:(BOOL)plainTextOnly;
+- (id)_initWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly scratch:(struct _OUIRTFReaderScratch *)scratch;
+- (NSString *)_newPlainTextString;
+- (NSAttributedString *)_newAttributedString;
+#ifdef OUI_COLLECT_RTF_READER_STATS
+- (OUIRTFReaderStatistics *)_newStatistics;
+#endif
+- (void)_parseRTFGroupWithSemicolonSelector:(SEL)semicolonSelector;
 - (void)_parseRTF;
-- (void)_parseKeyword;
+- (void)_stopForExceededLimit:(NSInteger)exceededLimit;
+- (void)_prepareToAppendEventText;
+- (void)_sendPendingText;
+- (void)_appendBreakCharacter:(unichar)character;
+- (void)_startIndexing:(OUIRTFDocumentIndex *)index indexOnly:(BOOL)indexOnly;
+- (void)_finishIndexing;
+- (BOOL)_hasCaughtUpWithPreviousIndexAtLocation:(NSUInteger)location kind:(OUIRTFDocumentIndexEntryKind)kind snapshotStart:(NSUInteger)snapshotStart;
+- (void)_prepareToParseFromEntryAtIndex:(NSUInteger)startEntryIndex toEntryAtIndex:(NSUInteger)stopEntryIndex ofIndex:(OUIRTFDocumentIndex *)index;
+- (BOOL)_restoreStateStackFromSnapshot:(const OFByte *)snapshot length:(NSUInteger)length;
+- (BOOL)_noteBoundaryOfKind:(OUIRTFDocumentIndexEntryKind)kind;
+- (BOOL)_parseKeyword;
 - (void)_parseControlSymbol;
+- (void)_skipUTF8ContinuationBytes;
+- (void)_skipControlWordOrSymbol;
+- (void)_appendEscapedNonASCIICharacterStartingWithByte:(OFByte)leadByte;
 - (void)_pushRTFState;
 - (void)_popRTFState;
 - (void)_actionSkipDestination;
+- (void)_actionSkipBinaryData:(int)length;
+- (void)_discardDestinationText;
+- (void)_skipToEndOfGroup;
 
 - (CGColorRef)_newCurrentColorTableCGColor;
 - (void)_resetCurrentColorTableColor;
+- (void)_appendCurrentColorTableColor;
 - (void)_addColorTableEntry;
+- (void)_replayColorDefinitions:(const OFByte *)definitions length:(NSUInteger)length;
 - (void)_actionReadColorTable;
 - (CGColorRef)_colorAtIndex:(int)colorTableIndex;
 
+- (void)_setFontTableEntry:(int)fontNumber name:(NSString *)fontName encoding:(CFStringEncoding)encoding;
 - (void)_addFontTableEntry;
+- (void)_replayFontDefinitions:(const OFByte *)definitions length:(NSUInteger)length;
 - (void)_actionReadFontTable;
 - (void)_actionReadFontCharacterSet:(int)characterSet;
 - (NSString *)_fontNameAtIndex:(int)fontTableIndex;
@@ -59,7 +107,13 @@ RCS_ID("$Id$");
 - (void)_actionUnderline:(int)value;
 - (void)_actionUnderlineStyle:(int)value;
 
+- (NSDictionary *)_currentStringAttributes;
+- (void)_discardCachedStringAttributes;
 - (void)_actionAppendString:(NSString *)string;
+- (void)_appendCharacter:(unichar)character;
+- (void)_flushPendingCharacters;
+- (void)_appendEncodedByte:(OFByte)byte;
+- (BOOL)_appendPendingLeadByteWithTrailByte:(OFByte)trailByte;
 - (void)_actionSetUnicodeSkipCount:(int)newCount;
 - (void)_actionInsertUnicodeCharacter:(int)unicodeCharacter;
 - (void)_actionInsertPageBreak;
@@ -75,90 +129,509 @@ RCS_ID("$Id$");
 
 @end
 
-#define NO_RIGHT_INDENT (-999999)
-
-@interface OUIRTFReaderState : OFObject <NSCopying>
-{
-    @public
-
-    NSMutableString *_alternateDestination;
-    CFStringEncoding _stringEncoding;
-    id _foregroundColor;
-    id _backgroundColor;
-    CGFloat _fontSize;
-    int _fontNumber;
-    int _fontCharacterSet;
-    unsigned int _underline;
-    int _superscriptCount;
-
-    int _unicodeSkipCount;
-    struct {
-        unsigned int discardText:1;
-        unsigned int bold:1;
-        unsigned int italic:1;
-    } _flags;
-
-    struct {
-        CTTextAlignment alignment;
-        int firstLineIndent;
-        int leftIndent;
-        int rightIndent;
-    } _paragraph;
-
-    NSMutableDictionary *_cachedStringAttributes;
-}
-
-@property (nonatomic, readwrite, retain) NSMutableString *alternateDestination;
-@property (nonatomic, retain) id foregroundColor;
-@property (nonatomic, retain) id backgroundColor;
-@property (nonatomic) CGFloat fontSize;
-@property (nonatomic) int fontNumber;
-@property (nonatomic) BOOL bold;
-@property (nonatomic) BOOL italic;
-@property (nonatomic) unsigned int underlineStyle;
-@property (nonatomic) int superscript;
-@property (nonatomic) int fontCharacterSet;
-@property (nonatomic) CTTextAlignment paragraphAlignment;
-@property (nonatomic) int paragraphFirstLineIndent;
-@property (nonatomic) int paragraphLeftIndent;
-@property (nonatomic) int paragraphRightIndent;
-
-- (NSMutableDictionary *)stringAttributesForReader:(OUIRTFReader *)reader;
-- (CFStringEncoding)fontEncoding;
-- (void)resetParagraphAttributes;
+#define NO_RIGHT_INDENT OUIRTFReaderNoRightIndent
+#define NO_COLOR_INDEX OUIRTFReaderNoColorIndex
+
+// One of these per open group, kept in a contiguous stack on the reader. A new group starts out sharing its parent's alternate destination and cached attributes; it only takes ownership of (and so releases) the ones it replaces, which means changing the formatting in a group never disturbs the attributes its parent has already built.
+typedef struct _OUIRTFReaderState {
+    OUIRTFReaderFormatting formatting;
+    CFStringEncoding stringEncoding;
+    int fontCharacterSet;
+    int unicodeSkipCount;
+    unsigned int discardText:1;
+    unsigned int ownsAlternateDestination:1;
+    unsigned int ownsCachedStringAttributes:1;
+    NSMutableString *alternateDestination;
+    NSDictionary *cachedStringAttributes; // Built lazily from formatting
+} OUIRTFReaderState;
+
+#define OUIRTFReaderInitialStateStackCapacity (16)
+
+// Buffers that a reader borrows for the length of a parse rather than allocating its own, so that a thread parsing one document after another reuses them. Only one reader at a time may use a given scratch.
+typedef struct _OUIRTFReaderScratch {
+    OUIRTFReaderState *stateStack; // NULL while a reader has it
+    NSUInteger stateStackCapacity;
+} OUIRTFReaderScratch;
+
+// What a reparse after an edit needs in order to tell when it has caught up with the parse before the edit
+typedef struct _OUIRTFReaderReindexing {
+    OUIRTFDocumentIndex *previousIndex;
+    NSUInteger startLocation; // Where we started; its entry is already in the previous index
+    NSUInteger editEnd; // In the edited data; only entries from here on can match the previous index's
+    NSInteger byteDelta; // How much longer the edited data is
+    NSUInteger caughtUpEntryIndex; // The previous index's entry where the parses agree again, or NSNotFound if they never did
+} OUIRTFReaderReindexing;
+
+// Where a parse of untrusted input stands against the limits in its options. A limit that wasn't set is the largest value its field holds, so it's never reached.
+typedef struct _OUIRTFReaderLimits {
+    NSUInteger maximumGroupDepth;
+    NSUInteger maximumTableIndex;
+    NSUInteger maximumOutputLength;
+    NSUInteger remainingTokenCount;
+    CFAbsoluteTime deadline; // Zero if there's no time limit
+    OUIRTFReaderTask *task; // Checked for cancellation, and told of our progress; nil if we're not running in the background
+    NSUInteger tokensUntilPeriodicCheck; // Reading the clock or the task's state for every token would cost more than most tokens do
+    NSInteger exceededLimit; // The error code for the limit that stopped the parse, or zero
+} OUIRTFReaderLimits;
+
+#define OUIRTFReaderTokensPerPeriodicCheck (1024)
+#define OUIRTFReaderCancelled (-1) // Not one of our error codes; a cancelled parse reports NSUserCancelledError
+
+// What a parse that streams events to a delegate keeps track of. Text collects in the reader's string builder, without attributes, until something else has to be reported or there's enough of it to be worth a call.
+typedef struct _OUIRTFReaderEvents {
+    id <OUIRTFReaderDelegate> delegate;
+    OUIRTFReaderFormatting reportedFormatting; // What the delegate was last told
+    NSUInteger sentLength; // Characters sent so far, for the output limit
+    unsigned int hasReportedFormatting:1;
+    unsigned int didChangeFormatting:1; // Which of the optional methods the delegate implements
+    unsigned int foundParagraphBreak:1;
+    unsigned int foundPageBreak:1;
+    unsigned int foundFontTableEntry:1;
+    unsigned int foundColorTableEntry:1;
+} OUIRTFReaderEvents;
+
+#define OUIRTFReaderEventTextBufferLength (4096)
+
+// Returns NO if neither the options nor a task set any limits, in which case the reader needn't check any
+static BOOL _initLimits(OUIRTFReaderLimits *limits, OUIRTFReaderOptions *options, OUIRTFReaderTask *task)
+{
+    NSUInteger maximumGroupDepth = options.maximumGroupDepth, maximumTableIndex = options.maximumTableIndex;
+    NSUInteger maximumOutputLength = options.maximumOutputLength, maximumTokenCount = options.maximumTokenCount;
+    NSTimeInterval timeLimit = options.timeLimit;
+    if (task == nil && maximumGroupDepth == 0 && maximumTableIndex == 0 && maximumOutputLength == 0 && maximumTokenCount == 0 && timeLimit <= 0)
+        return NO;
+
+    limits->maximumGroupDepth = maximumGroupDepth != 0 ? maximumGroupDepth : NSUIntegerMax;
+    limits->maximumTableIndex = maximumTableIndex != 0 ? maximumTableIndex : NSUIntegerMax;
+    limits->maximumOutputLength = maximumOutputLength != 0 ? maximumOutputLength : NSUIntegerMax;
+    limits->remainingTokenCount = maximumTokenCount != 0 ? maximumTokenCount : NSUIntegerMax;
+    limits->deadline = timeLimit > 0 ? CFAbsoluteTimeGetCurrent() + timeLimit : 0;
+    limits->task = task;
+    limits->tokensUntilPeriodicCheck = OUIRTFReaderTokensPerPeriodicCheck;
+    limits->exceededLimit = 0;
+    return YES;
+}
+
+// Called before each token. Returns the error code for a limit the parse has reached, or zero to go on.
+static inline NSInteger _checkTokenLimits(OUIRTFReaderLimits *limits, NSUInteger outputLength, OFByteScanner *scanner)
+{
+    if (outputLength > limits->maximumOutputLength)
+        return OUIRTFReaderOutputTooLongError;
+    if (limits->remainingTokenCount == 0)
+        return OUIRTFReaderTooManyTokensError;
+    limits->remainingTokenCount--;
+    if (--limits->tokensUntilPeriodicCheck == 0) {
+        limits->tokensUntilPeriodicCheck = OUIRTFReaderTokensPerPeriodicCheck;
+        if (limits->deadline != 0 && CFAbsoluteTimeGetCurrent() > limits->deadline)
+            return OUIRTFReaderTimeLimitExceededError;
+        if (limits->task != nil) {
+            if ([limits->task isCancelled])
+                return OUIRTFReaderCancelled;
+            [limits->task _reportProgress:byteScannerScanLocation(scanner)];
+        }
+    }
+    return 0;
+}
 
-@end
+static void _getLimitError(NSError **outError, NSInteger exceededLimit)
+{
+    if (exceededLimit == OUIRTFReaderCancelled) {
+        OBUserCancelledError(outError);
+        return;
+    }
 
-@interface OUIRTFReaderAction : OFObject
-- (void)performActionWithParser:(OUIRTFReader *)parser;
-- (void)performActionWithParser:(OUIRTFReader *)parser parameter:(int)parameter;
-@end
+    NSString *reason;
+    switch (exceededLimit) {
+        case OUIRTFReaderGroupsNestedTooDeeplyError:
+            reason = NSLocalizedStringFromTableInBundle(@"Its groups are nested too deeply.", @"OmniUI", OMNI_BUNDLE, @"error reason");
+            break;
+        case OUIRTFReaderTableIndexTooLargeError:
+            reason = NSLocalizedStringFromTableInBundle(@"Its font or color table is too large.", @"OmniUI", OMNI_BUNDLE, @"error reason");
+            break;
+        case OUIRTFReaderOutputTooLongError:
+            reason = NSLocalizedStringFromTableInBundle(@"Its text is too long.", @"OmniUI", OMNI_BUNDLE, @"error reason");
+            break;
+        case OUIRTFReaderTooManyTokensError:
+            reason = NSLocalizedStringFromTableInBundle(@"It has too much markup.", @"OmniUI", OMNI_BUNDLE, @"error reason");
+            break;
+        case OUIRTFReaderTimeLimitExceededError:
+            reason = NSLocalizedStringFromTableInBundle(@"It took too long to read.", @"OmniUI", OMNI_BUNDLE, @"error reason");
+            break;
+        default:
+            OBASSERT_NOT_REACHED("Unknown limit");
+            reason = @"";
+            break;
+    }
+    _OBError(outError, OUIRTFReaderErrorDomain, exceededLimit, __FILE__, __LINE__, NSLocalizedDescriptionKey, NSLocalizedStringFromTableInBundle(@"Unable to read all of the RTF document.", @"OmniUI", OMNI_BUNDLE, @"error description"), NSLocalizedFailureReasonErrorKey, reason, nil);
+}
 
-@interface OUIRTFReaderSelectorAction : OUIRTFReaderAction
+static void _resetParagraphFormatting(OUIRTFReaderFormatting *formatting)
 {
-@private
-    SEL _selector;
-    IMP _implementation;
-    int _defaultValue;
-    BOOL _forceValue;
+    formatting->paragraph.alignment = kCTLeftTextAlignment;
+    formatting->paragraph.firstLineIndent = 0;
+    formatting->paragraph.leftIndent = 0;
+    formatting->paragraph.rightIndent = NO_RIGHT_INDENT;
 }
 
-- (id)initWithSelector:(SEL)selector defaultValue:(int)defaultValue;
-- (id)initWithSelector:(SEL)selector value:(int)defaultValue;
-- (id)initWithSelector:(SEL)selector;
+static void _initState(OUIRTFReaderState *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->stringEncoding = kCFStringEncodingWindowsLatin1;
+    state->unicodeSkipCount = 1;
+    state->formatting.fontSize = 12.0f;
+    state->formatting.underline = kCTUnderlineStyleNone;
+    state->formatting.foregroundColorIndex = NO_COLOR_INDEX;
+    state->formatting.backgroundColorIndex = NO_COLOR_INDEX;
+    _resetParagraphFormatting(&state->formatting);
+}
 
-@end
+static void _releaseState(OUIRTFReaderState *state)
+{
+    if (state->ownsAlternateDestination)
+        [state->alternateDestination release];
+    if (state->ownsCachedStringAttributes)
+        [state->cachedStringAttributes release];
+    state->alternateDestination = nil;
+    state->cachedStringAttributes = nil;
+    state->ownsAlternateDestination = 0;
+    state->ownsCachedStringAttributes = 0;
+}
 
-@interface OUIRTFReaderAppendStringAction : OUIRTFReaderAction
+static void _setAlternateDestination(OUIRTFReaderState *state, NSMutableString *alternateDestination)
 {
-@private
-    NSString *_string;
+    [alternateDestination retain];
+    if (state->ownsAlternateDestination)
+        [state->alternateDestination release];
+    state->alternateDestination = alternateDestination;
+    state->ownsAlternateDestination = 1;
+}
+
+static void _setCachedStringAttributes(OUIRTFReaderState *state, NSDictionary *attributes)
+{
+    [attributes retain];
+    if (state->ownsCachedStringAttributes)
+        [state->cachedStringAttributes release];
+    state->cachedStringAttributes = attributes;
+    state->ownsCachedStringAttributes = (attributes != nil);
 }
 
-+ (OUIRTFReaderAction *)appendStringActionWithString:(NSString *)string;
-- (id)initWithString:(NSString *)string;
+// Sets a field of the current group's formatting, dropping its cached attributes only if the value actually changes. Writers repeat things like \plain\f0\fs24 at the start of nearly every group, and those shouldn't cost us a new font.
+#define SET_FORMATTING(field, newValue) do { \
+    if (_currentState->formatting.field != (newValue)) { \
+        _setCachedStringAttributes(_currentState, nil); \
+        _currentState->formatting.field = (newValue); \
+    } \
+} while (0)
 
-@end
+// Callbacks for interning attribute dictionaries by formatting. Lookups pass a pointer to the formatting in the current state; the dictionary keeps its own malloc'd copy. These compare field by field since bitfields and padding make the raw bytes unreliable.
+
+static const void *_formattingKeyRetain(CFAllocatorRef allocator, const void *value)
+{
+    OUIRTFReaderFormatting *copy = malloc(sizeof(*copy));
+    memcpy(copy, value, sizeof(*copy));
+    return copy;
+}
+
+static void _formattingKeyRelease(CFAllocatorRef allocator, const void *value)
+{
+    free((void *)value);
+}
+
+static Boolean _formattingKeyEqual(const void *value1, const void *value2)
+{
+    const OUIRTFReaderFormatting *a = value1, *b = value2;
+    return a->fontSize == b->fontSize &&
+        a->fontNumber == b->fontNumber &&
+        a->foregroundColorIndex == b->foregroundColorIndex &&
+        a->backgroundColorIndex == b->backgroundColorIndex &&
+        a->underline == b->underline &&
+        a->superscriptCount == b->superscriptCount &&
+        a->paragraph.alignment == b->paragraph.alignment &&
+        a->paragraph.firstLineIndent == b->paragraph.firstLineIndent &&
+        a->paragraph.leftIndent == b->paragraph.leftIndent &&
+        a->paragraph.rightIndent == b->paragraph.rightIndent &&
+        a->bold == b->bold &&
+        a->italic == b->italic;
+}
+
+static CFHashCode _formattingKeyHash(const void *value)
+{
+    const OUIRTFReaderFormatting *formatting = value;
+
+    // Font sizes are always whole half-points
+    uint32_t fields[] = {
+        (uint32_t)(formatting->fontSize * 2.0f),
+        (uint32_t)formatting->fontNumber,
+        (uint32_t)formatting->foregroundColorIndex,
+        (uint32_t)formatting->backgroundColorIndex,
+        formatting->underline,
+        (uint32_t)formatting->superscriptCount,
+        (uint32_t)formatting->paragraph.alignment,
+        (uint32_t)formatting->paragraph.firstLineIndent,
+        (uint32_t)formatting->paragraph.leftIndent,
+        (uint32_t)formatting->paragraph.rightIndent,
+        (formatting->bold << 1) | formatting->italic,
+    };
+
+    // FNV-1a over the fields
+    uint32_t hash = 2166136261u;
+    for (NSUInteger fieldIndex = 0; fieldIndex < sizeof(fields) / sizeof(*fields); fieldIndex++) {
+        hash ^= fields[fieldIndex];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const CFDictionaryKeyCallBacks FormattingKeyCallbacks = {
+    0, // version
+    _formattingKeyRetain,
+    _formattingKeyRelease,
+    NULL, // copyDescription
+    _formattingKeyEqual,
+    _formattingKeyHash,
+};
+
+// An index snapshot (see OUIRTFDocumentIndex) is a group state stack written as the fields below. Each state is a mask of the fields that differ from the state under it (from the default state, for the outermost) followed by just those fields, so a nested group that changes a field or two costs two or three bytes.
+enum {
+    SnapshotFontSize, // In half points, as \fs has it
+    SnapshotFontNumber,
+    SnapshotForegroundColorIndex,
+    SnapshotBackgroundColorIndex,
+    SnapshotUnderline,
+    SnapshotSuperscriptCount,
+    SnapshotAlignment,
+    SnapshotFirstLineIndent,
+    SnapshotLeftIndent,
+    SnapshotRightIndent,
+    SnapshotFlags, // Bold, italic and discardText
+    SnapshotStringEncoding,
+    SnapshotFontCharacterSet,
+    SnapshotUnicodeSkipCount,
+    SnapshotFieldCount
+};
+
+static void _getSnapshotFields(const OUIRTFReaderState *state, int64_t fields[SnapshotFieldCount])
+{
+    fields[SnapshotFontSize] = (int64_t)(state->formatting.fontSize * 2.0f);
+    fields[SnapshotFontNumber] = state->formatting.fontNumber;
+    fields[SnapshotForegroundColorIndex] = state->formatting.foregroundColorIndex;
+    fields[SnapshotBackgroundColorIndex] = state->formatting.backgroundColorIndex;
+    fields[SnapshotUnderline] = state->formatting.underline;
+    fields[SnapshotSuperscriptCount] = state->formatting.superscriptCount;
+    fields[SnapshotAlignment] = state->formatting.paragraph.alignment;
+    fields[SnapshotFirstLineIndent] = state->formatting.paragraph.firstLineIndent;
+    fields[SnapshotLeftIndent] = state->formatting.paragraph.leftIndent;
+    fields[SnapshotRightIndent] = state->formatting.paragraph.rightIndent;
+    fields[SnapshotFlags] = state->formatting.bold | (state->formatting.italic << 1) | (state->discardText << 2);
+    fields[SnapshotStringEncoding] = state->stringEncoding;
+    fields[SnapshotFontCharacterSet] = state->fontCharacterSet;
+    fields[SnapshotUnicodeSkipCount] = state->unicodeSkipCount;
+}
+
+static void _setSnapshotFields(OUIRTFReaderState *state, const int64_t fields[SnapshotFieldCount])
+{
+    state->formatting.fontSize = fields[SnapshotFontSize] * 0.5f;
+    state->formatting.fontNumber = (int)fields[SnapshotFontNumber];
+    state->formatting.foregroundColorIndex = (int)fields[SnapshotForegroundColorIndex];
+    state->formatting.backgroundColorIndex = (int)fields[SnapshotBackgroundColorIndex];
+    state->formatting.underline = (unsigned int)fields[SnapshotUnderline];
+    state->formatting.superscriptCount = (int)fields[SnapshotSuperscriptCount];
+    state->formatting.paragraph.alignment = (CTTextAlignment)fields[SnapshotAlignment];
+    state->formatting.paragraph.firstLineIndent = (int)fields[SnapshotFirstLineIndent];
+    state->formatting.paragraph.leftIndent = (int)fields[SnapshotLeftIndent];
+    state->formatting.paragraph.rightIndent = (int)fields[SnapshotRightIndent];
+    state->formatting.bold = (fields[SnapshotFlags] & 1) != 0;
+    state->formatting.italic = (fields[SnapshotFlags] & 2) != 0;
+    state->discardText = (fields[SnapshotFlags] & 4) != 0;
+    state->stringEncoding = (CFStringEncoding)fields[SnapshotStringEncoding];
+    state->fontCharacterSet = (int)fields[SnapshotFontCharacterSet];
+    state->unicodeSkipCount = (int)fields[SnapshotUnicodeSkipCount];
+}
+
+// Zigzag encoding keeps small negative values (NO_COLOR_INDEX, say) down to a byte
+static inline uint64_t _zigzagEncode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t _zigzagDecode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline BOOL _readSignedInteger(const OFByte **cursor, const OFByte *end, int64_t *outValue)
+{
+    unsigned long long value;
+    if (!OUIRTFDocumentIndexReadCompressedInt(cursor, end, &value))
+        return NO;
+    *outValue = _zigzagDecode(value);
+    return YES;
+}
+
+static void _appendStateSnapshot(OFDataBuffer *dataBuffer, const OUIRTFReaderState *states, NSUInteger stateCount)
+{
+    OUIRTFReaderState defaultState;
+    _initState(&defaultState);
+
+    int64_t previousFields[SnapshotFieldCount], fields[SnapshotFieldCount];
+    _getSnapshotFields(&defaultState, previousFields);
+
+    OFDataBufferAppendCompressedLongLongInt(dataBuffer, stateCount);
+    for (NSUInteger stateIndex = 0; stateIndex < stateCount; stateIndex++) {
+        _getSnapshotFields(&states[stateIndex], fields);
+
+        unsigned int changedFields = 0;
+        for (unsigned int fieldIndex = 0; fieldIndex < SnapshotFieldCount; fieldIndex++) {
+            if (fields[fieldIndex] != previousFields[fieldIndex])
+                changedFields |= 1U << fieldIndex;
+        }
+        OFDataBufferAppendCompressedLongLongInt(dataBuffer, changedFields);
+        for (unsigned int fieldIndex = 0; fieldIndex < SnapshotFieldCount; fieldIndex++) {
+            if (changedFields & (1U << fieldIndex))
+                OFDataBufferAppendCompressedLongLongInt(dataBuffer, _zigzagEncode(fields[fieldIndex]));
+        }
+
+        memcpy(previousFields, fields, sizeof(fields));
+    }
+}
+
+static CFStringEncoding _encodingForFontCharacterSet(int fontCharacterSet)
+{
+    #define WIN32_ANSI_CHARSET          0   /* CP1252, ansi-0, iso8859-{1,15} */
+    #define WIN32_DEFAULT_CHARSET       1
+    #define WIN32_SYMBOL_CHARSET        2
+    #define WIN32_SHIFTJIS_CHARSET      128 /* CP932 */
+    #define WIN32_HANGEUL_CHARSET       129 /* CP949, ksc5601.1987-0 */
+    #define WIN32_HANGUL_CHARSET        HANGEUL_CHARSET
+    #define WIN32_GB2312_CHARSET        134 /* CP936, gb2312.1980-0 */
+    #define WIN32_CHINESEBIG5_CHARSET   136 /* CP950, big5.et-0 */
+    #define WIN32_GREEK_CHARSET         161 /* CP1253 */
+    #define WIN32_TURKISH_CHARSET       162 /* CP1254, -iso8859-9 */
+    #define WIN32_HEBREW_CHARSET        177 /* CP1255, -iso8859-8 */
+    #define WIN32_ARABIC_CHARSET        178 /* CP1256, -iso8859-6 */
+    #define WIN32_BALTIC_CHARSET        186 /* CP1257, -iso8859-13 */
+    #define WIN32_VIETNAMESE_CHARSET    163 /* CP1258 */
+    #define WIN32_RUSSIAN_CHARSET       204 /* CP1251, -iso8859-5 */
+    #define WIN32_EE_CHARSET            238 /* CP1250, -iso8859-2 */
+    #define WIN32_EASTEUROPE_CHARSET    EE_CHARSET
+    #define WIN32_THAI_CHARSET          222 /* CP874, iso8859-11, tis620 */
+    #define WIN32_JOHAB_CHARSET         130 /* korean (johab) CP1361 */
+    #define WIN32_MAC_CHARSET           77
+    #define WIN32_OEM_CHARSET           255
+
+    switch (fontCharacterSet) {
+        default: case WIN32_ANSI_CHARSET: return kCFStringEncodingWindowsLatin1;
+        case WIN32_SYMBOL_CHARSET: return kCFStringEncodingMacSymbol;
+        case WIN32_SHIFTJIS_CHARSET: return kCFStringEncodingShiftJIS;
+        case WIN32_HANGEUL_CHARSET: return kCFStringEncodingDOSKorean;
+        case WIN32_GB2312_CHARSET: return kCFStringEncodingDOSChineseSimplif;
+        case WIN32_CHINESEBIG5_CHARSET: return kCFStringEncodingDOSChineseTrad;
+        case WIN32_GREEK_CHARSET: return kCFStringEncodingWindowsGreek;
+        case WIN32_TURKISH_CHARSET: return kCFStringEncodingWindowsLatin5;
+        case WIN32_HEBREW_CHARSET: return kCFStringEncodingWindowsHebrew;
+        case WIN32_ARABIC_CHARSET: return kCFStringEncodingWindowsArabic;
+        case WIN32_BALTIC_CHARSET: return kCFStringEncodingWindowsBalticRim;
+        case WIN32_VIETNAMESE_CHARSET: return kCFStringEncodingWindowsVietnamese;
+        case WIN32_RUSSIAN_CHARSET: return kCFStringEncodingWindowsCyrillic;
+        case WIN32_EE_CHARSET: return kCFStringEncodingWindowsLatin2;
+        case WIN32_THAI_CHARSET: return kCFStringEncodingDOSThai;
+        case WIN32_JOHAB_CHARSET: return kCFStringEncodingWindowsKoreanJohab;
+        case WIN32_MAC_CHARSET: return kCFStringEncodingMacRoman;
+    }
+}
+
+/*
+ Decoding for \'xx escapes, which carry bytes in the code page of the current font. Each code page that _encodingForFontCharacterSet() can return gets a 256-entry table of what each byte decodes to on its own, built in +initialize. The double-byte code pages also have a table of which bytes lead a pair, and a row of 256 characters per lead byte giving what each trail byte makes with it; a row is built the first time any reader meets its lead byte, and published with a compare-and-swap so concurrent readers can share it.
+*/
+typedef struct _OUIRTFReaderCodePage {
+    CFStringEncoding encoding;
+    unichar singleBytes[256]; // 0xFFFD for bytes that don't stand on their own
+    BOOL leadBytes[256]; // All NO for single-byte code pages
+    unichar * volatile pairRows[256]; // Indexed by lead byte
+} OUIRTFReaderCodePage;
+
+// The lead byte ranges of the double-byte Windows code pages
+static const struct {
+    CFStringEncoding encoding;
+    OFByte leadByteRanges[3][2]; // First and last; unused ranges are zero
+} DoubleByteCodePages[] = {
+    {kCFStringEncodingShiftJIS, {{0x81, 0x9F}, {0xE0, 0xFC}}}, // CP932
+    {kCFStringEncodingDOSKorean, {{0x81, 0xFE}}}, // CP949
+    {kCFStringEncodingDOSChineseSimplif, {{0x81, 0xFE}}}, // CP936
+    {kCFStringEncodingDOSChineseTrad, {{0x81, 0xFE}}}, // CP950
+    {kCFStringEncodingWindowsKoreanJohab, {{0x84, 0xD3}, {0xD8, 0xDE}, {0xE0, 0xF9}}}, // CP1361
+};
+
+static const CFStringEncoding SingleByteCodePageEncodings[] = {
+    kCFStringEncodingWindowsLatin1,
+    kCFStringEncodingMacSymbol,
+    kCFStringEncodingWindowsGreek,
+    kCFStringEncodingWindowsLatin5,
+    kCFStringEncodingWindowsHebrew,
+    kCFStringEncodingWindowsArabic,
+    kCFStringEncodingWindowsBalticRim,
+    kCFStringEncodingWindowsVietnamese,
+    kCFStringEncodingWindowsCyrillic,
+    kCFStringEncodingWindowsLatin2,
+    kCFStringEncodingDOSThai,
+    kCFStringEncodingMacRoman,
+};
+
+#define OUIRTFReaderCodePageCount (sizeof(SingleByteCodePageEncodings) / sizeof(*SingleByteCodePageEncodings) + sizeof(DoubleByteCodePages) / sizeof(*DoubleByteCodePages))
+static OUIRTFReaderCodePage CodePages[OUIRTFReaderCodePageCount];
+
+static unichar _decodeBytes(const OFByte *bytes, CFIndex length, CFStringEncoding encoding)
+{
+    unichar character = 0xFFFD;
+    CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, length, encoding, false);
+    if (string != NULL) {
+        if (CFStringGetLength(string) == 1)
+            character = CFStringGetCharacterAtIndex(string, 0);
+        CFRelease(string);
+    }
+    return character;
+}
+
+static void _initCodePage(OUIRTFReaderCodePage *codePage, CFStringEncoding encoding)
+{
+    codePage->encoding = encoding;
+    for (unsigned int byte = 0; byte < 256; byte++) {
+        OFByte singleByte = (OFByte)byte;
+        codePage->singleBytes[byte] = _decodeBytes(&singleByte, 1, encoding);
+    }
+}
+
+static const OUIRTFReaderCodePage *_codePageForEncoding(CFStringEncoding encoding)
+{
+    for (NSUInteger codePageIndex = 0; codePageIndex < OUIRTFReaderCodePageCount; codePageIndex++) {
+        if (CodePages[codePageIndex].encoding == encoding)
+            return &CodePages[codePageIndex];
+    }
+    return NULL;
+}
+
+static const unichar *_pairRowForLeadByte(const OUIRTFReaderCodePage *codePage, OFByte leadByte)
+{
+    OBPRECONDITION(codePage->leadBytes[leadByte]);
+
+    unichar *row = codePage->pairRows[leadByte];
+    if (row != NULL)
+        return row;
+
+    row = malloc(sizeof(*row) * 256);
+    for (unsigned int trailByte = 0; trailByte < 256; trailByte++) {
+        OFByte pair[2] = {leadByte, (OFByte)trailByte};
+        row[trailByte] = _decodeBytes(pair, 2, codePage->encoding);
+    }
+
+    // Another reader may have beaten us to it, in which case theirs stands
+    OUIRTFReaderCodePage *mutableCodePage = (OUIRTFReaderCodePage *)codePage;
+    if (!OSAtomicCompareAndSwapPtrBarrier(NULL, row, (void * volatile *)&mutableCodePage->pairRows[leadByte])) {
+        free(row);
+        row = codePage->pairRows[leadByte];
+    }
+    return row;
+}
 
 @interface OUIRTFReaderFontTableEntry : OFObject
 {
@@ -174,127 +647,215 @@ RCS_ID("$Id$");
 
 @implementation OUIRTFReader
 
-@synthesize attributedString = _attributedString;
+static OFByteSet *StandardReservedSet, *SemicolonReservedSet;
+static OFByteSet *LetterSequenceDelimiters;
+static OFByteSet *GroupSkipSet;
+static CGColorSpaceRef RGBColorSpace;
+
+#define OUIRTFReaderMaximumKeywordLength (32) // The RTF spec limits control words to 32 letters
+#define OUIRTFReaderMaximumKeywordCount (128)
+
+typedef struct {
+    const char *keyword;
+    NSUInteger length;
+    SEL selector;
+    IMP implementation;
+    int value; // Passed when the control word has no parameter, or always if forceValue is set
+    unsigned int forceValue:1;
+    unsigned int attributeOnly:1; // Only affects attributes, so plain text extraction ignores it
+} OUIRTFReaderKeyword;
+
+static OUIRTFReaderKeyword KeywordTable[OUIRTFReaderMaximumKeywordCount];
+static NSUInteger KeywordCount;
+static uint8_t *KeywordHashSlots; // One more than an index into KeywordTable, or zero for an empty slot
+static uint32_t KeywordHashMask;
+static uint32_t KeywordHashSeed;
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+
+// What a parse that collects statistics counts as it goes. The rest of OUIRTFReaderStatistics is filled in at the end.
+typedef struct _OUIRTFReaderCounters {
+    NSUInteger controlWordCounts[OUIRTFReaderMaximumKeywordCount]; // Indexed like KeywordTable
+    NSUInteger unknownControlWordCount;
+    NSUInteger controlSymbolCount;
+    NSUInteger groupCount;
+    NSUInteger maximumGroupDepth;
+    NSUInteger attributeCacheHitCount;
+    NSUInteger attributeCacheMissCount;
+    NSUInteger fontResolutionCount;
+    uint64_t fontResolutionTime; // In mach_absolute_time() units
+} OUIRTFReaderCounters;
+
+#define COUNT(counter) do { \
+    if (_counters != NULL) \
+        _counters->counter++; \
+} while (0)
+
+static NSTimeInterval _secondsFromAbsoluteTime(uint64_t absoluteTime)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)absoluteTime * timebase.numer / timebase.denom / 1e9;
+}
+
+#else
 
-static OFCharacterSet *StandardReservedSet, *SemicolonReservedSet;
-static OFCharacterSet *LetterSequenceDelimiters;
-static OFCharacterSet *NumericParameterDelimiters;
-static NSMutableDictionary *KeywordActions;
+#define COUNT(counter) do { } while (0)
 
-+ (void)initialize;
+#endif
+
+static inline uint32_t _keywordHash(const char *keyword, NSUInteger length, uint32_t seed)
 {
-    OBINITIALIZE;
+    uint32_t hash = seed ^ (uint32_t)length;
+    while (length--)
+        hash = (hash ^ (uint8_t)*keyword++) * 16777619u; // The FNV-1a prime
+    return hash ^ (hash >> 15);
+}
 
-    StandardReservedSet = [[OFCharacterSet alloc] initWithString:@"\\{}\r\n"];
-    SemicolonReservedSet = [[OFCharacterSet alloc] initWithString:@"\\{}\r\n;"];
+// The hash is perfect over the registered keywords, so this is a single probe; the compare rejects unknown keywords that land in a used slot.
+static inline const OUIRTFReaderKeyword *_lookupKeyword(const char *keyword, NSUInteger length)
+{
+    uint8_t slot = KeywordHashSlots[_keywordHash(keyword, length, KeywordHashSeed) & KeywordHashMask];
+    if (slot == 0)
+        return NULL;
 
-    LetterSequenceDelimiters = [[OFCharacterSet alloc] init];
-    [LetterSequenceDelimiters addAllCharacters];
-    [LetterSequenceDelimiters removeCharactersInString:@"abcdefghijklmnopqrstuvwxyz"];
-    [LetterSequenceDelimiters removeCharactersInString:@"ABCDEFGHIJKLMNOPQRSTUVWXYZ"]; // Word 97-2000 keywords do not follow the requirement that keywords may not contain any uppercase 
-    NumericParameterDelimiters = [[OFCharacterSet alloc] init];
-    [NumericParameterDelimiters addAllCharacters];
-    [NumericParameterDelimiters removeCharactersInString:@"0123456789"];
+    const OUIRTFReaderKeyword *entry = &KeywordTable[slot - 1];
+    if (entry->length != length || memcmp(entry->keyword, keyword, length) != 0)
+        return NULL;
+    return entry;
+}
 
-    KeywordActions = [[NSMutableDictionary alloc] init];
++ (void)initialize;
+{
+    OBINITIALIZE;
 
-    OUIRTFReaderAction *skipDestinationAction = [[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionSkipDestination)] autorelease];
+    StandardReservedSet = [[OFByteSet alloc] init];
+    [StandardReservedSet addBytesFromString:@"\\{}\r\n" encoding:NSASCIIStringEncoding];
+    SemicolonReservedSet = [[OFByteSet alloc] init];
+    [SemicolonReservedSet addBytesFromString:@"\\{}\r\n;" encoding:NSASCIIStringEncoding];
+
+    GroupSkipSet = [[OFByteSet alloc] init];
+    [GroupSkipSet addBytesFromString:@"\\{}" encoding:NSASCIIStringEncoding];
+
+    LetterSequenceDelimiters = [[OFByteSet alloc] init];
+    [LetterSequenceDelimiters addAllBytes];
+    [LetterSequenceDelimiters removeBytesFromString:@"abcdefghijklmnopqrstuvwxyz" encoding:NSASCIIStringEncoding];
+    [LetterSequenceDelimiters removeBytesFromString:@"ABCDEFGHIJKLMNOPQRSTUVWXYZ" encoding:NSASCIIStringEncoding]; // Word 97-2000 keywords do not follow the requirement that keywords may not contain any uppercase 
+
+    // Everything readers share is set up here, before any of them can run, and never changes afterward (apart from the code pages' pair rows, which are only ever filled in)
+    RGBColorSpace = CGColorSpaceCreateDeviceRGB();
+
+    NSUInteger codePageIndex = 0;
+    for (NSUInteger encodingIndex = 0; encodingIndex < sizeof(SingleByteCodePageEncodings) / sizeof(*SingleByteCodePageEncodings); encodingIndex++)
+        _initCodePage(&CodePages[codePageIndex++], SingleByteCodePageEncodings[encodingIndex]);
+    for (NSUInteger encodingIndex = 0; encodingIndex < sizeof(DoubleByteCodePages) / sizeof(*DoubleByteCodePages); encodingIndex++) {
+        OUIRTFReaderCodePage *codePage = &CodePages[codePageIndex++];
+        _initCodePage(codePage, DoubleByteCodePages[encodingIndex].encoding);
+        for (NSUInteger rangeIndex = 0; rangeIndex < 3; rangeIndex++) {
+            const OFByte *range = DoubleByteCodePages[encodingIndex].leadByteRanges[rangeIndex];
+            for (unsigned int byte = range[0]; range[0] != 0 && byte <= range[1]; byte++) {
+                codePage->leadBytes[byte] = YES;
+                codePage->singleBytes[byte] = 0xFFFD;
+            }
+        }
+    }
+    OBASSERT(codePageIndex == OUIRTFReaderCodePageCount);
 
     // Unicode characters
-    [self _registerKeyword:@"uc" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionSetUnicodeSkipCount:)] autorelease]];
-    [self _registerKeyword:@"u" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionInsertUnicodeCharacter:)] autorelease]];
+    [self _registerKeyword:"uc" selector:@selector(_actionSetUnicodeSkipCount:)];
+    [self _registerKeyword:"u" selector:@selector(_actionInsertUnicodeCharacter:)];
 
     // Special keywords
-    [self _registerKeyword:@"page" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionInsertPageBreak)] autorelease]];
+    [self _registerKeyword:"page" selector:@selector(_actionInsertPageBreak)];
+    [self _registerKeyword:"bin" selector:@selector(_actionSkipBinaryData:) defaultValue:0 forceValue:NO attributeOnly:NO];
 
     // Character traits
-    [self _registerKeyword:@"cb" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionBackgroundColor:)] autorelease]];
-    [self _registerKeyword:@"cf" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionForegroundColor:)] autorelease]];
-    [self _registerKeyword:@"b" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionBold:)] autorelease]];
-    [self _registerKeyword:@"i" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionItalic:)] autorelease]];
-    [self _registerKeyword:@"fs" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionFontSize:)] autorelease]];
-    [self _registerKeyword:@"f" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionFontNumber:)] autorelease]];
-    [self _registerKeyword:@"super" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionSuperSubScript:) value:1] autorelease]];
-    [self _registerKeyword:@"sub" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionSuperSubScript:) value:-1] autorelease]];
-    [self _registerKeyword:@"nosupersub" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionSuperSubScript:) value:0] autorelease]];
+    [self _registerAttributeKeyword:"cb" selector:@selector(_actionBackgroundColor:)];
+    [self _registerAttributeKeyword:"cf" selector:@selector(_actionForegroundColor:)];
+    [self _registerAttributeKeyword:"b" selector:@selector(_actionBold:)];
+    [self _registerAttributeKeyword:"i" selector:@selector(_actionItalic:)];
+    [self _registerAttributeKeyword:"fs" selector:@selector(_actionFontSize:)];
+    [self _registerKeyword:"f" selector:@selector(_actionFontNumber:)];
+    [self _registerAttributeKeyword:"super" selector:@selector(_actionSuperSubScript:) value:1];
+    [self _registerAttributeKeyword:"sub" selector:@selector(_actionSuperSubScript:) value:-1];
+    [self _registerAttributeKeyword:"nosupersub" selector:@selector(_actionSuperSubScript:) value:0];
     
     // Underlines
-    [self _registerKeyword:@"ul" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderline:)] autorelease]];
-    [self _registerKeyword:@"uld" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDot)] autorelease]];
-    OUIRTFReaderAction *uldash = [[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDash)] autorelease];
-    [self _registerKeyword:@"uldash" action:uldash];
-    [self _registerKeyword:@"uldashd" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDashDot)] autorelease]];
-    [self _registerKeyword:@"uldashdd" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDashDotDot)] autorelease]];
-    OUIRTFReaderAction *uldb = [[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleDouble] autorelease];
-    [self _registerKeyword:@"uldb" action:uldb];
-    [self _registerKeyword:@"ulnone" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleNone] autorelease]];
-    OUIRTFReaderAction *ulth = [[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleThick] autorelease];
-    [self _registerKeyword:@"ulth" action:ulth];
-    [self _registerKeyword:@"ulthd" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDot)] autorelease]];
-    OUIRTFReaderAction *ulthdash = [[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDash)] autorelease];
-    [self _registerKeyword:@"ulthdash" action:ulthdash];
-    [self _registerKeyword:@"ulthdashd" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDashDot)] autorelease]];
-    [self _registerKeyword:@"ulthdashdd" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDashDotDot)] autorelease]];
+    [self _registerAttributeKeyword:"ul" selector:@selector(_actionUnderline:)];
+    [self _registerAttributeKeyword:"uld" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDot)];
+    [self _registerAttributeKeyword:"uldash" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDash)];
+    [self _registerAttributeKeyword:"uldashd" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDashDot)];
+    [self _registerAttributeKeyword:"uldashdd" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDashDotDot)];
+    [self _registerAttributeKeyword:"uldb" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleDouble];
+    [self _registerAttributeKeyword:"ulnone" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleNone];
+    [self _registerAttributeKeyword:"ulth" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleThick];
+    [self _registerAttributeKeyword:"ulthd" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDot)];
+    [self _registerAttributeKeyword:"ulthdash" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDash)];
+    [self _registerAttributeKeyword:"ulthdashd" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDashDot)];
+    [self _registerAttributeKeyword:"ulthdashdd" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDashDotDot)];
     // Underline styles we don't actually support; translate them into something similar
-    [self _registerKeyword:@"ulwave" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleSingle] autorelease]];
-    [self _registerKeyword:@"ulhwave" action:ulth];
-    [self _registerKeyword:@"ulldash" action:uldash];
-    [self _registerKeyword:@"ulthldash" action:ulthdash];
-    [self _registerKeyword:@"ululdbwave" action:uldb];
+    [self _registerAttributeKeyword:"ulwave" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleSingle];
+    [self _registerAttributeKeyword:"ulhwave" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleThick];
+    [self _registerAttributeKeyword:"ulldash" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleSingle|kCTUnderlinePatternDash)];
+    [self _registerAttributeKeyword:"ulthldash" selector:@selector(_actionUnderlineStyle:) value:(kCTUnderlineStyleThick|kCTUnderlinePatternDash)];
+    [self _registerAttributeKeyword:"ululdbwave" selector:@selector(_actionUnderlineStyle:) value:kCTUnderlineStyleDouble];
 
     // Paragraph formatting properties
-    [self _registerKeyword:@"par" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionNewParagraph)] autorelease]];
-    [self _registerKeyword:@"pard" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphDefault)] autorelease]];
-    [self _registerKeyword:@"qc" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphAlignCenter)] autorelease]];
-    [self _registerKeyword:@"qj" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphAlignJustify)] autorelease]];
-    [self _registerKeyword:@"ql" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphAlignLeft)] autorelease]];
-    [self _registerKeyword:@"qr" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphAlignRight)] autorelease]];
-    [self _registerKeyword:@"fi" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphFirstLineIndent:)] autorelease]];
-    [self _registerKeyword:@"li" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphLeftIndent:)] autorelease]];
-    [self _registerKeyword:@"ri" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionParagraphRightIndent:)] autorelease]];
+    [self _registerKeyword:"par" selector:@selector(_actionNewParagraph)];
+    [self _registerAttributeKeyword:"pard" selector:@selector(_actionParagraphDefault)];
+    [self _registerAttributeKeyword:"qc" selector:@selector(_actionParagraphAlignCenter)];
+    [self _registerAttributeKeyword:"qj" selector:@selector(_actionParagraphAlignJustify)];
+    [self _registerAttributeKeyword:"ql" selector:@selector(_actionParagraphAlignLeft)];
+    [self _registerAttributeKeyword:"qr" selector:@selector(_actionParagraphAlignRight)];
+    [self _registerAttributeKeyword:"fi" selector:@selector(_actionParagraphFirstLineIndent:)];
+    [self _registerAttributeKeyword:"li" selector:@selector(_actionParagraphLeftIndent:)];
+    [self _registerAttributeKeyword:"ri" selector:@selector(_actionParagraphRightIndent:)];
 
     // Color table destination
-    [self _registerKeyword:@"colortbl" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadColorTable)] autorelease]];
-    [self _registerKeyword:@"red" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadColorTableRedValue:)] autorelease]];
-    [self _registerKeyword:@"green" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadColorTableGreenValue:)] autorelease]];
-    [self _registerKeyword:@"blue" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadColorTableBlueValue:)] autorelease]];
+    [self _registerKeyword:"colortbl" selector:@selector(_actionReadColorTable)];
+    [self _registerAttributeKeyword:"red" selector:@selector(_actionReadColorTableRedValue:)];
+    [self _registerAttributeKeyword:"green" selector:@selector(_actionReadColorTableGreenValue:)];
+    [self _registerAttributeKeyword:"blue" selector:@selector(_actionReadColorTableBlueValue:)];
 
     // Font table destination
-    [self _registerKeyword:@"fonttbl" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadFontTable)] autorelease]];
-    [self _registerKeyword:@"fcharset" action:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_actionReadFontCharacterSet:)] autorelease]];
+    [self _registerKeyword:"fonttbl" selector:@selector(_actionReadFontTable)];
+    [self _registerKeyword:"fcharset" selector:@selector(_actionReadFontCharacterSet:)];
 
     // Unsupported destinations
-    [self _registerKeyword:@"author" action:skipDestinationAction];
-    [self _registerKeyword:@"buptim" action:skipDestinationAction];
-    [self _registerKeyword:@"comment" action:skipDestinationAction];
-    [self _registerKeyword:@"creatim" action:skipDestinationAction];
-    [self _registerKeyword:@"doccomm" action:skipDestinationAction];
-    [self _registerKeyword:@"footer" action:skipDestinationAction];
-    [self _registerKeyword:@"footerf" action:skipDestinationAction];
-    [self _registerKeyword:@"footerl" action:skipDestinationAction];
-    [self _registerKeyword:@"footerr" action:skipDestinationAction];
-    [self _registerKeyword:@"footnote" action:skipDestinationAction];
-    [self _registerKeyword:@"ftncn" action:skipDestinationAction];
-    [self _registerKeyword:@"ftnsep" action:skipDestinationAction];
-    [self _registerKeyword:@"ftnsepc" action:skipDestinationAction];
-    [self _registerKeyword:@"header" action:skipDestinationAction];
-    [self _registerKeyword:@"headerf" action:skipDestinationAction];
-    [self _registerKeyword:@"headerl" action:skipDestinationAction];
-    [self _registerKeyword:@"headerr" action:skipDestinationAction];
-    [self _registerKeyword:@"info" action:skipDestinationAction];
-    [self _registerKeyword:@"keywords" action:skipDestinationAction];
-    [self _registerKeyword:@"operator" action:skipDestinationAction];
-    [self _registerKeyword:@"pict" action:skipDestinationAction];
-    [self _registerKeyword:@"printim" action:skipDestinationAction];
-    [self _registerKeyword:@"private1" action:skipDestinationAction];
-    [self _registerKeyword:@"revtim" action:skipDestinationAction];
-    [self _registerKeyword:@"rxe" action:skipDestinationAction];
-    [self _registerKeyword:@"stylesheet" action:skipDestinationAction];
-    [self _registerKeyword:@"subject" action:skipDestinationAction];
-    [self _registerKeyword:@"tc" action:skipDestinationAction];
-    [self _registerKeyword:@"title" action:skipDestinationAction];
-    [self _registerKeyword:@"txe" action:skipDestinationAction];
-    [self _registerKeyword:@"xe" action:skipDestinationAction];
+    [self _registerKeyword:"author" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"buptim" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"comment" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"creatim" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"doccomm" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"footer" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"footerf" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"footerl" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"footerr" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"footnote" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"ftncn" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"ftnsep" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"ftnsepc" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"header" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"headerf" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"headerl" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"headerr" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"info" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"keywords" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"operator" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"pict" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"printim" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"private1" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"revtim" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"rxe" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"stylesheet" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"subject" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"tc" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"title" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"txe" selector:@selector(_actionSkipDestination)];
+    [self _registerKeyword:"xe" selector:@selector(_actionSkipDestination)];
+
+    [self _buildKeywordHash];
 }
 
 #ifdef DEBUG_RTF_READER
@@ -334,255 +895,975 @@ static NSMutableDictionary *KeywordActions;
 
 + (NSAttributedString *)parseRTFString:(NSString *)rtfString;
 {
-    NSAttributedString *result = nil;
-    OMNI_POOL_START {
-        OUIRTFReader *parser = [[self alloc] _initWithRTFString:rtfString];
-        result = [parser.attributedString retain];
-        [parser release];
+    OFStringByteScanner *scanner = [[OFStringByteScanner alloc] initWithString:rtfString];
+    NSAttributedString *result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingUTF8 plainTextOnly:NO];
+    [scanner release];
 #ifdef DEBUG_RTF_READER
-        NSLog(@"+[OUIRTFReader parseRTFString]: '%@' -> [%@]", rtfString, result);
+    NSLog(@"+[OUIRTFReader parseRTFString]: '%@' -> [%@]", rtfString, result);
 #endif
-    } OMNI_POOL_END;
-    return [result autorelease];
+    return result;
 }
 
-+ (void)_registerKeyword:(NSString *)keyword action:(OUIRTFReaderAction *)action;
++ (NSAttributedString *)parseRTFData:(NSData *)rtfData;
 {
-    OBPRECONDITION(KeywordActions != nil);
-    [KeywordActions setObject:action forKey:keyword];
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    NSAttributedString *result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:NO];
+    [scanner release];
+    return result;
 }
 
-- (id)_initWithRTFString:(NSString *)rtfString;
++ (NSAttributedString *)parseRTFFileAtPath:(NSString *)path error:(NSError **)outError;
 {
-    if (!(self = [super init]))
-        return nil;
-    
-    _attributedString = [[NSMutableAttributedString alloc] init];
-    _scanner = [[OFStringScanner alloc] initWithString:rtfString];
-    _currentState = [[OUIRTFReaderState alloc] init];
-    _pushedStates = [[NSMutableArray alloc] init];
-    _colorTable = [[NSMutableArray alloc] init];
-    _fontTable = [[NSMutableArray alloc] init];
-
-    [self _parseRTF];
-
-    return self;
+    return [self _parseRTFFileAtPath:path plainTextOnly:NO error:outError];
 }
 
-- (void)dealloc;
++ (NSAttributedString *)parseRTFFromFileDescriptor:(int)fd error:(NSError **)outError;
 {
-    [_attributedString release];
-    [_scanner release];
-    [_currentState release];
-    [_pushedStates release];
-    [_colorTable release];
-    [_fontTable release];
-
-    [super dealloc];
+    return [self _parseRTFFromFileDescriptor:fd plainTextOnly:NO options:nil task:nil statistics:NULL error:outError];
 }
 
-- (void)_handleKeyword:(NSString *)keyword;
++ (NSString *)plainTextFromRTFString:(NSString *)rtfString;
 {
-#ifdef DEBUG_RTF_READER
-    NSLog(@"RTF control word: %@", keyword);
-#endif
-    OUIRTFReaderAction *action = [KeywordActions objectForKey:keyword];
-    [action performActionWithParser:self];
+    OFStringByteScanner *scanner = [[OFStringByteScanner alloc] initWithString:rtfString];
+    NSString *result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingUTF8 plainTextOnly:YES];
+    [scanner release];
+    return result;
 }
 
-- (void)_handleKeyword:(NSString *)keyword parameter:(int)parameter;
++ (NSString *)plainTextFromRTFData:(NSData *)rtfData;
 {
-#ifdef DEBUG_RTF_READER
-    NSLog(@"RTF control word: %@ parameter:%d", keyword, parameter);
-#endif
-
-    OUIRTFReaderAction *action = [KeywordActions objectForKey:keyword];
-    [action performActionWithParser:self parameter:parameter];
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    NSString *result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:YES];
+    [scanner release];
+    return result;
 }
 
-- (void)_actionSkipDestination;
++ (NSString *)plainTextFromRTFFileAtPath:(NSString *)path error:(NSError **)outError;
 {
-#ifdef DEBUG_RTF_READER
-    NSLog(@"Skipping destination");
-#endif
-    _currentState->_flags.discardText = YES;
+    return [self _parseRTFFileAtPath:path plainTextOnly:YES error:outError];
 }
 
-#pragma mark -
-#pragma mark Parse color table
-
-- (CGColorRef)_newCurrentColorTableCGColor;
++ (NSString *)plainTextFromRTFFileDescriptor:(int)fd error:(NSError **)outError;
 {
-    static CGColorSpaceRef rgbColorSpace = NULL;
-    if (rgbColorSpace == NULL)
-        rgbColorSpace = CGColorSpaceCreateDeviceRGB();
-
-    if (_colorTableRedComponent < 0 || _colorTableGreenComponent < 0 || _colorTableBlueComponent < 0)
-        return NULL;
-
-    CGFloat components[] = {_colorTableRedComponent / 255.0f, _colorTableGreenComponent / 255.0f, _colorTableBlueComponent / 255.0f, 1.0f};
-    return CGColorCreate(rgbColorSpace, components);
+    return [self _parseRTFFromFileDescriptor:fd plainTextOnly:YES options:nil task:nil statistics:NULL error:outError];
 }
 
-- (void)_resetCurrentColorTableColor;
++ (id)_parseRTFFileAtPath:(NSString *)path plainTextOnly:(BOOL)plainTextOnly error:(NSError **)outError;
 {
-    _colorTableRedComponent = -1;
-    _colorTableGreenComponent = -1;
-    _colorTableBlueComponent = -1;
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        OBErrorWithErrno(outError, OMNI_ERRNO(), "open", path, NSLocalizedStringFromTableInBundle(@"Unable to open RTF file.", @"OmniUI", OMNI_BUNDLE, @"error description"));
+        return nil;
+    }
+
+    id result = [self _parseRTFFromFileDescriptor:fd plainTextOnly:plainTextOnly options:nil task:nil statistics:NULL error:outError];
+    close(fd);
+    return result;
 }
 
-- (void)_addColorTableEntry;
++ (id)_parseRTFFromFileDescriptor:(int)fd plainTextOnly:(BOOL)plainTextOnly options:(OUIRTFReaderOptions *)options task:(OUIRTFReaderTask *)task statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
 {
-    scannerSkipPeekedCharacter(_scanner); // Skip ';'
-    CGColorRef currentColor = [self _newCurrentColorTableCGColor];
-    if (currentColor != nil) {
-        [_colorTable addObject:(id)currentColor];
-        CGColorRelease(currentColor);
-    } else {
-        [_colorTable addObject:[NSNull null]];
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithFileDescriptor:fd closeOnDealloc:NO];
+    id result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:plainTextOnly options:options task:task scratch:NULL statistics:outStatistics error:outError];
+
+    NSError *readError = [scanner readError];
+    if (readError != nil) {
+        if (outError)
+            *outError = [[readError retain] autorelease];
+        result = nil;
     }
-    [self _resetCurrentColorTableColor];
-}
 
-- (void)_actionReadColorTable;
-{
-    [self _actionSkipDestination]; // Don't let any text from the color table slip into the output stream
-    [self _resetCurrentColorTableColor];
-    [self _parseRTFGroupWithSemicolonAction:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_addColorTableEntry)] autorelease]];
+    [scanner release];
+    return result;
 }
 
-- (CGColorRef)_colorAtIndex:(int)colorTableIndex;
++ (NSArray *)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options;
 {
-    id colorTableEntry = [_colorTable objectAtIndex:colorTableIndex];
-    if ([colorTableEntry isNull])
-        return NULL;
-    else
-        return (CGColorRef)colorTableEntry;
+    return [self parseRTFStrings:rtfStrings options:options errors:NULL];
 }
 
-#pragma mark -
-#pragma mark Parse font table
-
-- (void)_addFontTableEntry;
++ (NSArray *)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options errors:(NSArray **)outErrors;
 {
-    scannerSkipPeekedCharacter(_scanner); // Skip ';'
-
-    // Read and reset alternate destination
-    NSString *fontName = [NSString stringWithString:_currentState.alternateDestination];
-    _currentState.alternateDestination = [NSMutableString string];
-
-#ifdef DEBUG_RTF_READER
-    NSLog(@"Font table entry: %@", fontName);
-#endif
-
-    int fontNumber = _currentState.fontNumber;
-    if (fontNumber < 0)
-        return; // Protect against bad RTF
+    OBPRECONDITION(rtfStrings != nil);
 
-    OUIRTFReaderFontTableEntry *fontEntry = [[OUIRTFReaderFontTableEntry alloc] init];
-    fontEntry.name = fontName;
-    fontEntry.encoding = _currentState.fontEncoding;
+    NSUInteger documentCount = [rtfStrings count];
+    if (documentCount == 0) {
+        if (outErrors)
+            *outErrors = [NSArray array];
+        return [NSArray array];
+    }
 
-    int entryCount = (int)[_fontTable count];
-    if (fontNumber < entryCount) {
-        [_fontTable replaceObjectAtIndex:fontNumber withObject:fontEntry];
-    } else {
-        while (fontNumber > entryCount) {
-            [_fontTable addObject:[NSNull null]];
-            entryCount++;
+    BOOL plainTextOnly = options.plainTextOnly;
+    NSUInteger workerCount = options.maximumConcurrentParses;
+    if (workerCount == 0)
+        workerCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    workerCount = MIN(workerCount, documentCount);
+
+    // Each worker takes the next document from a shared counter, so one slow document only holds up its own worker. Workers write only their own documents' slots.
+    id *results = calloc(documentCount, sizeof(*results));
+    id *errors = outErrors ? calloc(documentCount, sizeof(*errors)) : NULL;
+    __block int32_t lastClaimedIndex = -1;
+    dispatch_apply(workerCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t workerIndex) {
+        OUIRTFReaderScratch scratch = {NULL, 0};
+        while (YES) {
+            NSUInteger documentIndex = (NSUInteger)OSAtomicIncrement32Barrier(&lastClaimedIndex);
+            if (documentIndex >= documentCount)
+                break;
+            OMNI_POOL_START {
+                NSError *error = nil;
+                OFStringByteScanner *scanner = [[OFStringByteScanner alloc] initWithString:[rtfStrings objectAtIndex:documentIndex]];
+                results[documentIndex] = [[self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingUTF8 plainTextOnly:plainTextOnly options:options task:nil scratch:&scratch statistics:NULL error:&error] retain];
+                [scanner release];
+                if (errors != NULL)
+                    errors[documentIndex] = [(error != nil ? (id)error : [NSNull null]) retain]; // Retained past the pool
+            } OMNI_POOL_END;
         }
-        [_fontTable addObject:fontEntry];
+        free(scratch.stateStack);
+    });
+
+    NSArray *resultArray = [NSArray arrayWithObjects:results count:documentCount];
+    for (NSUInteger documentIndex = 0; documentIndex < documentCount; documentIndex++)
+        [results[documentIndex] release];
+    free(results);
+    if (errors != NULL) {
+        *outErrors = [NSArray arrayWithObjects:errors count:documentCount];
+        for (NSUInteger documentIndex = 0; documentIndex < documentCount; documentIndex++)
+            [errors[documentIndex] release];
+        free(errors);
     }
-    [fontEntry release];
+    return resultArray;
 }
 
-- (void)_actionReadFontTable;
++ (void)parseRTFStrings:(NSArray *)rtfStrings options:(OUIRTFReaderOptions *)options completion:(void (^)(NSArray *results, NSArray *errors))completion;
 {
-    _currentState.alternateDestination = [NSMutableString string];
-    [self _parseRTFGroupWithSemicolonAction:[[[OUIRTFReaderSelectorAction alloc] initWithSelector:@selector(_addFontTableEntry)] autorelease]];
-}
+    OBPRECONDITION(completion != NULL);
 
-- (void)_actionReadFontCharacterSet:(int)characterSet;
-{
-    _currentState.fontCharacterSet = characterSet;
+    rtfStrings = [[rtfStrings copy] autorelease]; // The caller may go on to change theirs
+    options = [[options copy] autorelease];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        OMNI_POOL_START {
+            NSArray *errors = nil;
+            NSArray *results = [self parseRTFStrings:rtfStrings options:options errors:&errors];
+            completion(results, errors);
+        } OMNI_POOL_END;
+    });
 }
 
-- (NSString *)_fontNameAtIndex:(int)fontTableIndex;
++ (id)parseRTFData:(NSData *)rtfData options:(OUIRTFReaderOptions *)options statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
 {
-    static NSString *DefaultFontName = @"Helvetica";
+    OBPRECONDITION(rtfData != nil);
 
-    if (fontTableIndex >= (int)[_fontTable count])
-        return DefaultFontName;
-    OUIRTFReaderFontTableEntry *fontTableEntry = [_fontTable objectAtIndex:fontTableIndex];
-    if ([fontTableEntry isNull])
-        return DefaultFontName;
-    return fontTableEntry.name;
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    id result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:options.plainTextOnly options:options task:nil scratch:NULL statistics:outStatistics error:outError];
+    [scanner release];
+    return result;
 }
 
-- (CFStringEncoding)_fontEncodingAtIndex:(int)fontTableIndex;
++ (id)parseRTFFromFileDescriptor:(int)fd options:(OUIRTFReaderOptions *)options statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
 {
-    CFStringEncoding DefaultFontEncoding = kCFStringEncodingWindowsLatin1;
-    if (fontTableIndex >= (int)[_fontTable count])
-        return DefaultFontEncoding;
-    OUIRTFReaderFontTableEntry *fontTableEntry = [_fontTable objectAtIndex:fontTableIndex];
-    if ([fontTableEntry isNull])
-        return DefaultFontEncoding;
-    return fontTableEntry.encoding;
+    return [self _parseRTFFromFileDescriptor:fd plainTextOnly:options.plainTextOnly options:options task:nil statistics:outStatistics error:outError];
 }
 
-#pragma mark -
-#pragma mark Actions
-
-- (void)_actionBackgroundColor:(int)colorTableIndex;
++ (OUIRTFReaderTask *)parseRTFData:(NSData *)rtfData options:(OUIRTFReaderOptions *)options progress:(OUIRTFReaderProgressHandler)progress completion:(void (^)(id result, NSError *error))completion;
 {
-    CGColorRef color = [self _colorAtIndex:colorTableIndex];
-#ifdef DEBUG_RTF_READER
-    NSLog(@"Setting background color: %@ (%@)", (id)color, [(id)color class]);
-#endif
-    _currentState.backgroundColor = (id)color;
-}
+    OBPRECONDITION(rtfData != nil);
+    OBPRECONDITION(completion != NULL);
 
-- (void)_actionForegroundColor:(int)colorTableIndex;
-{
-    CGColorRef color = [self _colorAtIndex:colorTableIndex];
-#ifdef DEBUG_RTF_READER
-    NSLog(@"Setting foreground color: %@", [OUIRTFReader debugStringForColor:color]);
-#endif
-    _currentState.foregroundColor = (id)color;
+    rtfData = [[rtfData copy] autorelease]; // The caller may go on to change theirs
+    options = [[options copy] autorelease];
+    OUIRTFReaderTask *task = [[[OUIRTFReaderTask alloc] _initWithProgressHandler:progress] autorelease];
+    [task _setTotalLength:[rtfData length]];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        OMNI_POOL_START {
+            NSError *error = nil;
+            id result = nil;
+            if ([task isCancelled]) {
+                OBUserCancelledError(&error); // Before we'd started
+            } else {
+                OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+                result = [self _parseRTFWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:options.plainTextOnly options:options task:task scratch:NULL statistics:NULL error:&error];
+                [scanner release];
+            }
+            completion(result, error);
+        } OMNI_POOL_END;
+    });
+    return task;
 }
 
-- (void)_actionBold:(int)value;
++ (OUIRTFReaderTask *)parseRTFFileAtPath:(NSString *)path options:(OUIRTFReaderOptions *)options progress:(OUIRTFReaderProgressHandler)progress completion:(void (^)(id result, NSError *error))completion;
 {
-    _currentState.bold = value != 0;
+    OBPRECONDITION(path != nil);
+    OBPRECONDITION(completion != NULL);
+
+    path = [[path copy] autorelease];
+    options = [[options copy] autorelease];
+    OUIRTFReaderTask *task = [[[OUIRTFReaderTask alloc] _initWithProgressHandler:progress] autorelease];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        OMNI_POOL_START {
+            NSError *error = nil;
+            id result = nil;
+            int fd = -1;
+            if ([task isCancelled]) {
+                OBUserCancelledError(&error); // Before we'd started
+            } else if ((fd = open([path fileSystemRepresentation], O_RDONLY)) < 0) {
+                OBErrorWithErrno(&error, OMNI_ERRNO(), "open", path, NSLocalizedStringFromTableInBundle(@"Unable to open RTF file.", @"OmniUI", OMNI_BUNDLE, @"error description"));
+            } else {
+                struct stat fileInfo;
+                if (fstat(fd, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode))
+                    [task _setTotalLength:(NSUInteger)fileInfo.st_size];
+                result = [self _parseRTFFromFileDescriptor:fd plainTextOnly:options.plainTextOnly options:options task:task statistics:NULL error:&error];
+                close(fd);
+            }
+            completion(result, error);
+        } OMNI_POOL_END;
+    });
+    return task;
 }
 
-- (void)_actionItalic:(int)value;
++ (BOOL)parseRTFData:(NSData *)rtfData delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
 {
-    _currentState.italic = value != 0;
+    OBPRECONDITION(rtfData != nil);
+
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    BOOL success = [self _parseRTFWithScanner:scanner delegate:delegate options:options error:outError];
+    [scanner release];
+    return success;
 }
 
-- (void)_actionUnderline:(int)parameter;
++ (BOOL)parseRTFFromFileDescriptor:(int)fd delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
+{
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithFileDescriptor:fd closeOnDealloc:NO];
+    BOOL success = [self _parseRTFWithScanner:scanner delegate:delegate options:options error:outError];
+
+    NSError *readError = [scanner readError];
+    if (readError != nil) {
+        if (outError)
+            *outError = [[readError retain] autorelease];
+        success = NO;
+    }
+
+    [scanner release];
+    return success;
+}
+
++ (OUIRTFDocumentIndex *)indexRTFData:(NSData *)rtfData;
+{
+    OUIRTFDocumentIndex *index = [[OUIRTFDocumentIndex alloc] _initWithDocumentLength:[rtfData length]];
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:NO scratch:NULL];
+        [parser _startIndexing:index indexOnly:YES];
+        [parser _parseRTF];
+        [parser _finishIndexing];
+        [parser release];
+    } OMNI_POOL_END;
+    [scanner release];
+    return [index autorelease];
+}
+
++ (NSAttributedString *)parseRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index;
+{
+    return [self _parseRange:entryRange ofRTFData:rtfData index:index plainTextOnly:NO];
+}
+
++ (NSString *)plainTextFromRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index;
+{
+    return [self _parseRange:entryRange ofRTFData:rtfData index:index plainTextOnly:YES];
+}
+
++ (id)_parseRange:(NSRange)entryRange ofRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex *)index plainTextOnly:(BOOL)plainTextOnly;
+{
+    OBPRECONDITION(rtfData != nil);
+    OBPRECONDITION(index != nil);
+
+    NSUInteger entryCount = index.entryCount;
+    if ([rtfData length] != index.documentLength)
+        [NSException raise:NSInvalidArgumentException format:@"The RTF data (%lu bytes) is not what the index was built from (%lu bytes)", [rtfData length], index.documentLength];
+    if (entryRange.location > entryCount || entryRange.length > entryCount - entryRange.location)
+        [NSException raise:NSRangeException format:@"Entry range %@ is out of bounds for an index of %lu entries", NSStringFromRange(entryRange), entryCount];
+
+    if (entryRange.length == 0)
+        return plainTextOnly ? (id)@"" : (id)[[[NSAttributedString alloc] init] autorelease];
+
+    id result = nil;
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:plainTextOnly scratch:NULL];
+        [parser _prepareToParseFromEntryAtIndex:entryRange.location toEntryAtIndex:NSMaxRange(entryRange) ofIndex:index];
+        [parser _parseRTF];
+        if (plainTextOnly)
+            result = [parser _newPlainTextString];
+        else
+            result = [parser _newAttributedString];
+        [parser release];
+    } OMNI_POOL_END;
+    [scanner release];
+    return [result autorelease];
+}
+
++ (NSAttributedString *)parseRTFData:(NSData *)rtfData index:(OUIRTFDocumentIndex **)outIndex;
+{
+    OBPRECONDITION(outIndex != NULL);
+
+    NSAttributedString *result = nil;
+    OUIRTFDocumentIndex *index = [[OUIRTFDocumentIndex alloc] _initWithDocumentLength:[rtfData length]];
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:NO scratch:NULL];
+        [parser _startIndexing:index indexOnly:NO];
+        [parser _parseRTF];
+        [parser _finishIndexing];
+        result = [parser _newAttributedString];
+        [parser release];
+    } OMNI_POOL_END;
+    [scanner release];
+
+    *outIndex = [index autorelease];
+    return [result autorelease];
+}
+
++ (NSRange)reparseEditedRTFData:(NSData *)rtfData editedRange:(NSRange)editedRange changeInLength:(NSInteger)delta attributedString:(NSMutableAttributedString *)attributedString index:(OUIRTFDocumentIndex *)index;
+{
+    OBPRECONDITION(rtfData != nil);
+    OBPRECONDITION(attributedString != nil);
+    OBPRECONDITION(index != nil);
+    OBPRECONDITION((NSInteger)editedRange.length >= delta); // The edited range covers whatever was inserted
+
+    if ([rtfData length] != index.documentLength + delta || NSMaxRange(editedRange) > [rtfData length])
+        [NSException raise:NSInvalidArgumentException format:@"An edit of %@ changing the length by %ld doesn't fit the RTF data (%lu bytes, indexed at %lu bytes)", NSStringFromRange(editedRange), delta, [rtfData length], index.documentLength];
+    if ([attributedString length] != index.characterCount)
+        [NSException raise:NSInvalidArgumentException format:@"The attributed string (%lu characters) is not the result of the indexed parse (%lu characters)", [attributedString length], index.characterCount];
+
+    // An entry's state depends on the bytes before it and on the byte at it (which ends the control word before it, if any), so we start from the last entry before the edit
+    NSUInteger startEntryIndex = editedRange.location == 0 ? NSNotFound : [index indexOfEntryForByteOffset:editedRange.location - 1];
+
+    OUIRTFDocumentIndex *replacementIndex = [[OUIRTFDocumentIndex alloc] _initWithDocumentLength:[rtfData length]];
+    OUIRTFReaderReindexing reindexing;
+    reindexing.previousIndex = index;
+    reindexing.startLocation = 0;
+    reindexing.editEnd = NSMaxRange(editedRange);
+    reindexing.byteDelta = delta;
+    reindexing.caughtUpEntryIndex = NSNotFound;
+
+    NSAttributedString *replacementString = nil;
+    OFDataByteScanner *scanner = [[OFDataByteScanner alloc] initWithData:rtfData];
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:NO scratch:NULL];
+        if (startEntryIndex != NSNotFound) {
+            [parser _prepareToParseFromEntryAtIndex:startEntryIndex toEntryAtIndex:index.entryCount ofIndex:index];
+            [replacementIndex _appendDefinitionsOfEntryAtIndex:startEntryIndex ofIndex:index];
+            reindexing.startLocation = [index byteOffsetOfEntryAtIndex:startEntryIndex];
+        }
+        [parser _startIndexing:replacementIndex indexOnly:NO];
+        parser->_reindexing = &reindexing;
+        [parser _parseRTF];
+        replacementString = [parser _newAttributedString];
+        [parser release];
+    } OMNI_POOL_END;
+    [scanner release];
+
+    // Splice the new text over the old, from where we started to where we caught up
+    NSUInteger replacedEntryStart = startEntryIndex == NSNotFound ? 0 : startEntryIndex + 1;
+    NSUInteger replacedEntryEnd = reindexing.caughtUpEntryIndex == NSNotFound ? index.entryCount : reindexing.caughtUpEntryIndex;
+    NSUInteger replacedCharacterStart = startEntryIndex == NSNotFound ? 0 : [index characterOffsetOfEntryAtIndex:startEntryIndex];
+    NSUInteger replacedCharacterEnd = reindexing.caughtUpEntryIndex == NSNotFound ? index.characterCount : [index characterOffsetOfEntryAtIndex:reindexing.caughtUpEntryIndex];
+    NSRange replacedCharacters = NSMakeRange(replacedCharacterStart, replacedCharacterEnd - replacedCharacterStart);
+    NSUInteger replacementLength = [replacementString length];
+
+    [attributedString replaceCharactersInRange:replacedCharacters withAttributedString:replacementString];
+    [index _replaceEntriesInRange:NSMakeRange(replacedEntryStart, replacedEntryEnd - replacedEntryStart) withEntriesOfIndex:replacementIndex characterOffset:replacedCharacterStart byteDelta:delta characterDelta:(NSInteger)replacementLength - (NSInteger)replacedCharacters.length keepDefinitions:(reindexing.caughtUpEntryIndex != NSNotFound)];
+    OBPOSTCONDITION([attributedString length] == index.characterCount);
+
+    [replacementString release];
+    [replacementIndex release];
+    return NSMakeRange(replacedCharacterStart, replacementLength);
+}
+
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly;
+{
+    return [self _parseRTFWithScanner:scanner textEncoding:textEncoding plainTextOnly:plainTextOnly scratch:NULL];
+}
+
+// Returns an NSString if plainTextOnly is set, otherwise an NSAttributedString. The text encoding applies to unescaped bytes of text; escapes are interpreted as usual.
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly scratch:(OUIRTFReaderScratch *)scratch;
+{
+    return [self _parseRTFWithScanner:scanner textEncoding:textEncoding plainTextOnly:plainTextOnly options:nil task:nil scratch:scratch statistics:NULL error:NULL];
+}
+
+// Only the options' limits are looked at here. If one of them, or cancelling the task, stops the parse, the result is what was read up to there, and the error says why.
++ (id)_parseRTFWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly options:(OUIRTFReaderOptions *)options task:(OUIRTFReaderTask *)task scratch:(OUIRTFReaderScratch *)scratch statistics:(OUIRTFReaderStatistics **)outStatistics error:(NSError **)outError;
+{
+    OUIRTFReaderLimits limits;
+    BOOL isLimited = _initLimits(&limits, options, task);
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+    OUIRTFReaderCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    OUIRTFReaderStatistics *statistics = nil;
+    uint64_t startTime = mach_absolute_time(), parseEndTime = 0;
+#else
+    if (outStatistics != NULL)
+        *outStatistics = nil;
+#endif
+
+    id result = nil;
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:textEncoding plainTextOnly:plainTextOnly scratch:scratch];
+        if (isLimited)
+            parser->_limits = &limits;
+#ifdef OUI_COLLECT_RTF_READER_STATS
+        if (outStatistics != NULL)
+            parser->_counters = &counters;
+#endif
+        [parser _parseRTF];
+#ifdef OUI_COLLECT_RTF_READER_STATS
+        if (outStatistics != NULL) {
+            parseEndTime = mach_absolute_time();
+            statistics = [parser _newStatistics];
+        }
+#endif
+        if (plainTextOnly)
+            result = [parser _newPlainTextString];
+        else
+            result = [parser _newAttributedString];
+        [parser release];
+    } OMNI_POOL_END;
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+    if (outStatistics != NULL) {
+        statistics.parseTime = _secondsFromAbsoluteTime(parseEndTime - startTime);
+        statistics.buildTime = _secondsFromAbsoluteTime(mach_absolute_time() - parseEndTime);
+        *outStatistics = [statistics autorelease];
+    }
+#endif
+
+    if (isLimited && limits.exceededLimit != 0)
+        _getLimitError(outError, limits.exceededLimit);
+    return [result autorelease];
+}
+
++ (BOOL)_parseRTFWithScanner:(OFByteScanner *)scanner delegate:(id <OUIRTFReaderDelegate>)delegate options:(OUIRTFReaderOptions *)options error:(NSError **)outError;
+{
+    OBPRECONDITION(delegate != nil);
+
+    OUIRTFReaderEvents events;
+    memset(&events, 0, sizeof(events));
+    events.delegate = delegate;
+    events.didChangeFormatting = [delegate respondsToSelector:@selector(rtfReader:didChangeFormatting:)];
+    events.foundParagraphBreak = [delegate respondsToSelector:@selector(rtfReaderFoundParagraphBreak:)];
+    events.foundPageBreak = [delegate respondsToSelector:@selector(rtfReaderFoundPageBreak:)];
+    events.foundFontTableEntry = [delegate respondsToSelector:@selector(rtfReader:foundFontTableEntry:name:encoding:)];
+    events.foundColorTableEntry = [delegate respondsToSelector:@selector(rtfReader:foundColorTableEntry:red:green:blue:)];
+
+    OUIRTFReaderLimits limits;
+    BOOL isLimited = _initLimits(&limits, options, nil);
+
+    OMNI_POOL_START {
+        OUIRTFReader *parser = [[self alloc] _initWithScanner:scanner textEncoding:kCFStringEncodingWindowsLatin1 plainTextOnly:options.plainTextOnly scratch:NULL];
+        parser->_events = &events;
+        if (isLimited)
+            parser->_limits = &limits;
+        [parser _parseRTF];
+        [parser release];
+    } OMNI_POOL_END;
+
+    if (isLimited && limits.exceededLimit != 0) {
+        _getLimitError(outError, limits.exceededLimit);
+        return NO;
+    }
+    return YES;
+}
+
++ (void)_registerKeyword:(const char *)keyword selector:(SEL)selector defaultValue:(int)defaultValue forceValue:(BOOL)forceValue attributeOnly:(BOOL)attributeOnly;
+{
+    OBPRECONDITION(KeywordCount < OUIRTFReaderMaximumKeywordCount);
+    OBPRECONDITION(strlen(keyword) <= OUIRTFReaderMaximumKeywordLength);
+
+    Method method = class_getInstanceMethod(self, selector);
+    if (!method)
+        [NSException raise:NSInvalidArgumentException format:@"OUIRTFReader does not respond to the selector %@", NSStringFromSelector(selector)];
+
+    OUIRTFReaderKeyword *entry = &KeywordTable[KeywordCount++];
+    entry->keyword = keyword;
+    entry->length = strlen(keyword);
+    entry->selector = selector;
+    entry->implementation = method_getImplementation(method);
+    entry->value = defaultValue;
+    entry->forceValue = forceValue;
+    entry->attributeOnly = attributeOnly;
+}
+
++ (void)_registerKeyword:(const char *)keyword selector:(SEL)selector;
+{
+    [self _registerKeyword:keyword selector:selector defaultValue:1 forceValue:NO attributeOnly:NO];
+}
+
++ (void)_registerAttributeKeyword:(const char *)keyword selector:(SEL)selector;
+{
+    [self _registerKeyword:keyword selector:selector defaultValue:1 forceValue:NO attributeOnly:YES];
+}
+
++ (void)_registerAttributeKeyword:(const char *)keyword selector:(SEL)selector value:(int)value;
+{
+    [self _registerKeyword:keyword selector:selector defaultValue:value forceValue:YES attributeOnly:YES];
+}
+
+// Searches for a seed under which no two keywords share a slot. With at least eight slots per keyword a seed turns up within a few dozen tries; if one doesn't, we double the table and look again.
++ (void)_buildKeywordHash;
+{
+    OBPRECONDITION(KeywordHashSlots == NULL);
+    OBPRECONDITION(KeywordCount > 0 && KeywordCount < 256); // Slots are bytes
+
+    NSUInteger slotCount = 16;
+    while (slotCount < 8 * KeywordCount)
+        slotCount <<= 1;
+
+    while (YES) {
+        uint8_t *slots = malloc(slotCount);
+        uint32_t mask = (uint32_t)(slotCount - 1);
+
+        for (uint32_t attempt = 1; attempt <= 1024; attempt++) {
+            uint32_t seed = attempt * 2654435761u;
+            BOOL collided = NO;
+
+            memset(slots, 0, slotCount);
+            for (NSUInteger keywordIndex = 0; keywordIndex < KeywordCount; keywordIndex++) {
+                const OUIRTFReaderKeyword *entry = &KeywordTable[keywordIndex];
+                uint32_t slotIndex = _keywordHash(entry->keyword, entry->length, seed) & mask;
+                if (slots[slotIndex] != 0) {
+                    OBASSERT(KeywordTable[slots[slotIndex] - 1].length != entry->length || strcmp(KeywordTable[slots[slotIndex] - 1].keyword, entry->keyword) != 0); // Registered twice?
+                    collided = YES;
+                    break;
+                }
+                slots[slotIndex] = (uint8_t)(keywordIndex + 1);
+            }
+
+            if (!collided) {
+                KeywordHashSlots = slots;
+                KeywordHashMask = mask;
+                KeywordHashSeed = seed;
+                return;
+            }
+        }
+
+        free(slots);
+        slotCount <<= 1;
+    }
+}
+
+- (id)_initWithScanner:(OFByteScanner *)scanner textEncoding:(CFStringEncoding)textEncoding plainTextOnly:(BOOL)plainTextOnly scratch:(OUIRTFReaderScratch *)scratch;
+{
+    if (!(self = [super init]))
+        return nil;
+    
+    _flags.plainTextOnly = plainTextOnly;
+    OUIRTFStringBuilderInit(&_stringBuilder);
+    _scanner = [scanner retain];
+    _textEncoding = textEncoding;
+    _scratch = scratch;
+    if (scratch != NULL && scratch->stateStack != NULL) {
+        _stateStack = scratch->stateStack;
+        _stateStackCapacity = scratch->stateStackCapacity;
+        scratch->stateStack = NULL;
+    } else {
+        _stateStackCapacity = OUIRTFReaderInitialStateStackCapacity;
+        _stateStack = malloc(sizeof(*_stateStack) * _stateStackCapacity);
+    }
+    _stateStackDepth = 0;
+    _currentState = _stateStack;
+    _initState(_currentState);
+    _colorTable = [[NSMutableArray alloc] init];
+    _fontTable = [[NSMutableArray alloc] init];
+    _stopLocation = NSUIntegerMax;
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_scanner release];
+    for (NSUInteger stateIndex = 0; stateIndex <= _stateStackDepth; stateIndex++)
+        _releaseState(&_stateStack[stateIndex]);
+    if (_scratch != NULL && _scratch->stateStack == NULL) {
+        // Hand our (possibly grown) stack back for the next document
+        _scratch->stateStack = _stateStack;
+        _scratch->stateStackCapacity = _stateStackCapacity;
+    } else
+        free(_stateStack);
+    if (_attributesByFormatting != NULL)
+        CFRelease(_attributesByFormatting);
+    [_colorTable release];
+    [_fontTable release];
+    [_index release];
+    OUIRTFStringBuilderRelease(&_stringBuilder);
+
+    [super dealloc];
+}
+
+- (NSString *)_newPlainTextString;
+{
+    OBPRECONDITION(_flags.plainTextOnly);
+    return OUIRTFStringBuilderNewString(&_stringBuilder);
+}
+
+- (NSAttributedString *)_newAttributedString;
+{
+    OBPRECONDITION(!_flags.plainTextOnly);
+    return OUIRTFStringBuilderNewAttributedString(&_stringBuilder);
+}
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+
+// Everything but the parse and build times, which our caller measures. Call this before taking the result.
+- (OUIRTFReaderStatistics *)_newStatistics;
+{
+    OBPRECONDITION(_counters != NULL);
+
+    OUIRTFReaderStatistics *statistics = [[OUIRTFReaderStatistics alloc] init];
+    statistics.bytesScanned = byteScannerScanLocation(_scanner);
+
+    NSMutableDictionary *controlWordCounts = [[NSMutableDictionary alloc] init];
+    for (NSUInteger keywordIndex = 0; keywordIndex < KeywordCount; keywordIndex++) {
+        NSUInteger count = _counters->controlWordCounts[keywordIndex];
+        if (count != 0)
+            [controlWordCounts setUnsignedIntegerValue:count forKey:[NSString stringWithUTF8String:KeywordTable[keywordIndex].keyword]];
+    }
+    statistics.controlWordCounts = controlWordCounts;
+    [controlWordCounts release];
+
+    statistics.unknownControlWordCount = _counters->unknownControlWordCount;
+    statistics.controlSymbolCount = _counters->controlSymbolCount;
+    statistics.groupCount = _counters->groupCount;
+    statistics.maximumGroupDepth = _counters->maximumGroupDepth;
+    statistics.attributeCacheHitCount = _counters->attributeCacheHitCount;
+    statistics.attributeCacheMissCount = _counters->attributeCacheMissCount;
+    statistics.fontResolutionCount = _counters->fontResolutionCount;
+    statistics.fontResolutionTime = _secondsFromAbsoluteTime(_counters->fontResolutionTime);
+    statistics.outputLength = OUIRTFStringBuilderGetLength(&_stringBuilder);
+    statistics.runCount = _stringBuilder.runCount;
+    return statistics;
+}
+
+#endif
+
+- (void)_actionSkipDestination;
+{
+#ifdef DEBUG_RTF_READER
+    NSLog(@"Skipping destination");
+#endif
+    _currentState->discardText = 1; // In case the group isn't closed and we carry on after it
+    [self _skipToEndOfGroup];
+}
+
+- (void)_actionSkipBinaryData:(int)length;
+{
+    // \binN is followed by N raw bytes (after the control word's delimiter, which _parseKeyword has already eaten). We have no use for them, and they must not be taken for text or markup.
+    if (length > 0)
+        byteScannerSkipBytes(_scanner, length);
+}
+
+- (void)_discardDestinationText;
+{
+    _currentState->discardText = 1;
+}
+
+// Skips ahead to the '}' that closes the current group, leaving it for the caller's parse loop to pop the group as usual. None of the skipped markup is interpreted, except that escaped braces aren't counted and \binN payloads are jumped over whole, so this runs at the speed of the vectorized scan for '{', '}' and '\'.
+- (void)_skipToEndOfGroup;
+{
+    NSUInteger depth = 0;
+    while (byteScannerScanUpToByteInOFByteSet(_scanner, GroupSkipSet)) {
+        OFByte byte = *_scanner->scanLocation;
+        byteScannerSkipPeekedByte(_scanner);
+
+        if (byte == '{') {
+            depth++;
+        } else if (byte == '}') {
+            if (depth == 0) {
+                _scanner->scanLocation--; // Leave it for the parse loop
+                return;
+            }
+            depth--;
+        } else {
+            OBASSERT(byte == '\\');
+            OFByte controlCharacter = byteScannerPeekByte(_scanner);
+            if (isByteInByteSet(controlCharacter, LetterSequenceDelimiters)) {
+                byteScannerSkipPeekedByte(_scanner); // A control symbol; this is how \{, \} and \\ get skipped
+                continue;
+            }
+
+            OFByte keywordBuffer[4];
+            const OFByte *keyword;
+            NSUInteger keywordLength = byteScannerReadTokenWithDelimiterOFByteSet(_scanner, LetterSequenceDelimiters, &keyword, keywordBuffer, sizeof(keywordBuffer));
+            if (keywordLength != 3 || memcmp(keyword, "bin", 3) != 0)
+                continue; // Other parameters are just digits, which the scan passes over
+
+            OFByte parameterStart = byteScannerPeekByte(_scanner);
+            if (parameterStart == '-' || (parameterStart >= '0' && parameterStart <= '9')) {
+                int length = byteScannerScanClampedSignedInteger(_scanner, -INT_MAX, INT_MAX);
+                if (byteScannerPeekByte(_scanner) == ' ')
+                    byteScannerSkipPeekedByte(_scanner);
+                if (length > 0)
+                    byteScannerSkipBytes(_scanner, length);
+            }
+        }
+    }
+}
+
+#pragma mark -
+#pragma mark Parse color table
+
+- (CGColorRef)_newCurrentColorTableCGColor;
+{
+    if (_colorTableRedComponent < 0 || _colorTableGreenComponent < 0 || _colorTableBlueComponent < 0)
+        return NULL;
+
+    CGFloat components[] = {_colorTableRedComponent / 255.0f, _colorTableGreenComponent / 255.0f, _colorTableBlueComponent / 255.0f, 1.0f};
+    return CGColorCreate(RGBColorSpace, components);
+}
+
+- (void)_resetCurrentColorTableColor;
+{
+    _colorTableRedComponent = -1;
+    _colorTableGreenComponent = -1;
+    _colorTableBlueComponent = -1;
+}
+
+- (void)_appendCurrentColorTableColor;
+{
+    CGColorRef currentColor = [self _newCurrentColorTableCGColor];
+    if (currentColor != nil) {
+        [_colorTable addObject:(id)currentColor];
+        CGColorRelease(currentColor);
+    } else {
+        [_colorTable addObject:[NSNull null]];
+    }
+    [self _resetCurrentColorTableColor];
+    [self _discardCachedStringAttributes];
+}
+
+- (void)_addColorTableEntry;
+{
+    byteScannerSkipPeekedByte(_scanner); // Skip ';'
+    if (_limits != NULL && [_colorTable count] > _limits->maximumTableIndex) {
+        [self _stopForExceededLimit:OUIRTFReaderTableIndexTooLargeError];
+        return;
+    }
+    if (_index != nil) {
+        OFDataBuffer *definitions = [_index _colorDefinitions];
+        OFDataBufferAppendCompressedLongLongInt(definitions, _zigzagEncode(_colorTableRedComponent));
+        OFDataBufferAppendCompressedLongLongInt(definitions, _zigzagEncode(_colorTableGreenComponent));
+        OFDataBufferAppendCompressedLongLongInt(definitions, _zigzagEncode(_colorTableBlueComponent));
+    }
+    if (_events != NULL && _events->foundColorTableEntry)
+        [_events->delegate rtfReader:self foundColorTableEntry:[_colorTable count] red:_colorTableRedComponent green:_colorTableGreenComponent blue:_colorTableBlueComponent];
+    [self _appendCurrentColorTableColor];
+}
+
+// Rebuilds the color table from what an index recorded as _addColorTableEntry saw it
+- (void)_replayColorDefinitions:(const OFByte *)definitions length:(NSUInteger)length;
+{
+    const OFByte *cursor = definitions, *end = definitions + length;
+    while (cursor < end) {
+        int64_t red, green, blue;
+        if (!_readSignedInteger(&cursor, end, &red) || !_readSignedInteger(&cursor, end, &green) || !_readSignedInteger(&cursor, end, &blue)) {
+            OBASSERT_NOT_REACHED("Damaged color definitions in index");
+            return;
+        }
+        _colorTableRedComponent = (short int)red;
+        _colorTableGreenComponent = (short int)green;
+        _colorTableBlueComponent = (short int)blue;
+        [self _appendCurrentColorTableColor];
+    }
+}
+
+- (void)_actionReadColorTable;
+{
+    [self _discardDestinationText]; // Don't let any text from the color table slip into the output stream
+    if (_flags.plainTextOnly) {
+        [self _skipToEndOfGroup]; // Nothing will look up colors
+        return;
+    }
+    [self _resetCurrentColorTableColor];
+    [self _parseRTFGroupWithSemicolonSelector:@selector(_addColorTableEntry)];
+}
+
+- (CGColorRef)_colorAtIndex:(int)colorTableIndex;
+{
+    if (colorTableIndex < 0 || colorTableIndex >= (int)[_colorTable count])
+        return NULL; // NO_COLOR_INDEX, or bad RTF
+    id colorTableEntry = [_colorTable objectAtIndex:colorTableIndex];
+    if ([colorTableEntry isNull])
+        return NULL;
+    else
+        return (CGColorRef)colorTableEntry;
+}
+
+#pragma mark -
+#pragma mark Parse font table
+
+- (void)_setFontTableEntry:(int)fontNumber name:(NSString *)fontName encoding:(CFStringEncoding)encoding;
+{
+    OBPRECONDITION(fontNumber >= 0);
+
+    OUIRTFReaderFontTableEntry *fontEntry = [[OUIRTFReaderFontTableEntry alloc] init];
+    fontEntry.name = fontName;
+    fontEntry.encoding = encoding;
+
+    int entryCount = (int)[_fontTable count];
+    if (fontNumber < entryCount) {
+        [_fontTable replaceObjectAtIndex:fontNumber withObject:fontEntry];
+    } else {
+        while (fontNumber > entryCount) {
+            [_fontTable addObject:[NSNull null]];
+            entryCount++;
+        }
+        [_fontTable addObject:fontEntry];
+    }
+    [fontEntry release];
+    [self _discardCachedStringAttributes];
+}
+
+- (void)_addFontTableEntry;
+{
+    byteScannerSkipPeekedByte(_scanner); // Skip ';'
+
+    // Read and reset alternate destination
+    NSString *fontName = [NSString stringWithString:_currentState->alternateDestination];
+    _setAlternateDestination(_currentState, [NSMutableString string]);
+
+#ifdef DEBUG_RTF_READER
+    NSLog(@"Font table entry: %@", fontName);
+#endif
+
+    int fontNumber = _currentState->formatting.fontNumber;
+    if (fontNumber < 0)
+        return; // Protect against bad RTF
+    if (_limits != NULL && (NSUInteger)fontNumber > _limits->maximumTableIndex) {
+        [self _stopForExceededLimit:OUIRTFReaderTableIndexTooLargeError]; // Otherwise we'd pad the table out to it
+        return;
+    }
+
+    CFStringEncoding encoding = _encodingForFontCharacterSet(_currentState->fontCharacterSet);
+    if (_index != nil) {
+        OFDataBuffer *definitions = [_index _fontDefinitions];
+        NSData *nameData = [fontName dataUsingEncoding:NSUTF8StringEncoding];
+        OFDataBufferAppendCompressedLongLongInt(definitions, fontNumber);
+        OFDataBufferAppendCompressedLongLongInt(definitions, encoding);
+        OFDataBufferAppendCompressedLongLongInt(definitions, [nameData length]);
+        OFDataBufferAppendData(definitions, nameData);
+    }
+    [self _setFontTableEntry:fontNumber name:fontName encoding:encoding];
+    if (_events != NULL && _events->foundFontTableEntry)
+        [_events->delegate rtfReader:self foundFontTableEntry:fontNumber name:fontName encoding:encoding];
+}
+
+// Rebuilds the font table from what an index recorded as _addFontTableEntry saw it
+- (void)_replayFontDefinitions:(const OFByte *)definitions length:(NSUInteger)length;
+{
+    // Font numbers past the table limit (or, with no limit, past anything sane for the size of the definitions) mean a damaged index; don't pad the table out to them
+    unsigned long long maximumFontNumber = _limits != NULL ? MIN(_limits->maximumTableIndex, (NSUInteger)INT_MAX) : MAX(length, (NSUInteger)UINT16_MAX);
+    const OFByte *cursor = definitions, *end = definitions + length;
+    while (cursor < end) {
+        unsigned long long fontNumber, encoding, nameLength;
+        if (!OUIRTFDocumentIndexReadCompressedInt(&cursor, end, &fontNumber) || !OUIRTFDocumentIndexReadCompressedInt(&cursor, end, &encoding) ||
+            !OUIRTFDocumentIndexReadCompressedInt(&cursor, end, &nameLength) || nameLength > (unsigned long long)(end - cursor) || fontNumber > maximumFontNumber) {
+            OBASSERT_NOT_REACHED("Damaged font definitions in index");
+            return;
+        }
+        NSString *fontName = [[NSString alloc] initWithBytes:cursor length:(NSUInteger)nameLength encoding:NSUTF8StringEncoding];
+        cursor += nameLength;
+        if (fontName != nil)
+            [self _setFontTableEntry:(int)fontNumber name:fontName encoding:(CFStringEncoding)encoding];
+        [fontName release];
+    }
+}
+
+- (void)_actionReadFontTable;
+{
+    _setAlternateDestination(_currentState, [NSMutableString string]);
+    [self _parseRTFGroupWithSemicolonSelector:@selector(_addFontTableEntry)];
+}
+
+- (void)_actionReadFontCharacterSet:(int)characterSet;
+{
+    _currentState->fontCharacterSet = characterSet;
+}
+
+- (NSString *)_fontNameAtIndex:(int)fontTableIndex;
+{
+    static NSString *DefaultFontName = @"Helvetica";
+
+    if (fontTableIndex < 0 || fontTableIndex >= (int)[_fontTable count])
+        return DefaultFontName;
+    OUIRTFReaderFontTableEntry *fontTableEntry = [_fontTable objectAtIndex:fontTableIndex];
+    if ([fontTableEntry isNull])
+        return DefaultFontName;
+    return fontTableEntry.name;
+}
+
+- (CFStringEncoding)_fontEncodingAtIndex:(int)fontTableIndex;
+{
+    CFStringEncoding DefaultFontEncoding = kCFStringEncodingWindowsLatin1;
+    if (fontTableIndex < 0 || fontTableIndex >= (int)[_fontTable count])
+        return DefaultFontEncoding;
+    OUIRTFReaderFontTableEntry *fontTableEntry = [_fontTable objectAtIndex:fontTableIndex];
+    if ([fontTableEntry isNull])
+        return DefaultFontEncoding;
+    return fontTableEntry.encoding;
+}
+
+#pragma mark -
+#pragma mark Actions
+
+- (void)_actionBackgroundColor:(int)colorTableIndex;
+{
+#ifdef DEBUG_RTF_READER
+    CGColorRef color = [self _colorAtIndex:colorTableIndex];
+    NSLog(@"Setting background color: %@ (%@)", (id)color, [(id)color class]);
+#endif
+    SET_FORMATTING(backgroundColorIndex, colorTableIndex);
+}
+
+- (void)_actionForegroundColor:(int)colorTableIndex;
+{
+#ifdef DEBUG_RTF_READER
+    NSLog(@"Setting foreground color: %@", [OUIRTFReader debugStringForColor:[self _colorAtIndex:colorTableIndex]]);
+#endif
+    SET_FORMATTING(foregroundColorIndex, colorTableIndex);
+}
+
+- (void)_actionBold:(int)value;
+{
+    SET_FORMATTING(bold, (value != 0));
+}
+
+- (void)_actionItalic:(int)value;
+{
+    SET_FORMATTING(italic, (value != 0));
+}
+
+- (void)_actionUnderline:(int)parameter;
 {
     [self _actionUnderlineStyle: ( parameter? kCTUnderlineStyleSingle : kCTUnderlineStyleNone )];
 }
 
 - (void)_actionUnderlineStyle:(int)value;
 {
-    _currentState.underlineStyle = value;
+    SET_FORMATTING(underline, (unsigned int)value);
 }
 
 - (void)_actionFontSize:(int)value;
 {
-    _currentState.fontSize = value * 0.5f;
+    SET_FORMATTING(fontSize, value * 0.5f);
 }
 
 - (void)_actionFontNumber:(int)value;
 {
-    _currentState.fontNumber = value;
-    _currentState->_stringEncoding = [self _fontEncodingAtIndex:value];
+    SET_FORMATTING(fontNumber, value);
+    _currentState->stringEncoding = [self _fontEncodingAtIndex:value];
 #ifdef DEBUG_RTF_READER
-    CFStringRef encodingName = CFStringGetNameOfEncoding(_currentState->_stringEncoding);
-    NSLog(@"Changed font number to %d (string encoding %@=[%@])", value, (NSString *)encodingName, CFStringGetNameOfEncoding(_currentState->_stringEncoding));
+    CFStringRef encodingName = CFStringGetNameOfEncoding(_currentState->stringEncoding);
+    NSLog(@"Changed font number to %d (string encoding %@=[%@])", value, (NSString *)encodingName, CFStringGetNameOfEncoding(_currentState->stringEncoding));
 #endif
 }
 
@@ -590,11 +1871,11 @@ static NSMutableDictionary *KeywordActions;
 {
     // Rudimentary notion of superscript/subscript
     if (which == 0) {
-        _currentState.superscript = 0;
+        SET_FORMATTING(superscriptCount, 0);
     } else if (which > 0) {
-        _currentState.superscript = _currentState.superscript + 1;
+        SET_FORMATTING(superscriptCount, _currentState->formatting.superscriptCount + 1);
     } else if (which < 0) {
-        _currentState.superscript = _currentState.superscript - 1;
+        SET_FORMATTING(superscriptCount, _currentState->formatting.superscriptCount - 1);
     }
 }
 
@@ -613,239 +1894,551 @@ static NSMutableDictionary *KeywordActions;
     _colorTableBlueComponent = componentValue;
 }
 
+- (NSDictionary *)_currentStringAttributes;
+{
+    if (_currentState->cachedStringAttributes == nil) {
+        const OUIRTFReaderFormatting *formatting = &_currentState->formatting;
+
+        // Formatting we've seen before in this document gets the very same dictionary, which also lets the string builder merge runs by pointer
+        if (_attributesByFormatting == NULL)
+            _attributesByFormatting = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &FormattingKeyCallbacks, &OFNSObjectDictionaryValueCallbacks);
+        NSDictionary *internedAttributes = (NSDictionary *)CFDictionaryGetValue(_attributesByFormatting, formatting);
+        if (internedAttributes != nil) {
+            COUNT(attributeCacheHitCount);
+            _setCachedStringAttributes(_currentState, internedAttributes);
+            return internedAttributes;
+        }
+
+        COUNT(attributeCacheMissCount);
+        NSMutableDictionary *attributes = [[NSMutableDictionary alloc] init];
+        OMNI_POOL_START {
+            CGColorRef foregroundColor = [self _colorAtIndex:formatting->foregroundColorIndex];
+            CGColorRef backgroundColor = [self _colorAtIndex:formatting->backgroundColorIndex];
+            if (foregroundColor != NULL)
+                [attributes setObject:(id)foregroundColor forKey:(NSString *)kCTForegroundColorAttributeName];
+            if (backgroundColor != NULL)
+                [attributes setObject:(id)backgroundColor forKey:OABackgroundColorAttributeName];
+#ifdef DEBUG_RTF_READER
+            NSLog(@"-stringAttributes: foregroundColor=%@ backgroundColor=%@", [OUIRTFReader debugStringForColor:foregroundColor], [OUIRTFReader debugStringForColor:backgroundColor]);
+#endif
+            if ((formatting->underline & 0xFF) != 0)
+                [attributes setUnsignedIntValue:formatting->underline forKey:(NSString *)kCTUnderlineStyleAttributeName];
+#ifdef OUI_COLLECT_RTF_READER_STATS
+            uint64_t fontResolutionStartTime = _counters != NULL ? mach_absolute_time() : 0;
+#endif
+            OAFontDescriptorPlatformFont font = [[OUIRTFFontCache sharedCache] fontWithFamilyName:[self _fontNameAtIndex:formatting->fontNumber] size:formatting->fontSize bold:formatting->bold italic:formatting->italic];
+#ifdef OUI_COLLECT_RTF_READER_STATS
+            if (_counters != NULL) {
+                _counters->fontResolutionCount++;
+                _counters->fontResolutionTime += mach_absolute_time() - fontResolutionStartTime;
+            }
+#endif
+#ifdef DEBUG_RTF_READER
+            NSLog(@"-stringAttributes: font=%@", [OUIRTFReader debugStringForFont:font]);
+#endif
+            [attributes setObject:(id)font forKey:(NSString *)kCTFontAttributeName];
+
+            if (formatting->superscriptCount != 0)
+                [attributes setIntValue:formatting->superscriptCount forKey:(NSString *)kCTSuperscriptAttributeName];
+            
+            CTTextAlignment alignment = formatting->paragraph.alignment;
+            CGFloat firstLineHeadIndent = 1.0f / 20.0f * (formatting->paragraph.leftIndent + formatting->paragraph.firstLineIndent);
+            CGFloat headIndent = 1.0f / 20.0f * formatting->paragraph.leftIndent;
+            CGFloat tailIndent = 1.0f / 20.0f * (8640 - formatting->paragraph.rightIndent);
+            CTParagraphStyleSetting settings[] = {
+                {kCTParagraphStyleSpecifierAlignment, sizeof(alignment), &alignment},
+                {kCTParagraphStyleSpecifierFirstLineHeadIndent, sizeof(firstLineHeadIndent), &firstLineHeadIndent},
+                {kCTParagraphStyleSpecifierHeadIndent, sizeof(headIndent), &headIndent},
+                {kCTParagraphStyleSpecifierTailIndent, sizeof(tailIndent), &tailIndent},
+            };
+            CFIndex settingCount = sizeof(settings) / sizeof(*settings);
+            if (formatting->paragraph.rightIndent == NO_RIGHT_INDENT)
+                settingCount--;
+            CTParagraphStyleRef paragraphStyle = CTParagraphStyleCreate(settings, settingCount);
+            [attributes setObject:(id)paragraphStyle forKey:(NSString *)kCTParagraphStyleAttributeName];
+            CFRelease(paragraphStyle);
+        } OMNI_POOL_END;
+        CFDictionarySetValue(_attributesByFormatting, formatting, attributes);
+        _setCachedStringAttributes(_currentState, attributes);
+        [attributes release];
+    } else
+        COUNT(attributeCacheHitCount);
+
+    return _currentState->cachedStringAttributes;
+}
+
+// Attributes are interned by formatting, which names fonts and colors only by table index; once a table entry changes, what we built for those indices is wrong
+- (void)_discardCachedStringAttributes;
+{
+    if (_attributesByFormatting != NULL)
+        CFDictionaryRemoveAllValues(_attributesByFormatting);
+    for (NSUInteger stateIndex = 0; stateIndex <= _stateStackDepth; stateIndex++)
+        _setCachedStringAttributes(&_stateStack[stateIndex], nil);
+}
+
 - (void)_actionAppendString:(NSString *)string;
 {
     OBPRECONDITION(string != nil);
 
-    if (_currentState->_flags.discardText)
+    if (_currentState->discardText)
         return;
+    if (_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL)
+        [self _flushPendingCharacters];
 
-    NSMutableString *alternateDestination = _currentState->_alternateDestination;
+    NSMutableString *alternateDestination = _currentState->alternateDestination;
     if (alternateDestination != nil)
         [alternateDestination appendString:string];
+    else if (_events != NULL) {
+        [self _prepareToAppendEventText];
+        OUIRTFStringBuilderAppendString(&_stringBuilder, string, nil);
+    } else if (_flags.plainTextOnly || _flags.indexOnly) // An index only needs the character count
+        OUIRTFStringBuilderAppendString(&_stringBuilder, string, nil);
+    else
+        OUIRTFStringBuilderAppendString(&_stringBuilder, string, [self _currentStringAttributes]);
+}
+
+// For the characters we produce one at a time (\u escapes, control symbols, paragraph breaks): they go straight into the output buffer, extending the current attribute run, rather than each becoming an NSString of its own.
+- (void)_appendCharacter:(unichar)character;
+{
+    if (_currentState->discardText)
+        return;
+    if (_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL)
+        [self _flushPendingCharacters];
+
+    NSMutableString *alternateDestination = _currentState->alternateDestination;
+    if (alternateDestination != nil)
+        CFStringAppendCharacters((CFMutableStringRef)alternateDestination, &character, 1);
+    else if (_events != NULL) {
+        [self _prepareToAppendEventText];
+        OUIRTFStringBuilderAppendCharacter(&_stringBuilder, character, nil);
+    } else if (_flags.plainTextOnly || _flags.indexOnly)
+        OUIRTFStringBuilderAppendCharacter(&_stringBuilder, character, nil);
     else
-        [_attributedString appendString:string attributes:[_currentState stringAttributesForReader:self]];
+        OUIRTFStringBuilderAppendCharacter(&_stringBuilder, character, [self _currentStringAttributes]);
+}
+
+// A high surrogate that isn't followed by a low one, or a lead byte that isn't followed by a trail byte, is bad RTF. We don't want to pass on a broken sequence, so each becomes a replacement character.
+- (void)_flushPendingCharacters;
+{
+    OBPRECONDITION(_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL);
+
+    BOOL hadLeadByte = (_pendingLeadCodePage != NULL), hadHighSurrogate = (_pendingHighSurrogate != 0);
+    _pendingLeadCodePage = NULL;
+    _pendingHighSurrogate = 0;
+    if (hadLeadByte)
+        [self _appendCharacter:0xFFFD];
+    if (hadHighSurrogate)
+        [self _appendCharacter:0xFFFD];
 }
 
 - (void)_actionSetUnicodeSkipCount:(int)newCount;
 {
-    _currentState->_unicodeSkipCount = newCount;
+    _currentState->unicodeSkipCount = newCount;
 }
 
 - (void)_actionInsertUnicodeCharacter:(int)unicodeCharacter;
 {
 #ifdef DEBUG_RTF_READER
-    NSLog(@"Inserting unicode character %d [%@]", unicodeCharacter, [NSString stringWithCharacter:unicodeCharacter]);
+    NSLog(@"Inserting unicode character %d", unicodeCharacter);
 #endif
-    [self _actionAppendString:[NSString stringWithCharacter:unicodeCharacter]];
-    int skipCount = _currentState->_unicodeSkipCount;
+    // Parameters are signed 16-bit, so code units from U+8000 up are written as negative numbers. Characters beyond the BMP are usually written as a surrogate pair, one \u apiece, but some writers give the whole code point.
+    if (unicodeCharacter < 0)
+        unicodeCharacter += 0x10000;
+
+    if (_currentState->discardText) {
+        // Nothing to do but skip the fallback
+    } else if (unicodeCharacter >= 0xD800 && unicodeCharacter <= 0xDBFF) {
+        if (_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL)
+            [self _flushPendingCharacters];
+        _pendingHighSurrogate = (unichar)unicodeCharacter;
+    } else if (unicodeCharacter >= 0xDC00 && unicodeCharacter <= 0xDFFF) {
+        if (_pendingHighSurrogate != 0) {
+            unichar highSurrogate = _pendingHighSurrogate;
+            _pendingHighSurrogate = 0;
+            [self _appendCharacter:highSurrogate];
+            [self _appendCharacter:(unichar)unicodeCharacter];
+        } else
+            [self _appendCharacter:0xFFFD];
+    } else if (unicodeCharacter < 0 || unicodeCharacter > 0x10FFFF) {
+        [self _appendCharacter:0xFFFD];
+    } else if (unicodeCharacter > 0xFFFF) {
+        unicodeCharacter -= 0x10000;
+        [self _appendCharacter:(unichar)(0xD800 + (unicodeCharacter >> 10))];
+        [self _appendCharacter:(unichar)(0xDC00 + (unicodeCharacter & 0x3FF))];
+    } else {
+        [self _appendCharacter:(unichar)unicodeCharacter];
+    }
+
+    // Skip the fallback for readers that don't understand \u. A control word (with its parameter) or control symbol counts as one character, as does a whole UTF-8 sequence when we're reading a string, and the fallback can't run past the end of its group.
+    int skipCount = _currentState->unicodeSkipCount;
 #ifdef DEBUG_RTF_READER
     NSLog(@"Skipping %d characters", skipCount);
 #endif
-    while (skipCount-- > 0) {
-#ifdef DEBUG_RTF_READER
-        NSLog(@"... %d [%@]", scannerPeekCharacter(_scanner), [NSString stringWithCharacter:scannerPeekCharacter(_scanner)]);
-#endif
-        scannerSkipPeekedCharacter(_scanner);
+    while (skipCount-- > 0 && byteScannerHasData(_scanner)) {
+        OFByte byte = byteScannerPeekByte(_scanner);
+        if (byte == '{' || byte == '}')
+            break;
+        byteScannerSkipPeekedByte(_scanner);
+        if (byte == '\\')
+            [self _skipControlWordOrSymbol];
+        else if (byte >= 0xC0 && _textEncoding == kCFStringEncodingUTF8)
+            [self _skipUTF8ContinuationBytes];
     }
 }
 
 - (void)_actionInsertPageBreak;
 {
-    [self _actionAppendString:@"\f"];
+    [self _appendBreakCharacter:'\f'];
 }
 
 - (void)_actionNewParagraph;
 {
-    [self _actionAppendString:@"\n"];
+    [self _appendBreakCharacter:'\n'];
+    if (_flags.tracksBoundaries)
+        [self _noteBoundaryOfKind:OUIRTFDocumentIndexEntryParagraphStart];
 }
 
 - (void)_actionParagraphDefault;
 {
-    [_currentState resetParagraphAttributes];
+    SET_FORMATTING(paragraph.alignment, kCTLeftTextAlignment);
+    SET_FORMATTING(paragraph.firstLineIndent, 0);
+    SET_FORMATTING(paragraph.leftIndent, 0);
+    SET_FORMATTING(paragraph.rightIndent, NO_RIGHT_INDENT);
 }
 
 - (void)_actionParagraphAlignCenter;
 {
-    _currentState.paragraphAlignment = kCTCenterTextAlignment;
+    SET_FORMATTING(paragraph.alignment, kCTCenterTextAlignment);
 }
 
 - (void)_actionParagraphAlignJustify;
 {
-    _currentState.paragraphAlignment = kCTJustifiedTextAlignment;
+    SET_FORMATTING(paragraph.alignment, kCTJustifiedTextAlignment);
 }
 
 - (void)_actionParagraphAlignLeft;
 {
-    _currentState.paragraphAlignment = kCTLeftTextAlignment;
+    SET_FORMATTING(paragraph.alignment, kCTLeftTextAlignment);
 }
 
 - (void)_actionParagraphAlignRight;
 {
-    _currentState.paragraphAlignment = kCTRightTextAlignment;
+    SET_FORMATTING(paragraph.alignment, kCTRightTextAlignment);
 }
 
 - (void)_actionParagraphFirstLineIndent:(int)newValue;
 {
-    _currentState.paragraphFirstLineIndent = newValue;
+    SET_FORMATTING(paragraph.firstLineIndent, newValue);
 }
 
 - (void)_actionParagraphLeftIndent:(int)newValue;
 {
-    _currentState.paragraphLeftIndent = newValue;
+    SET_FORMATTING(paragraph.leftIndent, newValue);
 }
 
 - (void)_actionParagraphRightIndent:(int)newValue;
 {
-    _currentState.paragraphRightIndent = newValue;
+    SET_FORMATTING(paragraph.rightIndent, newValue);
 }
 
 #pragma mark -
 #pragma mark Parsing engine
 
-- (void)_parseKeyword;
+// Returns whether the control word was one we know, whether or not it had any effect
+- (BOOL)_parseKeyword;
 {
-    NSString *letterSequence = [_scanner readFullTokenWithDelimiterOFCharacterSet:LetterSequenceDelimiters forceLowercase:NO];
-    BOOL parameterIsNegative = NO;
-    switch (scannerPeekCharacter(_scanner)) {
+    // The keyword usually points straight into the scanner's buffer; it's only copied into ours if it spans a refill. Anything longer than ours can't be one of our keywords.
+    OFByte keywordBuffer[OUIRTFReaderMaximumKeywordLength];
+    const OFByte *keyword;
+    NSUInteger keywordLength = byteScannerReadTokenWithDelimiterOFByteSet(_scanner, LetterSequenceDelimiters, &keyword, keywordBuffer, sizeof(keywordBuffer));
+    const OUIRTFReaderKeyword *entry = NULL;
+    if (keywordLength <= sizeof(keywordBuffer))
+        entry = _lookupKeyword((const char *)keyword, keywordLength);
+
+#ifdef DEBUG_RTF_READER
+    NSLog(@"RTF control word: %.*s", (int)MIN(keywordLength, sizeof(keywordBuffer)), keyword);
+#endif
+
+    // The keyword's bytes may not survive reading the parameter, so we're done with them now
+    BOOL hasParameter = NO;
+    int numericParameter = 0;
+    switch (byteScannerPeekByte(_scanner)) {
         case ' ':
-            scannerSkipPeekedCharacter(_scanner);
-            [self _handleKeyword:letterSequence];
+            byteScannerSkipPeekedByte(_scanner);
             break;
         case '-':
-            parameterIsNegative = YES;
-            scannerSkipPeekedCharacter(_scanner);
-            // FALL THROUGH
         case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-        {
-            NSString *numericParameterString = [_scanner readFullTokenWithDelimiterOFCharacterSet:NumericParameterDelimiters];
-            if (scannerPeekCharacter(_scanner) == ' ')
-                scannerSkipPeekedCharacter(_scanner);
-            int numericParameter = [numericParameterString intValue];
-            if (parameterIsNegative)
-                numericParameter = -numericParameter;
-            [self _handleKeyword:letterSequence parameter:numericParameter];
+            // The spec says parameters are signed 16-bit, but writers emit larger ones (\bin lengths, for instance), so we clamp to what an int holds.
+            numericParameter = byteScannerScanClampedSignedInteger(_scanner, -INT_MAX, INT_MAX);
+            if (byteScannerPeekByte(_scanner) == ' ')
+                byteScannerSkipPeekedByte(_scanner);
+            hasParameter = YES;
+#ifdef DEBUG_RTF_READER
+            NSLog(@"... parameter:%d", numericParameter);
+#endif
             break;
-        }
         default:
-            [self _handleKeyword:letterSequence];
             break;
     }
+
+    if (entry == NULL) {
+        COUNT(unknownControlWordCount);
+        return NO; // Unknown control words are ignored
+    }
+    COUNT(controlWordCounts[entry - KeywordTable]);
+    if (entry->attributeOnly && _flags.plainTextOnly)
+        return YES;
+
+    int value = (hasParameter && !entry->forceValue) ? numericParameter : entry->value;
+    entry->implementation(self, entry->selector, value);
+    return YES;
 }
 
 - (void)_parseHexByte;
 {
-    UInt8 hexBytes[2];
-    CFIndex numBytes = 0;
-    hexBytes[numBytes++] = [_scanner scanHexadecimalNumberMaximumDigits:2];
+    OFByte byte = (OFByte)byteScannerScanHexadecimalNumber(_scanner, 2);
+    if (!_currentState->discardText)
+        [self _appendEncodedByte:byte];
+}
+
+// Decodes a byte in the current font's code page. In a double-byte code page, a lead byte waits for the next byte, which may come from another \'xx or be plain text (writers often leave trail bytes in the ASCII range unescaped).
+- (void)_appendEncodedByte:(OFByte)byte;
+{
+    if (_pendingLeadCodePage != NULL) {
+        if ([self _appendPendingLeadByteWithTrailByte:byte])
+            return;
+        [self _flushPendingCharacters];
+    }
 
-    // Check for double-byte characters
-    if (scannerReadString(_scanner, @"\\'"))
-        hexBytes[numBytes++] = [_scanner scanHexadecimalNumberMaximumDigits:2];
+    CFStringEncoding encoding = _currentState->stringEncoding;
+    if (_codePage == NULL || _codePage->encoding != encoding)
+        _codePage = _codePageForEncoding(encoding);
 
-    CFStringRef byteString = CFStringCreateWithBytes(NULL, hexBytes, numBytes, _currentState->_stringEncoding, NO);
-    OBASSERT(byteString != NULL); // Or something went wrong with our string encoding
-    if (byteString != NULL) {
-        [self _actionAppendString:(NSString *)byteString];
-        CFRelease(byteString);
+    if (_codePage == NULL) {
+        [self _appendCharacter:_decodeBytes(&byte, 1, encoding)]; // Not a code page we know from \fcharset
+    } else if (_codePage->leadBytes[byte]) {
+        _pendingLeadCodePage = _codePage;
+        _pendingLeadByte = byte;
+    } else {
+        [self _appendCharacter:_codePage->singleBytes[byte]];
     }
 }
 
+// Returns NO, leaving the lead byte pending, if the byte can't follow it
+- (BOOL)_appendPendingLeadByteWithTrailByte:(OFByte)trailByte;
+{
+    OBPRECONDITION(_pendingLeadCodePage != NULL);
+
+    unichar character = _pairRowForLeadByte(_pendingLeadCodePage, _pendingLeadByte)[trailByte];
+    if (character == 0xFFFD)
+        return NO;
+    _pendingLeadCodePage = NULL;
+    [self _appendCharacter:character];
+    return YES;
+}
+
 - (void)_parseControlSymbol;
 {
-    unichar controlSymbol = scannerPeekCharacter(_scanner);
-    scannerSkipPeekedCharacter(_scanner);
+    OFByte controlSymbol = byteScannerPeekByte(_scanner);
+    byteScannerSkipPeekedByte(_scanner);
+    COUNT(controlSymbolCount);
 
     switch (controlSymbol) {
         case '*':
-            [self _actionSkipDestination];
+            // An ignorable destination: readers that don't know the control word that follows are to skip the whole group
+            [self _discardDestinationText];
+            if (byteScannerPeekByte(_scanner) == '\\') {
+                byteScannerSkipPeekedByte(_scanner);
+                if (isByteInByteSet(byteScannerPeekByte(_scanner), LetterSequenceDelimiters))
+                    [self _parseControlSymbol];
+                else if (![self _parseKeyword])
+                    [self _skipToEndOfGroup];
+            }
             break;
         case '\'':
             [self _parseHexByte];
             break;
         default:
-            [self _actionAppendString:[NSString stringWithCharacter:controlSymbol]];
+            if (controlSymbol < 0x80)
+                [self _appendCharacter:controlSymbol];
+            else
+                [self _appendEscapedNonASCIICharacterStartingWithByte:controlSymbol];
             break;
     }
 }
 
+// A lead byte's continuation bytes, so that a multibyte character is skipped whole. Stops at anything that isn't one, as malformed input may.
+- (void)_skipUTF8ContinuationBytes;
+{
+    while (byteScannerHasData(_scanner) && (byteScannerPeekByte(_scanner) & 0xC0) == 0x80)
+        byteScannerSkipPeekedByte(_scanner);
+}
+
+// What follows a backslash in a \u fallback, passed over the way _parseKeyword and _parseControlSymbol would read it
+- (void)_skipControlWordOrSymbol;
+{
+    if (!byteScannerHasData(_scanner))
+        return;
+
+    OFByte controlCharacter = byteScannerPeekByte(_scanner);
+    if (isByteInByteSet(controlCharacter, LetterSequenceDelimiters)) {
+        byteScannerSkipPeekedByte(_scanner);
+        if (controlCharacter == '\'')
+            byteScannerScanHexadecimalNumber(_scanner, 2);
+        else if (controlCharacter >= 0xC0 && _textEncoding == kCFStringEncodingUTF8)
+            [self _skipUTF8ContinuationBytes];
+        return;
+    }
+
+    OFByte keywordBuffer[4];
+    const OFByte *keyword;
+    NSUInteger keywordLength = byteScannerReadTokenWithDelimiterOFByteSet(_scanner, LetterSequenceDelimiters, &keyword, keywordBuffer, sizeof(keywordBuffer));
+    BOOL isBinary = (keywordLength == 3 && memcmp(keyword, "bin", 3) == 0);
+
+    int parameter = 0;
+    OFByte parameterStart = byteScannerPeekByte(_scanner);
+    if (parameterStart == '-' || (parameterStart >= '0' && parameterStart <= '9'))
+        parameter = byteScannerScanClampedSignedInteger(_scanner, -INT_MAX, INT_MAX);
+    if (byteScannerPeekByte(_scanner) == ' ')
+        byteScannerSkipPeekedByte(_scanner);
+    if (isBinary && parameter > 0)
+        byteScannerSkipBytes(_scanner, parameter); // \binN and its data are one character too
+}
+
+// A backslash before a non-ASCII character escapes the whole character, which in a string we're reading as UTF-8 is more than the one byte
+- (void)_appendEscapedNonASCIICharacterStartingWithByte:(OFByte)leadByte;
+{
+    OFByte bytes[4];
+    NSUInteger length = 0;
+    bytes[length++] = leadByte;
+    if (leadByte >= 0xC0 && _textEncoding == kCFStringEncodingUTF8) {
+        while (length < sizeof(bytes) && byteScannerHasData(_scanner) && (byteScannerPeekByte(_scanner) & 0xC0) == 0x80) {
+            bytes[length++] = byteScannerPeekByte(_scanner);
+            byteScannerSkipPeekedByte(_scanner);
+        }
+    }
+
+    CFStringRef string = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, length, _textEncoding, false);
+    if (string == NULL) {
+        [self _appendCharacter:0xFFFD];
+        return;
+    }
+    CFIndex characterIndex, characterCount = CFStringGetLength(string);
+    for (characterIndex = 0; characterIndex < characterCount; characterIndex++)
+        [self _appendCharacter:CFStringGetCharacterAtIndex(string, characterIndex)];
+    CFRelease(string);
+}
+
 - (void)_pushRTFState;
 {
-    OBPRECONDITION(_pushedStates != nil);
-    OBPRECONDITION(_currentState != nil);
+    OBPRECONDITION(_currentState == &_stateStack[_stateStackDepth]);
 
-    OUIRTFReaderState *oldState = _currentState;
-    [_pushedStates addObject:oldState];
-    _currentState = [oldState copy];
-    [oldState release];
+    if (_limits != NULL && _stateStackDepth >= _limits->maximumGroupDepth) {
+        [self _stopForExceededLimit:OUIRTFReaderGroupsNestedTooDeeplyError];
+        return;
+    }
+    if (_stateStackDepth + 1 == _stateStackCapacity) {
+        _stateStackCapacity *= 2;
+        _stateStack = realloc(_stateStack, sizeof(*_stateStack) * _stateStackCapacity);
+    }
 
-    OBPOSTCONDITION(_currentState != nil);
+    // The new group borrows its parent's alternate destination and cached attributes until it replaces them
+    OUIRTFReaderState *parentState = &_stateStack[_stateStackDepth];
+    _currentState = parentState + 1;
+    _stateStackDepth++;
+    memcpy(_currentState, parentState, sizeof(*_currentState));
+    _currentState->ownsAlternateDestination = 0;
+    _currentState->ownsCachedStringAttributes = 0;
+
+#ifdef OUI_COLLECT_RTF_READER_STATS
+    if (_counters != NULL) {
+        _counters->groupCount++;
+        if (_stateStackDepth > _counters->maximumGroupDepth)
+            _counters->maximumGroupDepth = _stateStackDepth;
+    }
+#endif
 }
 
 - (void)_popRTFState;
 {
-    OBPRECONDITION(_pushedStates != nil);
-    OBPRECONDITION(_currentState != nil);
+    OBPRECONDITION(_currentState == &_stateStack[_stateStackDepth]);
 
-    [_currentState release];
-    
-    if ([_pushedStates count] != 0) {
-        _currentState = [[_pushedStates lastObject] retain];
-        [_pushedStates removeLastObject];
+    _releaseState(_currentState);
+
+    if (_stateStackDepth != 0) {
+        _stateStackDepth--;
+        _currentState--;
     } else {
-        _currentState = [[OUIRTFReaderState alloc] init];
+        // Unbalanced '}'; carry on from the default state
+        _initState(_currentState);
     }
-
-    OBPOSTCONDITION(_currentState != nil);
 }
 
-- (void)_parseRTFGroupWithSemicolonAction:(OUIRTFReaderAction *)semicolonAction;
+- (void)_parseRTFGroupWithSemicolonSelector:(SEL)semicolonSelector;
 {
-    OFCharacterSet *reservedSet;
-    if (semicolonAction == NULL)
+    OFByteSet *reservedSet;
+    if (semicolonSelector == NULL)
         reservedSet = StandardReservedSet;
     else
         reservedSet = SemicolonReservedSet;
 
-    NSUInteger pushedStateCount = [_pushedStates count]; // Keep track of our starting depth
-    while (scannerHasData(_scanner)) {
-        switch (scannerPeekCharacter(_scanner)) {
+    NSUInteger startingDepth = _stateStackDepth;
+    while (!_flags.reachedStopLocation && !_flags.exceededLimit && byteScannerHasData(_scanner)) {
+        if (_limits != NULL) {
+            NSUInteger outputLength = OUIRTFStringBuilderGetLength(&_stringBuilder);
+            if (_events != NULL)
+                outputLength += _events->sentLength;
+            NSInteger exceededLimit = _checkTokenLimits(_limits, outputLength, _scanner);
+            if (exceededLimit != 0) {
+                [self _stopForExceededLimit:exceededLimit];
+                return;
+            }
+        }
+
+        switch (byteScannerPeekByte(_scanner)) {
             case '\\':
-                scannerSkipPeekedCharacter(_scanner); // Skip '\'
-                unichar controlCharacter = scannerPeekCharacter(_scanner);
-                if (OFCharacterSetHasMember(LetterSequenceDelimiters, controlCharacter))
+                byteScannerSkipPeekedByte(_scanner); // Skip '\'
+                OFByte controlCharacter = byteScannerPeekByte(_scanner);
+                if (isByteInByteSet(controlCharacter, LetterSequenceDelimiters))
                     [self _parseControlSymbol];
                 else
                     [self _parseKeyword];
                 break;
             case '{':
-                scannerSkipPeekedCharacter(_scanner); // Skip '{'
+                if (_stateStackDepth == 1 && _flags.tracksBoundaries && [self _noteBoundaryOfKind:OUIRTFDocumentIndexEntryGroupStart])
+                    return; // A top-level group, and the end of our range
+                byteScannerSkipPeekedByte(_scanner); // Skip '{'
                 [self _pushRTFState];
                 break;
             case '}':
-                scannerSkipPeekedCharacter(_scanner); // Skip '}'
+                byteScannerSkipPeekedByte(_scanner); // Skip '}'
                 [self _popRTFState];
-                if ([_pushedStates count] < pushedStateCount)
+                if (_stateStackDepth < startingDepth)
                     return;
                 break;
             case '\r': case '\n':
                 // Skip noise
-                scannerSkipPeekedCharacter(_scanner);
+                byteScannerSkipPeekedByte(_scanner);
                 break;
             case ';':
-                if (semicolonAction != nil) {
-                    [semicolonAction performActionWithParser:self];
+                if (semicolonSelector != NULL) {
+                    [self performSelector:semicolonSelector];
                     break;
                 }
                 // Fall through
             default:
-                if (_currentState->_flags.discardText) {
+                if (_pendingLeadCodePage != NULL && !_currentState->discardText && [self _appendPendingLeadByteWithTrailByte:byteScannerPeekByte(_scanner)]) {
+                    byteScannerSkipPeekedByte(_scanner); // An unescaped trail byte
+                    break;
+                }
+                if (_currentState->discardText) {
                     // Skip all unreserved characters
-                    scannerScanUpToCharacterInOFCharacterSet(_scanner, reservedSet);
+                    byteScannerScanUpToByteInOFByteSet(_scanner, reservedSet);
                 } else {
-                    // Read all unreserved characters
-                    NSString *destinationText = [_scanner readTokenFragmentWithDelimiterOFCharacterSet:reservedSet];
-                    [self _actionAppendString:destinationText];
+                    // Read all unreserved characters; bytes that aren't valid in our text encoding come out as U+FFFD rather than losing the run
+                    NSString *destinationText = [_scanner readLossyTokenFragmentWithDelimiterOFByteSet:reservedSet encoding:_textEncoding];
+                    if (destinationText != nil)
+                        [self _actionAppendString:destinationText];
                 }
                 break;
         }
@@ -854,421 +2447,239 @@ static NSMutableDictionary *KeywordActions;
 
 - (void)_parseRTF;
 {
-    while (scannerHasData(_scanner))
-        [self _parseRTFGroupWithSemicolonAction:nil];
-}
-
-@end
-
-@implementation OUIRTFReaderState
-
-- (id)init;
-{
-    if (!(self = [super init]))
-        return nil;
-
-    _stringEncoding = kCFStringEncodingWindowsLatin1;
-    _unicodeSkipCount = 1;
-    _fontSize = 12.0f;
-    _underline = kCTUnderlineStyleNone;
-
-    [self resetParagraphAttributes];
-
-    return self;
-}
-
-- (id)copyWithZone:(NSZone *)zone;
-{
-    OUIRTFReaderState *copy = (OUIRTFReaderState *)OFCopyObject(self, 0, zone);
-    [copy->_alternateDestination retain];
-    [copy->_foregroundColor retain];
-    [copy->_backgroundColor retain];
-    copy->_cachedStringAttributes = nil;
-    return copy;
+    while (!_flags.reachedStopLocation && !_flags.exceededLimit && byteScannerHasData(_scanner))
+        [self _parseRTFGroupWithSemicolonSelector:NULL];
+    if (_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL)
+        [self _flushPendingCharacters];
+
+    // The output is checked before each token, so the last ones may have run past the limit
+    if (_events != NULL) {
+        [self _sendPendingText]; // Which holds to the limit itself
+    } else if (_limits != NULL && OUIRTFStringBuilderGetLength(&_stringBuilder) > _limits->maximumOutputLength) {
+        NSUInteger length = _limits->maximumOutputLength;
+        if (length != 0 && CFStringIsSurrogateHighCharacter(((const unichar *)_stringBuilder.characters.buffer)[length - 1]))
+            length--; // Don't leave half of a pair
+        OUIRTFStringBuilderTruncate(&_stringBuilder, length);
+        if (!_flags.exceededLimit)
+            [self _stopForExceededLimit:OUIRTFReaderOutputTooLongError];
+    }
 }
 
-- (void)dealloc;
+// Ends the parse early, keeping what we have so far
+- (void)_stopForExceededLimit:(NSInteger)exceededLimit;
 {
-    [_alternateDestination release];
-    [_foregroundColor release];
-    [_backgroundColor release];
-    [_cachedStringAttributes release];
-    [super dealloc];
-}
+    OBPRECONDITION(_limits != NULL);
+    OBPRECONDITION(!_flags.exceededLimit);
 
-- (void)_resetCache;
-{
-    [_cachedStringAttributes release];
-    _cachedStringAttributes = nil;
+#ifdef DEBUG_RTF_READER
+    NSLog(@"Stopping at byte %lu: exceeded limit %ld", byteScannerScanLocation(_scanner), exceededLimit);
+#endif
+    _flags.exceededLimit = 1;
+    _limits->exceededLimit = exceededLimit;
 }
 
 #pragma mark -
-#pragma mark Properties
-
-@synthesize alternateDestination = _alternateDestination;
+#pragma mark Events
 
-- (id)foregroundColor;
+// Text events carry no formatting of their own, so the delegate hears of a change before the first text it applies to. Formatting that changes and changes back with no text in between is never reported.
+- (void)_prepareToAppendEventText;
 {
-    return _foregroundColor;
-}
-
-- (void)setForegroundColor:(id)newColor;
-{
-    if (_foregroundColor == newColor)
-        return;
+    OBPRECONDITION(_events != NULL);
 
-    [_foregroundColor release];
-    _foregroundColor = [newColor retain];
-    
-    [self _resetCache];
+    if (!_flags.plainTextOnly && (!_events->hasReportedFormatting || !_formattingKeyEqual(&_events->reportedFormatting, &_currentState->formatting))) {
+        [self _sendPendingText];
+        _events->reportedFormatting = _currentState->formatting;
+        _events->hasReportedFormatting = 1;
+        if (_events->didChangeFormatting)
+            [_events->delegate rtfReader:self didChangeFormatting:&_events->reportedFormatting];
+    } else if (OUIRTFStringBuilderGetLength(&_stringBuilder) >= OUIRTFReaderEventTextBufferLength) {
+        [self _sendPendingText];
+    }
 }
 
-- (id)backgroundColor;
+- (void)_sendPendingText;
 {
-    return _backgroundColor;
-}
+    OBPRECONDITION(_events != NULL);
 
-- (void)setBackgroundColor:(id)newColor;
-{
-    if (_backgroundColor == newColor)
+    NSUInteger length = OUIRTFStringBuilderGetLength(&_stringBuilder);
+    if (length == 0)
         return;
-    
-    [_backgroundColor release];
-    _backgroundColor = [newColor retain];
-    
-    [self _resetCache];
-}
-
-- (CGFloat)fontSize;
-{
-    return _fontSize;
-}
-
-- (void)setFontSize:(CGFloat)newSize;
-{
-    _fontSize = newSize;
-
-    [self _resetCache];
-}
-
-- (int)fontNumber;
-{
-    return _fontNumber;
-}
-
-- (void)setFontNumber:(int)newNumber;
-{
-    _fontNumber = newNumber;
-
-    [self _resetCache];
-}
-
-- (BOOL)bold;
-{
-    return _flags.bold != 0;
-}
-
-- (void)setBold:(BOOL)newSetting;
-{
-    _flags.bold = newSetting;
-
-    [self _resetCache];
-}
-
-- (BOOL)italic;
-{
-    return _flags.italic != 0;
-}
-
-- (void)setItalic:(BOOL)newSetting;
-{
-    _flags.italic = newSetting;
-
-    [self _resetCache];
-}
-
-- (void)setUnderlineStyle:(unsigned)ul
-{
-    _underline = ul;
-    
-    [self _resetCache];
-}
-
-@synthesize underlineStyle = _underline;
-
-- (void)setSuperscript:(int)s
-{
-    _superscriptCount = s;
-    [self _resetCache];
-}
-
-@synthesize superscript = _superscriptCount;
-
-@synthesize fontCharacterSet = _fontCharacterSet;
-
-- (CTTextAlignment)paragraphAlignment;
-{
-    return _paragraph.alignment;
-}
-
-- (void)setParagraphAlignment:(CTTextAlignment)newAlignment;
-{
-    _paragraph.alignment = newAlignment;
-
-    [self _resetCache];
-}
 
-- (int)paragraphFirstLineIndent;
-{
-    return _paragraph.firstLineIndent;
-}
-
-- (void)setParagraphFirstLineIndent:(int)newValue;
-{
-    _paragraph.firstLineIndent = newValue;
-
-    [self _resetCache];
-}
+    const unichar *characters = (const unichar *)_stringBuilder.characters.buffer;
+    if (_limits != NULL && length > _limits->maximumOutputLength - _events->sentLength) {
+        length = _limits->maximumOutputLength - _events->sentLength;
+        if (length != 0 && CFStringIsSurrogateHighCharacter(characters[length - 1]))
+            length--; // Don't leave half of a pair
+        if (!_flags.exceededLimit)
+            [self _stopForExceededLimit:OUIRTFReaderOutputTooLongError];
+    }
+    if (length != 0)
+        [_events->delegate rtfReader:self foundCharacters:characters length:length];
+    _events->sentLength += length;
+    if (_flags.exceededLimit && _limits->exceededLimit == OUIRTFReaderOutputTooLongError)
+        _events->sentLength = _limits->maximumOutputLength; // Nothing more goes out, not even the other half of a pair we held back
+    OUIRTFStringBuilderTruncate(&_stringBuilder, 0);
+}
+
+// Paragraph and page breaks go to the delegate as events of their own if it wants them; otherwise they're characters like any other
+- (void)_appendBreakCharacter:(unichar)character;
+{
+    BOOL sendsEvent = NO;
+    if (_events != NULL)
+        sendsEvent = (character == '\n') ? _events->foundParagraphBreak : _events->foundPageBreak;
+    if (!sendsEvent || _currentState->discardText || _currentState->alternateDestination != nil) {
+        [self _appendCharacter:character];
+        return;
+    }
 
-- (int)paragraphLeftIndent;
-{
-    return _paragraph.leftIndent;
+    if (_pendingHighSurrogate != 0 || _pendingLeadCodePage != NULL)
+        [self _flushPendingCharacters];
+    [self _sendPendingText];
+    if (character == '\n')
+        [_events->delegate rtfReaderFoundParagraphBreak:self];
+    else
+        [_events->delegate rtfReaderFoundPageBreak:self];
 }
 
-- (void)setParagraphLeftIndent:(int)newValue;
-{
-    _paragraph.leftIndent = newValue;
-
-    [self _resetCache];
-}
+#pragma mark -
+#pragma mark Indexing
 
-- (int)paragraphRightIndent;
+- (void)_startIndexing:(OUIRTFDocumentIndex *)index indexOnly:(BOOL)indexOnly;
 {
-    return _paragraph.rightIndent;
+    OBPRECONDITION(_index == nil);
+    _index = [index retain];
+    _flags.tracksBoundaries = 1;
+    _flags.indexOnly = indexOnly;
 }
 
-- (void)setParagraphRightIndent:(int)newValue;
+- (void)_finishIndexing;
 {
-    _paragraph.rightIndent = newValue;
-
-    [self _resetCache];
+    [_index _setCharacterCount:OUIRTFStringBuilderGetLength(&_stringBuilder)];
 }
 
-#pragma mark -
-#pragma mark API
-
-- (NSMutableDictionary *)stringAttributesForReader:(OUIRTFReader *)reader;
+// Called at each place an index entry can go: the '{' of a top-level group, and just past a \par. Returns YES if a range parse should stop here.
+- (BOOL)_noteBoundaryOfKind:(OUIRTFDocumentIndexEntryKind)kind;
 {
-    if (_cachedStringAttributes == nil) {
-        OMNI_POOL_START {
-            _cachedStringAttributes = [[NSMutableDictionary alloc] init];
-            if (_foregroundColor != NULL)
-                [_cachedStringAttributes setObject:_foregroundColor forKey:(NSString *)kCTForegroundColorAttributeName];
-            if (_backgroundColor != NULL)
-                [_cachedStringAttributes setObject:_backgroundColor forKey:OABackgroundColorAttributeName];
-#ifdef DEBUG_RTF_READER
-            NSLog(@"-stringAttributes: foregroundColor=%@ backgroundColor=%@", [OUIRTFReader debugStringForColor:_foregroundColor], [OUIRTFReader debugStringForColor:_backgroundColor]);
-#endif
-            if ((_underline & 0xFF) != 0)
-                [_cachedStringAttributes setUnsignedIntValue:_underline forKey:(NSString *)kCTUnderlineStyleAttributeName];
-            NSMutableDictionary *fontAttributes = [[NSMutableDictionary alloc] init];
-            [fontAttributes setObject:[reader _fontNameAtIndex:_fontNumber] forKey:(id)kCTFontNameAttribute];
-            if (_fontSize > 0.0)
-                [fontAttributes setObject:[NSNumber numberWithCGFloat:_fontSize] forKey:(id)kCTFontSizeAttribute];
-            OAFontDescriptor *fontDescriptor = [[[OAFontDescriptor alloc] initWithFontAttributes:fontAttributes] autorelease];
-            [fontAttributes release];
-            if (_flags.bold)
-                fontDescriptor = [[fontDescriptor newFontDescriptorWithBold:_flags.bold] autorelease];
-            if (_flags.italic)
-                fontDescriptor = [[fontDescriptor newFontDescriptorWithItalic:_flags.italic] autorelease];
-            OAFontDescriptorPlatformFont font = [fontDescriptor font];
-#ifdef DEBUG_RTF_READER
-            NSLog(@"-stringAttributes: font=%@", [OUIRTFReader debugStringForFont:font]);
-#endif
-#ifdef OMNI_ASSERTIONS_ON
-            OBASSERT([fontDescriptor bold] == _flags.bold);
-            OBASSERT([fontDescriptor italic] == _flags.italic);
-            OAFontDescriptor *newFontDescriptor = [[OAFontDescriptor alloc] initWithFont:font];
-            OBASSERT([newFontDescriptor bold] == _flags.bold);
-            OBASSERT([newFontDescriptor italic] == _flags.italic);
-            [newFontDescriptor release];
-#endif
-            [_cachedStringAttributes setObject:(id)font forKey:(NSString *)kCTFontAttributeName];
-
-            if (_superscriptCount != 0)
-                [_cachedStringAttributes setIntValue:_superscriptCount forKey:(NSString *)kCTSuperscriptAttributeName];
-            
-            CTTextAlignment alignment = _paragraph.alignment;
-            CGFloat firstLineHeadIndent = 1.0f / 20.0f * (_paragraph.leftIndent + _paragraph.firstLineIndent);
-            CGFloat headIndent = 1.0f / 20.0f * _paragraph.leftIndent;
-            CGFloat tailIndent = 1.0f / 20.0f * (8640 - _paragraph.rightIndent);
-            CTParagraphStyleSetting settings[] = {
-                {kCTParagraphStyleSpecifierAlignment, sizeof(alignment), &alignment},
-                {kCTParagraphStyleSpecifierFirstLineHeadIndent, sizeof(firstLineHeadIndent), &firstLineHeadIndent},
-                {kCTParagraphStyleSpecifierHeadIndent, sizeof(headIndent), &headIndent},
-                {kCTParagraphStyleSpecifierTailIndent, sizeof(tailIndent), &tailIndent},
-            };
-            CFIndex settingCount = sizeof(settings) / sizeof(*settings);
-            if (_paragraph.rightIndent == NO_RIGHT_INDENT)
-                settingCount--;
-            CTParagraphStyleRef paragraphStyle = CTParagraphStyleCreate(settings, settingCount);
-            [_cachedStringAttributes setObject:(id)paragraphStyle forKey:(NSString *)kCTParagraphStyleAttributeName];
-            CFRelease(paragraphStyle);
-        } OMNI_POOL_END;
+    NSUInteger location = byteScannerScanLocation(_scanner);
+    if (location >= _stopLocation) {
+        _flags.reachedStopLocation = 1;
+        return YES;
     }
 
-    return _cachedStringAttributes;
-}
-
-- (CFStringEncoding)fontEncoding;
-{
-    #define WIN32_ANSI_CHARSET          0   /* CP1252, ansi-0, iso8859-{1,15} */
-    #define WIN32_DEFAULT_CHARSET       1
-    #define WIN32_SYMBOL_CHARSET        2
-    #define WIN32_SHIFTJIS_CHARSET      128 /* CP932 */
-    #define WIN32_HANGEUL_CHARSET       129 /* CP949, ksc5601.1987-0 */
-    #define WIN32_HANGUL_CHARSET        HANGEUL_CHARSET
-    #define WIN32_GB2312_CHARSET        134 /* CP936, gb2312.1980-0 */
-    #define WIN32_CHINESEBIG5_CHARSET   136 /* CP950, big5.et-0 */
-    #define WIN32_GREEK_CHARSET         161 /* CP1253 */
-    #define WIN32_TURKISH_CHARSET       162 /* CP1254, -iso8859-9 */
-    #define WIN32_HEBREW_CHARSET        177 /* CP1255, -iso8859-8 */
-    #define WIN32_ARABIC_CHARSET        178 /* CP1256, -iso8859-6 */
-    #define WIN32_BALTIC_CHARSET        186 /* CP1257, -iso8859-13 */
-    #define WIN32_VIETNAMESE_CHARSET    163 /* CP1258 */
-    #define WIN32_RUSSIAN_CHARSET       204 /* CP1251, -iso8859-5 */
-    #define WIN32_EE_CHARSET            238 /* CP1250, -iso8859-2 */
-    #define WIN32_EASTEUROPE_CHARSET    EE_CHARSET
-    #define WIN32_THAI_CHARSET          222 /* CP874, iso8859-11, tis620 */
-    #define WIN32_JOHAB_CHARSET         130 /* korean (johab) CP1361 */
-    #define WIN32_MAC_CHARSET           77
-    #define WIN32_OEM_CHARSET           255
-
-    switch (_fontCharacterSet) {
-        default: case WIN32_ANSI_CHARSET: return kCFStringEncodingWindowsLatin1;
-        case WIN32_SYMBOL_CHARSET: return kCFStringEncodingMacSymbol;
-        case WIN32_SHIFTJIS_CHARSET: return kCFStringEncodingShiftJIS;
-        case WIN32_HANGEUL_CHARSET: return kCFStringEncodingDOSKorean;
-        case WIN32_GB2312_CHARSET: return kCFStringEncodingDOSChineseSimplif;
-        case WIN32_CHINESEBIG5_CHARSET: return kCFStringEncodingDOSChineseTrad;
-        case WIN32_GREEK_CHARSET: return kCFStringEncodingWindowsGreek;
-        case WIN32_TURKISH_CHARSET: return kCFStringEncodingWindowsLatin5;
-        case WIN32_HEBREW_CHARSET: return kCFStringEncodingWindowsHebrew;
-        case WIN32_ARABIC_CHARSET: return kCFStringEncodingWindowsArabic;
-        case WIN32_BALTIC_CHARSET: return kCFStringEncodingWindowsBalticRim;
-        case WIN32_VIETNAMESE_CHARSET: return kCFStringEncodingWindowsVietnamese;
-        case WIN32_RUSSIAN_CHARSET: return kCFStringEncodingWindowsCyrillic;
-        case WIN32_EE_CHARSET: return kCFStringEncodingWindowsLatin2;
-        case WIN32_THAI_CHARSET: return kCFStringEncodingDOSThai;
-        case WIN32_JOHAB_CHARSET: return kCFStringEncodingWindowsKoreanJohab;
-        case WIN32_MAC_CHARSET: return kCFStringEncodingMacRoman;
+    if (_index == nil)
+        return NO;
+    if (kind == OUIRTFDocumentIndexEntryParagraphStart && (_currentState->discardText || _currentState->alternateDestination != nil))
+        return NO; // Not a paragraph of body text
+
+    if (_reindexing != NULL && location == _reindexing->startLocation)
+        return NO; // The group we restarted at; the previous index's entry for it stands
+
+    OFDataBuffer *snapshots = [_index _snapshots];
+    NSUInteger snapshotStart = OFDataBufferSpaceOccupied(snapshots);
+    _appendStateSnapshot(snapshots, _stateStack, _stateStackDepth + 1);
+    if (_reindexing != NULL && location >= _reindexing->editEnd && [self _hasCaughtUpWithPreviousIndexAtLocation:location kind:kind snapshotStart:snapshotStart]) {
+        snapshots->writeStart = snapshots->buffer + snapshotStart; // The previous index's entry for this spot stands too
+        _flags.reachedStopLocation = 1;
+        return YES;
     }
-}
-
-- (void)resetParagraphAttributes;
-{
-    _paragraph.alignment = kCTLeftTextAlignment;
-    _paragraph.firstLineIndent = 0;
-    _paragraph.leftIndent = 0;
-    _paragraph.rightIndent = NO_RIGHT_INDENT;
-
-    [self _resetCache];
-}
-
-@end
-
-@implementation OUIRTFReaderAction
 
-- (void)performActionWithParser:(OUIRTFReader *)parser;
-{
-    OBRequestConcreteImplementation(self, _cmd);
+    [_index _addEntryOfKind:kind byteOffset:location characterOffset:OUIRTFStringBuilderGetLength(&_stringBuilder)];
+    return NO;
 }
 
-- (void)performActionWithParser:(OUIRTFReader *)parser parameter:(int)parameter;
+// Past the edit, everything the previous parse produced from an entry on is still good if we arrive at the same spot with the same state stack and the same tables
+- (BOOL)_hasCaughtUpWithPreviousIndexAtLocation:(NSUInteger)location kind:(OUIRTFDocumentIndexEntryKind)kind snapshotStart:(NSUInteger)snapshotStart;
 {
-    OBRequestConcreteImplementation(self, _cmd);
-}
-
-@end
+    OUIRTFDocumentIndex *previousIndex = _reindexing->previousIndex;
+    NSUInteger previousLocation = (NSUInteger)((NSInteger)location - _reindexing->byteDelta);
 
-@implementation OUIRTFReaderSelectorAction
+    // A paragraph and a top-level group can start at the same spot
+    NSUInteger entryIndex = [previousIndex indexOfEntryForByteOffset:previousLocation];
+    while (entryIndex != NSNotFound && [previousIndex byteOffsetOfEntryAtIndex:entryIndex] == previousLocation && [previousIndex kindOfEntryAtIndex:entryIndex] != kind)
+        entryIndex = entryIndex == 0 ? NSNotFound : entryIndex - 1;
+    if (entryIndex == NSNotFound || [previousIndex byteOffsetOfEntryAtIndex:entryIndex] != previousLocation)
+        return NO;
 
-- (id)initWithSelector:(SEL)selector defaultValue:(int)defaultValue;
-{
-    if (!(self = [super init]))
-        return nil;
+    const OFByte *previousSnapshot, *previousFontDefinitions, *previousColorDefinitions;
+    NSUInteger previousSnapshotLength, previousFontDefinitionsLength, previousColorDefinitionsLength;
+    [previousIndex _getSnapshot:&previousSnapshot length:&previousSnapshotLength fontDefinitions:&previousFontDefinitions length:&previousFontDefinitionsLength colorDefinitions:&previousColorDefinitions length:&previousColorDefinitionsLength forEntryAtIndex:entryIndex];
 
-    _selector = selector;
-    _defaultValue = defaultValue;
-    Method method = class_getInstanceMethod([OUIRTFReader class], selector);
-    if (!method)
-        [NSException raise:NSInvalidArgumentException format:@"OUIRTFReader does not respond to the selector %@", NSStringFromSelector(selector)];
-    _implementation = method_getImplementation(method);
-    _forceValue = NO;
+    OFDataBuffer *snapshots = [_index _snapshots];
+    if (OFDataBufferSpaceOccupied(snapshots) - snapshotStart != previousSnapshotLength || memcmp(snapshots->buffer + snapshotStart, previousSnapshot, previousSnapshotLength) != 0)
+        return NO;
 
-    return self;
-}
+    OFDataBuffer *fontDefinitions = [_index _fontDefinitions];
+    if (OFDataBufferSpaceOccupied(fontDefinitions) != previousFontDefinitionsLength || (previousFontDefinitionsLength > 0 && memcmp(fontDefinitions->buffer, previousFontDefinitions, previousFontDefinitionsLength) != 0))
+        return NO;
+    OFDataBuffer *colorDefinitions = [_index _colorDefinitions];
+    if (OFDataBufferSpaceOccupied(colorDefinitions) != previousColorDefinitionsLength || (previousColorDefinitionsLength > 0 && memcmp(colorDefinitions->buffer, previousColorDefinitions, previousColorDefinitionsLength) != 0))
+        return NO;
 
-- (id)initWithSelector:(SEL)selector;
-{
-    return [self initWithSelector:selector defaultValue:1];
+    _reindexing->caughtUpEntryIndex = entryIndex;
+    return YES;
 }
 
-- (id)initWithSelector:(SEL)selector value:(int)value;
+- (void)_prepareToParseFromEntryAtIndex:(NSUInteger)startEntryIndex toEntryAtIndex:(NSUInteger)stopEntryIndex ofIndex:(OUIRTFDocumentIndex *)index;
 {
-    self = [self initWithSelector:selector defaultValue:value];
-    _forceValue = YES;
-    return self;
-}
+    OBPRECONDITION(startEntryIndex < stopEntryIndex);
+    OBPRECONDITION(stopEntryIndex <= index.entryCount);
+    OBPRECONDITION(_stateStackDepth == 0);
 
-- (void)performActionWithParser:(OUIRTFReader *)parser;
-{
-    _implementation(parser, _selector, _defaultValue);
-}
+    const OFByte *snapshot, *fontDefinitions, *colorDefinitions;
+    NSUInteger snapshotLength, fontDefinitionsLength, colorDefinitionsLength;
+    [index _getSnapshot:&snapshot length:&snapshotLength fontDefinitions:&fontDefinitions length:&fontDefinitionsLength colorDefinitions:&colorDefinitions length:&colorDefinitionsLength forEntryAtIndex:startEntryIndex];
 
-- (void)performActionWithParser:(OUIRTFReader *)parser parameter:(int)parameter;
-{
-    if (_forceValue) {
-        _implementation(parser, _selector, _defaultValue);
-        return;
+    [self _replayFontDefinitions:fontDefinitions length:fontDefinitionsLength];
+    if (!_flags.plainTextOnly)
+        [self _replayColorDefinitions:colorDefinitions length:colorDefinitionsLength];
+    if (![self _restoreStateStackFromSnapshot:snapshot length:snapshotLength]) {
+        OBASSERT_NOT_REACHED("Damaged state snapshot in index");
+        _initState(_currentState); // Carry on from the default state
     }
 
-    _implementation(parser, _selector, parameter);
-}
-
-@end
-
-@implementation OUIRTFReaderAppendStringAction
-
-+ (OUIRTFReaderAction *)appendStringActionWithString:(NSString *)string;
-{
-    return [[[self alloc] initWithString:string] autorelease];
+    [_scanner setScanLocation:[index byteOffsetOfEntryAtIndex:startEntryIndex]];
+    if (stopEntryIndex < index.entryCount)
+        _stopLocation = [index byteOffsetOfEntryAtIndex:stopEntryIndex];
+    _flags.tracksBoundaries = 1;
 }
 
-- (id)initWithString:(NSString *)string;
+- (BOOL)_restoreStateStackFromSnapshot:(const OFByte *)snapshot length:(NSUInteger)length;
 {
-    if (!(self = [super init]))
-        return nil;
-
-    _string = [string retain];
-
-    return self;
-}
+    OBPRECONDITION(_stateStackDepth == 0);
 
-- (void)dealloc;
-{
-    [_string release];
-    [super dealloc];
-}
+    const OFByte *cursor = snapshot, *end = snapshot + length;
+    unsigned long long stateCount;
+    if (!OUIRTFDocumentIndexReadCompressedInt(&cursor, end, &stateCount) || stateCount == 0 || stateCount > length) // Each state takes at least a byte
+        return NO;
 
-- (void)performActionWithParser:(OUIRTFReader *)parser;
-{
-    [parser _actionAppendString:_string];
-}
+    while (_stateStackCapacity <= stateCount) {
+        _stateStackCapacity *= 2;
+        _stateStack = realloc(_stateStack, sizeof(*_stateStack) * _stateStackCapacity);
+    }
+    _currentState = _stateStack; // The stack may have moved; callers fall back to the bottom state if we give up below
+
+    OUIRTFReaderState defaultState;
+    _initState(&defaultState);
+    int64_t fields[SnapshotFieldCount];
+    _getSnapshotFields(&defaultState, fields);
+
+    // Restored states hold no objects, so there's nothing to release if we give up partway
+    for (NSUInteger stateIndex = 0; stateIndex < stateCount; stateIndex++) {
+        unsigned long long changedFields;
+        if (!OUIRTFDocumentIndexReadCompressedInt(&cursor, end, &changedFields))
+            return NO;
+        for (unsigned int fieldIndex = 0; fieldIndex < SnapshotFieldCount; fieldIndex++) {
+            if ((changedFields & (1ULL << fieldIndex)) && !_readSignedInteger(&cursor, end, &fields[fieldIndex]))
+                return NO;
+        }
+        OUIRTFReaderState *state = &_stateStack[stateIndex];
+        _initState(state);
+        _setSnapshotFields(state, fields);
+    }
 
-- (void)performActionWithParser:(OUIRTFReader *)parser parameter:(int)parameter;
-{
-    [self performActionWithParser:parser];
+    _stateStackDepth = (NSUInteger)stateCount - 1;
+    _currentState = &_stateStack[_stateStackDepth];
+    return YES;
 }
 
 @end
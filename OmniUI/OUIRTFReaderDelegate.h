@@ -0,0 +1,59 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <Foundation/NSObject.h>
+#import <CoreFoundation/CFString.h>
+
+#if defined(TARGET_OS_IPHONE) && TARGET_OS_IPHONE
+#import <CoreText/CTParagraphStyle.h>
+#else
+#import <ApplicationServices/ApplicationServices.h> // CoreText lives in this umbrella on the Mac
+#endif
+
+@class NSString;
+@class OUIRTFReader;
+
+#define OUIRTFReaderNoColorIndex (-1)
+#define OUIRTFReaderNoRightIndent (-999999)
+
+// The formatting that goes into a text run's attributes. There are no object pointers in here (colors are looked up in the color table by index when the attributes are built), so a group's formatting is pushed with a plain struct copy. Indents are in twips, as RTF gives them.
+typedef struct {
+    CGFloat fontSize; // In points
+    int fontNumber; // In the font table
+    int foregroundColorIndex; // In the color table, or OUIRTFReaderNoColorIndex
+    int backgroundColorIndex;
+    unsigned int underline; // A CTUnderlineStyle
+    int superscriptCount; // Negative for subscripts
+    struct {
+        CTTextAlignment alignment;
+        int firstLineIndent; // From the left indent
+        int leftIndent;
+        int rightIndent; // OUIRTFReaderNoRightIndent for none
+    } paragraph;
+    unsigned int bold:1;
+    unsigned int italic:1;
+} OUIRTFReaderFormatting;
+
+/*
+ Events from +[OUIRTFReader parseRTFData:delegate:options:error:] and friends, in document order, for callers that want to convert or index RTF without building an attributed string. Text comes in runs that all have the formatting most recently reported; each run's characters are only good for the length of the call. The tables are reported as they're read, which in any sensible document is before the text that uses them.
+ Unless the delegate implements the break methods, paragraph and page breaks come as '\n' and '\f' in the text. With plainTextOnly set in the options there are no formatting or color table events.
+*/
+
+@protocol OUIRTFReaderDelegate <NSObject>
+
+- (void)rtfReader:(OUIRTFReader *)reader foundCharacters:(const unichar *)characters length:(NSUInteger)length;
+
+@optional
+- (void)rtfReader:(OUIRTFReader *)reader didChangeFormatting:(const OUIRTFReaderFormatting *)formatting;
+- (void)rtfReaderFoundParagraphBreak:(OUIRTFReader *)reader;
+- (void)rtfReaderFoundPageBreak:(OUIRTFReader *)reader;
+- (void)rtfReader:(OUIRTFReader *)reader foundFontTableEntry:(int)fontNumber name:(NSString *)fontName encoding:(CFStringEncoding)encoding;
+- (void)rtfReader:(OUIRTFReader *)reader foundColorTableEntry:(NSUInteger)colorIndex red:(int)red green:(int)green blue:(int)blue; // Components are 0-255; if any is negative, the entry is the default (\auto) color
+
+@end
@@ -0,0 +1,36 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+
+// Settings for OUIRTFReader's batch parsing and for parsing untrusted input. The defaults match what +parseRTFString: does for a single document, with no limits.
+
+@interface OUIRTFReaderOptions : OFObject <NSCopying>
+{
+@private
+    BOOL _plainTextOnly;
+    NSUInteger _maximumConcurrentParses;
+    NSUInteger _maximumGroupDepth;
+    NSUInteger _maximumTableIndex;
+    NSUInteger _maximumOutputLength;
+    NSUInteger _maximumTokenCount;
+    NSTimeInterval _timeLimit;
+}
+
+@property (nonatomic) BOOL plainTextOnly; // Produce NSStrings, as +plainTextFromRTFString: does, rather than NSAttributedStrings
+@property (nonatomic) NSUInteger maximumConcurrentParses; // Zero (the default) means one per active processor
+
+// Limits on what one document may cost. Zero (the default) means no limit. A parse that reaches one stops there; see +[OUIRTFReader parseRTFData:options:statistics:error:].
+@property (nonatomic) NSUInteger maximumGroupDepth; // Groups open at once
+@property (nonatomic) NSUInteger maximumTableIndex; // Highest font number or color table index that may be defined
+@property (nonatomic) NSUInteger maximumOutputLength; // In UTF-16 code units; longer text is cut off here
+@property (nonatomic) NSUInteger maximumTokenCount; // Control words, control symbols, braces and runs of text, together
+@property (nonatomic) NSTimeInterval timeLimit; // Wall clock time, in seconds
+
+@end
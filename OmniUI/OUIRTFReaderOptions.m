@@ -0,0 +1,40 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFReaderOptions.h>
+
+#import <OmniBase/OmniBase.h>
+
+RCS_ID("$Id$");
+
+@implementation OUIRTFReaderOptions
+
+@synthesize plainTextOnly = _plainTextOnly;
+@synthesize maximumConcurrentParses = _maximumConcurrentParses;
+@synthesize maximumGroupDepth = _maximumGroupDepth;
+@synthesize maximumTableIndex = _maximumTableIndex;
+@synthesize maximumOutputLength = _maximumOutputLength;
+@synthesize maximumTokenCount = _maximumTokenCount;
+@synthesize timeLimit = _timeLimit;
+
+#pragma mark -
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone *)zone;
+{
+    OUIRTFReaderOptions *copy = [[[self class] allocWithZone:zone] init];
+    copy->_plainTextOnly = _plainTextOnly;
+    copy->_maximumConcurrentParses = _maximumConcurrentParses;
+    copy->_maximumGroupDepth = _maximumGroupDepth;
+    copy->_maximumTableIndex = _maximumTableIndex;
+    copy->_maximumOutputLength = _maximumOutputLength;
+    copy->_maximumTokenCount = _maximumTokenCount;
+    copy->_timeLimit = _timeLimit;
+    return copy;
+}
+
+@end
@@ -0,0 +1,55 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+
+@class NSDictionary;
+
+/*
+ What one parse did and where its time went, for finding out why one document takes so much longer than another. The reader only collects these when OmniUI is built with OUI_COLLECT_RTF_READER_STATS defined (see +[OUIRTFReader parseRTFData:options:statistics:error:]), and fills them in once the parse is done. The -description lists them all, for logging.
+*/
+
+@interface OUIRTFReaderStatistics : OFObject
+{
+@private
+    NSUInteger _bytesScanned;
+    NSDictionary *_controlWordCounts;
+    NSUInteger _unknownControlWordCount;
+    NSUInteger _controlSymbolCount;
+    NSUInteger _groupCount;
+    NSUInteger _maximumGroupDepth;
+    NSUInteger _attributeCacheHitCount;
+    NSUInteger _attributeCacheMissCount;
+    NSUInteger _fontResolutionCount;
+    NSUInteger _outputLength;
+    NSUInteger _runCount;
+    NSTimeInterval _parseTime;
+    NSTimeInterval _fontResolutionTime;
+    NSTimeInterval _buildTime;
+}
+
+@property (nonatomic) NSUInteger bytesScanned;
+@property (nonatomic, copy) NSDictionary *controlWordCounts; // NSNumbers keyed by control word, for the ones the reader knows
+@property (nonatomic) NSUInteger unknownControlWordCount;
+@property (nonatomic) NSUInteger controlSymbolCount; // Including \'xx escapes
+@property (nonatomic) NSUInteger groupCount; // Groups opened
+@property (nonatomic) NSUInteger maximumGroupDepth;
+@property (nonatomic) NSUInteger attributeCacheHitCount; // Text appends that reused an attribute dictionary, either the current group's or one built earlier for the same formatting
+@property (nonatomic) NSUInteger attributeCacheMissCount; // Attribute dictionaries built
+@property (nonatomic) NSUInteger fontResolutionCount; // Fonts looked up for new attribute dictionaries
+@property (nonatomic) NSUInteger outputLength; // In UTF-16 code units
+@property (nonatomic) NSUInteger runCount; // Attribute runs; zero for plain text
+
+// Wall clock times, in seconds. The font resolution time is part of the parse time.
+@property (nonatomic) NSTimeInterval parseTime;
+@property (nonatomic) NSTimeInterval fontResolutionTime;
+@property (nonatomic) NSTimeInterval buildTime; // Making the result string from what the parse produced
+@property (nonatomic, readonly) NSTimeInterval totalTime;
+
+@end
@@ -0,0 +1,67 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFReaderStatistics.h>
+
+#import <OmniBase/OmniBase.h>
+#import <OmniFoundation/NSMutableDictionary-OFExtensions.h>
+
+RCS_ID("$Id$");
+
+@implementation OUIRTFReaderStatistics
+
+@synthesize bytesScanned = _bytesScanned;
+@synthesize controlWordCounts = _controlWordCounts;
+@synthesize unknownControlWordCount = _unknownControlWordCount;
+@synthesize controlSymbolCount = _controlSymbolCount;
+@synthesize groupCount = _groupCount;
+@synthesize maximumGroupDepth = _maximumGroupDepth;
+@synthesize attributeCacheHitCount = _attributeCacheHitCount;
+@synthesize attributeCacheMissCount = _attributeCacheMissCount;
+@synthesize fontResolutionCount = _fontResolutionCount;
+@synthesize outputLength = _outputLength;
+@synthesize runCount = _runCount;
+@synthesize parseTime = _parseTime;
+@synthesize fontResolutionTime = _fontResolutionTime;
+@synthesize buildTime = _buildTime;
+
+- (void)dealloc;
+{
+    [_controlWordCounts release];
+    [super dealloc];
+}
+
+- (NSTimeInterval)totalTime;
+{
+    return _parseTime + _buildTime;
+}
+
+#pragma mark -
+#pragma mark Debugging
+
+- (NSMutableDictionary *)debugDictionary;
+{
+    NSMutableDictionary *debugDictionary = [super debugDictionary];
+    [debugDictionary setUnsignedIntegerValue:_bytesScanned forKey:@"bytesScanned"];
+    if (_controlWordCounts != nil)
+        [debugDictionary setObject:_controlWordCounts forKey:@"controlWordCounts"];
+    [debugDictionary setUnsignedIntegerValue:_unknownControlWordCount forKey:@"unknownControlWordCount"];
+    [debugDictionary setUnsignedIntegerValue:_controlSymbolCount forKey:@"controlSymbolCount"];
+    [debugDictionary setUnsignedIntegerValue:_groupCount forKey:@"groupCount"];
+    [debugDictionary setUnsignedIntegerValue:_maximumGroupDepth forKey:@"maximumGroupDepth"];
+    [debugDictionary setUnsignedIntegerValue:_attributeCacheHitCount forKey:@"attributeCacheHitCount"];
+    [debugDictionary setUnsignedIntegerValue:_attributeCacheMissCount forKey:@"attributeCacheMissCount"];
+    [debugDictionary setUnsignedIntegerValue:_fontResolutionCount forKey:@"fontResolutionCount"];
+    [debugDictionary setUnsignedIntegerValue:_outputLength forKey:@"outputLength"];
+    [debugDictionary setUnsignedIntegerValue:_runCount forKey:@"runCount"];
+    [debugDictionary setDoubleValue:_parseTime forKey:@"parseTime"];
+    [debugDictionary setDoubleValue:_fontResolutionTime forKey:@"fontResolutionTime"];
+    [debugDictionary setDoubleValue:_buildTime forKey:@"buildTime"];
+    return debugDictionary;
+}
+
+@end
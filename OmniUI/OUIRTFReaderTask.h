@@ -0,0 +1,34 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFObject.h>
+
+typedef void (^OUIRTFReaderProgressHandler)(NSUInteger bytesScanned, NSUInteger totalLength); // The total is zero if it isn't known
+
+/*
+ A parse running in the background, as started by +[OUIRTFReader parseRTFData:options:progress:completion:]. Cancelling it is cooperative: the reader checks every thousand or so tokens, then stops and hands what it has read so far to the completion handler, along with an NSUserCancelledError. All methods may be called from any thread.
+*/
+
+@interface OUIRTFReaderTask : OFObject
+{
+@private
+    volatile int32_t _cancelled;
+    NSUInteger _totalLength;
+    OUIRTFReaderProgressHandler _progressHandler;
+}
+
+- (void)cancel;
+@property (readonly, getter=isCancelled) BOOL cancelled;
+
+// For OUIRTFReader
+- (id)_initWithProgressHandler:(OUIRTFReaderProgressHandler)progressHandler;
+- (void)_setTotalLength:(NSUInteger)totalLength; // Before the parse starts
+- (void)_reportProgress:(NSUInteger)bytesScanned; // On the parsing thread
+
+@end
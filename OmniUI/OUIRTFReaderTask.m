@@ -0,0 +1,56 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFReaderTask.h>
+
+#import <OmniBase/OmniBase.h>
+
+#include <libkern/OSAtomic.h>
+
+RCS_ID("$Id$");
+
+@implementation OUIRTFReaderTask
+
+- (id)_initWithProgressHandler:(OUIRTFReaderProgressHandler)progressHandler;
+{
+    if (!(self = [super init]))
+        return nil;
+
+    _progressHandler = [progressHandler copy];
+
+    return self;
+}
+
+- (void)dealloc;
+{
+    [_progressHandler release];
+    [super dealloc];
+}
+
+- (void)cancel;
+{
+    OSAtomicCompareAndSwap32Barrier(0, 1, &_cancelled);
+}
+
+- (BOOL)isCancelled;
+{
+    OSMemoryBarrier();
+    return _cancelled != 0;
+}
+
+- (void)_setTotalLength:(NSUInteger)totalLength;
+{
+    _totalLength = totalLength;
+}
+
+- (void)_reportProgress:(NSUInteger)bytesScanned;
+{
+    if (_progressHandler != NULL)
+        _progressHandler(_totalLength != 0 ? MIN(bytesScanned, _totalLength) : bytesScanned, _totalLength);
+}
+
+@end
@@ -0,0 +1,81 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+//
+// $Id$
+
+#import <OmniFoundation/OFDataBuffer.h>
+
+@class NSAttributedString, NSDictionary, NSString;
+
+/*
+ Accumulates the reader's output: the characters go into one contiguous UTF-16 buffer, and their attributes into a table of runs, each a length and a retained attribute dictionary. A fragment that has the same attributes as the run before it just lengthens that run, so a document of many tiny fragments (escaped characters, say) doesn't cost an attributed string edit apiece; the attributed string is built in one pass at the end.
+ Appending with nil attributes records no runs at all, which is what plain text extraction does.
+*/
+
+typedef struct {
+    NSUInteger length;
+    NSDictionary *attributes;
+} OUIRTFStringBuilderRun;
+
+typedef struct {
+    OFDataBuffer characters;
+    OUIRTFStringBuilderRun *runs;
+    NSUInteger runCount;
+    NSUInteger runCapacity;
+} OUIRTFStringBuilder;
+
+extern void OUIRTFStringBuilderInit(OUIRTFStringBuilder *builder);
+extern void OUIRTFStringBuilderRelease(OUIRTFStringBuilder *builder);
+
+extern void OUIRTFStringBuilderAppendString(OUIRTFStringBuilder *builder, NSString *string, NSDictionary *attributes);
+extern void OUIRTFStringBuilderTruncate(OUIRTFStringBuilder *builder, NSUInteger length); // Drops the characters (and runs) past length
+
+// Both of these hand off the character buffer and leave the builder empty
+extern NSString *OUIRTFStringBuilderNewString(OUIRTFStringBuilder *builder);
+extern NSAttributedString *OUIRTFStringBuilderNewAttributedString(OUIRTFStringBuilder *builder);
+
+extern void _OUIRTFStringBuilderAddRun(OUIRTFStringBuilder *builder, NSUInteger length, NSDictionary *attributes);
+
+static inline NSUInteger
+OUIRTFStringBuilderGetLength(OUIRTFStringBuilder *builder)
+{
+    return OFDataBufferSpaceOccupied(&builder->characters) / sizeof(unichar);
+}
+
+static inline void
+_OUIRTFStringBuilderNoteAppend(OUIRTFStringBuilder *builder, NSUInteger length, NSDictionary *attributes)
+{
+    if (attributes == nil)
+        return;
+
+    // Readers hand us the same dictionary until their formatting changes, so a pointer compare catches nearly every merge
+    if (builder->runCount != 0 && builder->runs[builder->runCount - 1].attributes == attributes)
+        builder->runs[builder->runCount - 1].length += length;
+    else
+        _OUIRTFStringBuilderAddRun(builder, length, attributes);
+}
+
+static inline void
+OUIRTFStringBuilderAppendCharacters(OUIRTFStringBuilder *builder, const unichar *characters, NSUInteger length, NSDictionary *attributes)
+{
+    if (length == 0)
+        return;
+
+    OFByte *destination = OFDataBufferGetPointer(&builder->characters, sizeof(unichar) * length);
+    memcpy(destination, characters, sizeof(unichar) * length);
+    OFDataBufferDidAppend(&builder->characters, sizeof(unichar) * length);
+    _OUIRTFStringBuilderNoteAppend(builder, length, attributes);
+}
+
+static inline void
+OUIRTFStringBuilderAppendCharacter(OUIRTFStringBuilder *builder, unichar character, NSDictionary *attributes)
+{
+    OFByte *destination = OFDataBufferGetPointer(&builder->characters, sizeof(unichar));
+    memcpy(destination, &character, sizeof(unichar));
+    OFDataBufferDidAppend(&builder->characters, sizeof(unichar));
+    _OUIRTFStringBuilderNoteAppend(builder, 1, attributes);
+}
@@ -0,0 +1,148 @@
+// Copyright 2012 The Omni Group.  All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+#import <OmniUI/OUIRTFStringBuilder.h>
+
+#import <Foundation/NSAttributedString.h>
+#import <Foundation/NSDictionary.h>
+
+RCS_ID("$Id$");
+
+void OUIRTFStringBuilderInit(OUIRTFStringBuilder *builder)
+{
+    OFDataBufferInit(&builder->characters);
+    builder->runs = NULL;
+    builder->runCount = 0;
+    builder->runCapacity = 0;
+}
+
+static void _OUIRTFStringBuilderReleaseRuns(OUIRTFStringBuilder *builder)
+{
+    NSUInteger runIndex;
+    for (runIndex = 0; runIndex < builder->runCount; runIndex++)
+        [builder->runs[runIndex].attributes release];
+    free(builder->runs);
+    builder->runs = NULL;
+    builder->runCount = 0;
+    builder->runCapacity = 0;
+}
+
+void OUIRTFStringBuilderRelease(OUIRTFStringBuilder *builder)
+{
+    OFDataBufferRelease(&builder->characters, NULL, NULL);
+    _OUIRTFStringBuilderReleaseRuns(builder);
+}
+
+void _OUIRTFStringBuilderAddRun(OUIRTFStringBuilder *builder, NSUInteger length, NSDictionary *attributes)
+{
+    OBPRECONDITION(attributes != nil);
+
+    if (builder->runCount != 0) {
+        OUIRTFStringBuilderRun *lastRun = &builder->runs[builder->runCount - 1];
+        // Popping a group rebuilds attributes identical to the ones we had before it was pushed
+        if ([lastRun->attributes isEqualToDictionary:attributes]) {
+            lastRun->length += length;
+            return;
+        }
+    }
+
+    if (builder->runCount == builder->runCapacity) {
+        builder->runCapacity = builder->runCapacity ? 2 * builder->runCapacity : 16;
+        builder->runs = realloc(builder->runs, sizeof(*builder->runs) * builder->runCapacity);
+    }
+
+    OUIRTFStringBuilderRun *run = &builder->runs[builder->runCount++];
+    run->length = length;
+    run->attributes = [attributes retain];
+}
+
+void OUIRTFStringBuilderAppendString(OUIRTFStringBuilder *builder, NSString *string, NSDictionary *attributes)
+{
+    OBPRECONDITION(string != nil);
+
+    CFIndex length = CFStringGetLength((CFStringRef)string);
+    if (length == 0)
+        return;
+
+    OFByte *destination = OFDataBufferGetPointer(&builder->characters, sizeof(unichar) * length);
+    CFStringGetCharacters((CFStringRef)string, CFRangeMake(0, length), (UniChar *)destination);
+    OFDataBufferDidAppend(&builder->characters, sizeof(unichar) * length);
+    _OUIRTFStringBuilderNoteAppend(builder, length, attributes);
+}
+
+void OUIRTFStringBuilderTruncate(OUIRTFStringBuilder *builder, NSUInteger length)
+{
+    NSUInteger oldLength = OUIRTFStringBuilderGetLength(builder);
+    if (length >= oldLength)
+        return;
+    builder->characters.writeStart = builder->characters.buffer + sizeof(unichar) * length;
+
+    // Runs only exist when attributes were given, in which case they cover every character
+    NSUInteger excess = oldLength - length;
+    while (builder->runCount != 0 && excess != 0) {
+        OUIRTFStringBuilderRun *lastRun = &builder->runs[builder->runCount - 1];
+        if (lastRun->length > excess) {
+            lastRun->length -= excess;
+            break;
+        }
+        excess -= lastRun->length;
+        [lastRun->attributes release];
+        builder->runCount--;
+    }
+}
+
+NSString *OUIRTFStringBuilderNewString(OUIRTFStringBuilder *builder)
+{
+    NSUInteger length = OUIRTFStringBuilderGetLength(builder);
+    _OUIRTFStringBuilderReleaseRuns(builder);
+    if (length == 0) {
+        OFDataBufferRelease(&builder->characters, NULL, NULL);
+        return @"";
+    }
+
+    // Hand our malloc'd buffer straight to the string rather than copying it
+    CFStringRef string = CFStringCreateWithCharactersNoCopy(kCFAllocatorDefault, (const UniChar *)builder->characters.buffer, length, kCFAllocatorMalloc);
+    OFDataBufferInit(&builder->characters);
+    return NSMakeCollectable(string);
+}
+
+NSAttributedString *OUIRTFStringBuilderNewAttributedString(OUIRTFStringBuilder *builder)
+{
+#ifdef OMNI_ASSERTIONS_ON
+    NSUInteger runLength = 0, checkIndex;
+    for (checkIndex = 0; checkIndex < builder->runCount; checkIndex++)
+        runLength += builder->runs[checkIndex].length;
+    OBASSERT(runLength == OUIRTFStringBuilderGetLength(builder));
+#endif
+
+    // Take the runs before the string takes (and clears) the rest of the builder
+    OUIRTFStringBuilderRun *runs = builder->runs;
+    NSUInteger runCount = builder->runCount;
+    builder->runs = NULL;
+    builder->runCount = 0;
+    builder->runCapacity = 0;
+
+    NSString *string = OUIRTFStringBuilderNewString(builder);
+
+    CFMutableAttributedStringRef attributedString = CFAttributedStringCreateMutable(kCFAllocatorDefault, 0);
+    CFAttributedStringBeginEditing(attributedString);
+    CFAttributedStringReplaceString(attributedString, CFRangeMake(0, 0), (CFStringRef)string);
+    [string release];
+
+    CFIndex location = 0;
+    NSUInteger runIndex;
+    for (runIndex = 0; runIndex < runCount; runIndex++) {
+        OUIRTFStringBuilderRun *run = &runs[runIndex];
+        CFAttributedStringSetAttributes(attributedString, CFRangeMake(location, run->length), (CFDictionaryRef)run->attributes, true);
+        location += run->length;
+        [run->attributes release];
+    }
+    free(runs);
+
+    CFAttributedStringEndEditing(attributedString);
+    return NSMakeCollectable(attributedString);
+}
@@ -0,0 +1,281 @@
+// Copyright 2012 Omni Development, Inc. All rights reserved.
+//
+// This software may only be used and reproduced according to the
+// terms in the file OmniSourceLicense.html, which should be
+// distributed with this project and can also be found at
+// <http://www.omnigroup.com/developer/sourcecode/sourcelicense/>.
+
+// Converts RTF files, or whole directory trees of them, to plain text, to HTML, or to a property list describing the attributed string. Inputs are memory-mapped and parsed by a pool of worker threads; each file's size, time and throughput are reported as it finishes, followed by totals.
+//
+// Build as a command line tool with the OmniBase, OmniFoundation, OmniAppKit and OmniUI sources from this tree, linking Foundation and CoreText.
+//
+// Usage: rtf2txt [-j workers] [-f text|html|attr] [-o directory] [-n] path ...
+//   -j  number of worker threads (default: one per active processor)
+//   -f  text writes UTF-8 plain text (.txt); html streams UTF-8 HTML straight from the reader's events (.html); attr writes an XML property list of the string and its attribute runs (.plist)
+//   -o  write outputs under this directory, mirroring the input paths; by default they are written beside the inputs
+//   -n  parse only; don't write anything (for measuring)
+// Directories are searched recursively for files ending in .rtf. The exit status is 1 if any file failed.
+
+#import <Foundation/Foundation.h>
+#import <OmniBase/OmniBase.h>
+#import <OmniUI/OUIRTFReader.h>
+#import <OmniUI/OUIRTFHTMLConverter.h>
+
+#include <dispatch/dispatch.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RCS_ID("$Id$")
+
+typedef enum {
+    OutputFormatText,
+    OutputFormatHTML,
+    OutputFormatAttributes,
+} OutputFormat;
+
+static OutputFormat Format = OutputFormatText;
+static NSString *OutputDirectory = nil;
+static BOOL DiscardOutput = NO;
+
+static double _secondsSince(uint64_t start)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom / 1e9;
+}
+
+static void _usage(const char *toolName)
+{
+    fprintf(stderr, "usage: %s [-j workers] [-f text|html|attr] [-o directory] [-n] path ...\n", toolName);
+    exit(2);
+}
+
+static void _addInputsAtPath(NSString *path, NSMutableArray *inputs)
+{
+    BOOL isDirectory = NO;
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path isDirectory:&isDirectory]) {
+        fprintf(stderr, "%s: no such file or directory\n", [path fileSystemRepresentation]);
+        return;
+    }
+    if (!isDirectory) {
+        [inputs addObject:path];
+        return;
+    }
+
+    NSDirectoryEnumerator *enumerator = [[NSFileManager defaultManager] enumeratorAtPath:path];
+    NSString *relativePath;
+    while ((relativePath = [enumerator nextObject]) != nil) {
+        if ([[relativePath pathExtension] caseInsensitiveCompare:@"rtf"] == NSOrderedSame)
+            [inputs addObject:[path stringByAppendingPathComponent:relativePath]];
+    }
+}
+
+// Attribute values are fonts, colors and paragraph styles, none of which go in a property list, so we record their descriptions.
+static NSData *_newAttributesPropertyListData(NSAttributedString *attributedString, NSError **outError)
+{
+    NSMutableArray *runs = [NSMutableArray array];
+    NSUInteger length = [attributedString length];
+    NSUInteger location = 0;
+    while (location < length) {
+        NSRange runRange;
+        NSDictionary *attributes = [attributedString attributesAtIndex:location effectiveRange:&runRange];
+        NSMutableDictionary *describedAttributes = [NSMutableDictionary dictionary];
+        for (NSString *key in attributes)
+            [describedAttributes setObject:[[attributes objectForKey:key] description] forKey:key];
+        [runs addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithUnsignedInteger:runRange.location], @"location",
+            [NSNumber numberWithUnsignedInteger:runRange.length], @"length",
+            describedAttributes, @"attributes",
+            nil]];
+        location = NSMaxRange(runRange);
+    }
+
+    NSDictionary *plist = [NSDictionary dictionaryWithObjectsAndKeys:[attributedString string], @"string", runs, @"runs", nil];
+    return [[NSPropertyListSerialization dataWithPropertyList:plist format:NSPropertyListXMLFormat_v1_0 options:0 error:outError] retain];
+}
+
+static NSString *_outputPathForInputPath(NSString *inputPath)
+{
+    NSString *extension;
+    switch (Format) {
+        case OutputFormatText:
+            extension = @"txt";
+            break;
+        case OutputFormatHTML:
+            extension = @"html";
+            break;
+        default:
+            extension = @"plist";
+            break;
+    }
+    NSString *outputPath = [[inputPath stringByDeletingPathExtension] stringByAppendingPathExtension:extension];
+    if (OutputDirectory != nil) {
+        if ([outputPath isAbsolutePath])
+            outputPath = [outputPath substringFromIndex:1];
+        outputPath = [OutputDirectory stringByAppendingPathComponent:outputPath];
+    }
+    return outputPath;
+}
+
+// Returns the number of input bytes converted, or -1 on failure.
+static off_t _convertFile(NSString *inputPath)
+{
+    int fd = open([inputPath fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", [inputPath fileSystemRepresentation], strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "%s: %s\n", [inputPath fileSystemRepresentation], strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Map the file rather than reading it so that the reader scans the page cache in place
+    void *bytes = NULL;
+    if (info.st_size > 0) {
+        bytes = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes == MAP_FAILED) {
+            fprintf(stderr, "%s: %s\n", [inputPath fileSystemRepresentation], strerror(errno));
+            close(fd);
+            return -1;
+        }
+        madvise(bytes, (size_t)info.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    BOOL success = YES;
+    NSData *rtfData = [[NSData alloc] initWithBytesNoCopy:bytes length:(NSUInteger)info.st_size freeWhenDone:NO];
+    NSData *outputData = nil;
+    NSError *error = nil;
+    if (Format == OutputFormatText) {
+        NSString *text = [OUIRTFReader plainTextFromRTFData:rtfData];
+        if (!DiscardOutput)
+            outputData = [[text dataUsingEncoding:NSUTF8StringEncoding] retain];
+    } else if (Format == OutputFormatHTML) {
+        // The converter writes as it goes, so there's no outputData to save afterwards
+        NSString *outputPath = DiscardOutput ? @"/dev/null" : _outputPathForInputPath(inputPath);
+        NSString *outputDirectory = [outputPath stringByDeletingLastPathComponent];
+        if (!DiscardOutput && [outputDirectory length] > 0)
+            [[NSFileManager defaultManager] createDirectoryAtPath:outputDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+        int outputFD = open([outputPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outputFD < 0) {
+            OBErrorWithErrno(&error, OMNI_ERRNO(), "open", outputPath, @"Unable to create output file.");
+            success = NO;
+        } else {
+            success = [OUIRTFHTMLConverter convertRTFData:rtfData toFileDescriptor:outputFD options:nil error:&error];
+            if (close(outputFD) != 0 && success) {
+                OBErrorWithErrno(&error, OMNI_ERRNO(), "close", outputPath, @"Unable to write output file.");
+                success = NO;
+            }
+        }
+    } else {
+        NSAttributedString *attributedString = [OUIRTFReader parseRTFData:rtfData];
+        if (!DiscardOutput) {
+            outputData = _newAttributesPropertyListData(attributedString, &error);
+            success = (outputData != nil);
+        }
+    }
+    [rtfData release];
+    if (bytes != NULL)
+        munmap(bytes, (size_t)info.st_size);
+
+    if (outputData != nil) {
+        NSString *outputPath = _outputPathForInputPath(inputPath);
+        NSString *outputDirectory = [outputPath stringByDeletingLastPathComponent];
+        if ([outputDirectory length] > 0)
+            [[NSFileManager defaultManager] createDirectoryAtPath:outputDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+        success = [outputData writeToFile:outputPath options:NSDataWritingAtomic error:&error];
+        [outputData release];
+    }
+
+    if (!success) {
+        fprintf(stderr, "%s: %s\n", [inputPath fileSystemRepresentation], [[error localizedDescription] UTF8String]);
+        return -1;
+    }
+    return info.st_size;
+}
+
+int main(int argc, char *argv[])
+{
+    NSUInteger workerCount = 0;
+    int option;
+    while ((option = getopt(argc, argv, "j:f:o:n")) != -1) {
+        switch (option) {
+            case 'j':
+                workerCount = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0)
+                    Format = OutputFormatText;
+                else if (strcmp(optarg, "html") == 0)
+                    Format = OutputFormatHTML;
+                else if (strcmp(optarg, "attr") == 0)
+                    Format = OutputFormatAttributes;
+                else
+                    _usage(argv[0]);
+                break;
+            case 'o':
+                OutputDirectory = [[NSString alloc] initWithUTF8String:optarg];
+                break;
+            case 'n':
+                DiscardOutput = YES;
+                break;
+            default:
+                _usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        _usage(argv[0]);
+
+    __block int32_t failureCount = 0;
+    OMNI_POOL_START {
+        NSMutableArray *inputs = [NSMutableArray array];
+        for (int argumentIndex = optind; argumentIndex < argc; argumentIndex++)
+            _addInputsAtPath([NSString stringWithUTF8String:argv[argumentIndex]], inputs);
+
+        NSUInteger inputCount = [inputs count];
+        if (workerCount == 0)
+            workerCount = [[NSProcessInfo processInfo] activeProcessorCount];
+        workerCount = MAX(1U, MIN(workerCount, inputCount));
+
+        __block int32_t lastClaimedIndex = -1;
+        __block int64_t totalBytes = 0;
+        uint64_t start = mach_absolute_time();
+        dispatch_apply(workerCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t workerIndex) {
+            while (YES) {
+                NSUInteger inputIndex = (NSUInteger)OSAtomicIncrement32Barrier(&lastClaimedIndex);
+                if (inputIndex >= inputCount)
+                    break;
+                OMNI_POOL_START {
+                    NSString *inputPath = [inputs objectAtIndex:inputIndex];
+                    uint64_t fileStart = mach_absolute_time();
+                    off_t byteCount = _convertFile(inputPath);
+                    double seconds = _secondsSince(fileStart);
+                    if (byteCount < 0) {
+                        OSAtomicIncrement32Barrier(&failureCount);
+                    } else {
+                        OSAtomicAdd64Barrier(byteCount, &totalBytes);
+                        printf("%s\t%lld bytes\t%.3f ms\t%.1f MB/s\n", [inputPath fileSystemRepresentation], (long long)byteCount, seconds * 1e3, seconds > 0 ? byteCount / seconds / 1e6 : 0.0);
+                    }
+                } OMNI_POOL_END;
+            }
+        });
+        double seconds = _secondsSince(start);
+
+        NSUInteger convertedCount = inputCount - failureCount;
+        printf("total\t%lu documents\t%lld bytes\t%d failed\t%lu workers\t%.3f s\t%.1f MB/s\t%.1f docs/s\n",
+            (unsigned long)convertedCount, (long long)totalBytes, failureCount, (unsigned long)workerCount, seconds,
+            seconds > 0 ? totalBytes / seconds / 1e6 : 0.0, seconds > 0 ? convertedCount / seconds : 0.0);
+    } OMNI_POOL_END;
+
+    return failureCount > 0 ? 1 : 0;
+}